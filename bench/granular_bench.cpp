@@ -0,0 +1,1463 @@
+// Headless benchmark of the grain renderer.
+//
+// Sweeps the named modes of benchModes() (the BSSRDF shader variant, resolution, light count,
+// the light-map techniques and the number of grain instances of a synthetic pile, see
+// grain_scene.h) over every compatible combination. Every configuration renders the light
+// pre-pass and the shading pass offscreen and reports ms/frame,
+// fragments/s and memory use as JSON, half-resolution configurations also their error
+// against the full-resolution gather and adaptive-gather configurations theirs against the grid.
+//
+// Build with `make bench`. No window is shown, on Linux it runs on llvmpipe e.g.
+//     LOGL_ROOT_PATH=$(pwd) LIBGL_ALWAYS_SOFTWARE=1 xvfb-run ./bin/granular_bench --out bench.json
+// and a later run can be checked against it (exit code 1 if any configuration is slower
+// than the baseline by more than the threshold):
+//     ./bin/granular_bench --baseline bench.json --threshold 0.1
+#define GL_SILENCE_DEPRECATION
+#include "libraries/glad/glad.h"
+#include "libraries/GLFW/glfw3.h"
+#include "shader.h"
+#include "shader_permutations.h"
+#include "model.h"
+#include "grain_scene.h"
+#include "light_space.h"
+#include "light_cascades.h"
+#include "light_list.h"
+#include "grain_medium.h"
+#include "grain_impostor.h"
+#include "grain_transfer.h"
+#include "grain_thickness.h"
+#include "irradiance_cloud.h"
+#include "translucency_cache.h"
+#include "temporal_translucency.h"
+#include "half_res_translucency.h"
+#include "sh_lighting.h"
+#include "profiler.h"
+#include "frame_data.h"
+#include "filesystem.h"
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "libraries/stb_image.h"
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <sys/resource.h>
+
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// size of the light arrays in the shaders (MAX_LIGHTS)
+#define BENCH_MAX_LIGHTS 2
+
+// same scene setup as main.cpp
+glm::vec3 lightDirections[BENCH_MAX_LIGHTS] = {
+        glm::vec3(1.0f,  1.0f, 1.0f),
+        glm::vec3(-1.0f,  -1.0f, -1.6f),
+    };
+glm::vec3 lightRadiances[BENCH_MAX_LIGHTS] = {
+        glm::vec3(20.0f, 20.0f, 20.0f),
+        glm::vec3(10.0f, 10.0f, 10.0f),
+    };
+float radius = 6.5f;
+float fov = 45.0f;
+float nearPlane = 0.5f;
+float farPlane = 20.0f;
+// half size of the box the synthetic grain pile is generated in
+float sceneExtent = 2.0f;
+// bounds of the current pile, the light-space ortho boxes are fitted to it
+Bounds sceneBounds;
+// per-frame uniform blocks, created once the context exists
+StreamBuffer *frameStream = nullptr;
+// the light maps of configurations with more than one cascade, made per configuration
+LightCascades *cascades = nullptr;
+// the lights of light-list configurations, made per configuration
+LightList *lightList = nullptr;
+// the homogenised medium of the pile for LOD configurations, and its ray-march shader
+GrainMedium *medium = nullptr;
+Shader *mediumShader = nullptr;
+// baked impostors of the grain shape for impostor configurations, and their shader
+GrainImpostor *impostor = nullptr;
+Shader *impostorShader = nullptr;
+// grains drawn as geometry, fewer than the configuration's instances with the medium LOD or
+// impostors, and grains drawn as impostors
+unsigned int drawnInstances = 0;
+unsigned int impostorInstances = 0;
+// the grain's baked transfer for PRT configurations
+GrainTransfer *transfer = nullptr;
+// the grain's baked thickness map for thickness-map configurations
+GrainThickness *thicknessMap = nullptr;
+// the pile's irradiance point cloud for point-cloud configurations
+IrradianceCloud *cloud = nullptr;
+// the grain's translucency cache for cache configurations, with the model3 variant that
+// draws it and its dilation shader
+TranslucencyCache *translucencyCache = nullptr;
+Shader *cacheBakeShader = nullptr;
+Shader *cacheDilateShader = nullptr;
+// the previous frames of temporal-reuse configurations
+TemporalTranslucency *temporal = nullptr;
+// the low-resolution subsurface term of half-resolution configurations, the model3 variant
+// that draws it and the full-resolution variant their quality is measured against
+HalfResTranslucency *halfRes = nullptr;
+Shader *lowResShader = nullptr;
+Shader *referenceShader = nullptr;
+// the grid-gather variant adaptive-gather configurations are measured against
+Shader *gridShader = nullptr;
+// the irradiance of the synthetic sky for environment configurations, and the grain's mean
+// chord its transmission crosses
+SHCoefficients *environment = nullptr;
+float environmentThickness = 1.0f;
+
+struct BenchConfig {
+    int variant;
+    int width;
+    int height;
+    int lights;
+    int sampleStep;
+    int instances;
+    // octahedral normal map plus depth texture instead of RGB32F normal and position maps
+    int compact;
+    // light cascades, model3 only (see light_cascades.h)
+    int cascades;
+    // lights from a light list with screen-tiled culling, model3 only (see light_list.h)
+    int lightList;
+    // far grains replaced by the homogenised medium, model3 only (see grain_medium.h)
+    int lod;
+    // back half of the pile as octahedral impostors, model3 only (see grain_impostor.h)
+    int impostors;
+    // precomputed radiance transfer instead of the light maps, model3 only (see grain_transfer.h)
+    int prt;
+    // thickness towards the lights from a baked map instead of the light maps, model2 and
+    // model3 (see grain_thickness.h)
+    int thicknessMap;
+    // dipole from a hierarchical irradiance point cloud, model3 only (see irradiance_cloud.h)
+    int pointCloud;
+    // subsurface term from a texture-space cache drawn once, model3 with a single grain only
+    // (see translucency_cache.h)
+    int translucencyCache;
+    // subsurface term reused from the previous frame where it reprojects, model3 only (see
+    // temporal_translucency.h); the bench camera is still, so this is the steady state
+    int temporal;
+    // subsurface term gathered at half the width and height and upsampled, model3 only (see
+    // half_res_translucency.h)
+    int halfRes;
+    // 0 regular grid, 1 jittered grid, 2 adaptive (coarse grid refined where it varies), the
+    // light-map gather of model3 only
+    int gatherMode;
+    // diffuse reflection and transmission of a synthetic sky through spherical harmonics, on
+    // top of the lights, model3 only (see sh_lighting.h)
+    int environment;
+};
+
+struct BenchResult {
+    BenchConfig config;
+    float msPerFrame;
+    float msP50;
+    float msP95;
+    float lightPassMs;
+    float shadingMs;
+    double fragmentsPerFrame;
+    double fragmentsPerSecond;
+    double rssMB;
+    double gpuMB;
+    // relative RMS difference to the full-resolution gather, half-resolution configurations only
+    double halfResError;
+    // relative RMS difference to the grid gather, adaptive-gather configurations only
+    double gatherError;
+    // false if the frame holds an inf or NaN, checked for medium LOD configurations
+    bool finite;
+};
+
+// one swept dimension of the configurations
+struct BenchMode {
+    // JSON key and command-line option
+    const char *key;
+    const char *option;
+    const char *help;
+    const char *defaults;
+    // the configuration's member this mode sets
+    int BenchConfig::*field;
+    // the swept values, clamped to [minimum, maximum]
+    std::vector<int> values;
+    int minimum;
+    int maximum;
+    // checked when the mode's value is above its minimum, false if that value cannot be
+    // combined with the configuration's other modes (nullptr combines with everything)
+    bool (*compatible)(const BenchConfig &config);
+};
+
+struct Options {
+    std::vector<BenchMode> modes;
+    int warmup;
+    int frames;
+    std::string mesh;
+    std::string out;
+    std::string baseline;
+    float threshold;
+    // check the light list's tile binning instead of benchmarking
+    bool selfTest;
+};
+
+// light-space normal and position maps of one light, sharing a depth buffer. Compact light
+// maps have no position map and a depth texture instead of the depth renderbuffer.
+struct LightMaps {
+    GLuint normalFBO, vertexFBO;
+    GLuint normalTexture, vertexTexture;
+    GLuint depthRBO, depthTexture;
+};
+
+// offscreen targets for one resolution and light-map format
+struct Targets {
+    int width, height;
+    bool compact;
+    GLuint fbo, color, depth;
+    // color only, the medium pass reads depth
+    GLuint mediumFBO;
+    LightMaps lights[BENCH_MAX_LIGHTS];
+    size_t bytes;
+};
+
+std::vector<int> parseList(const std::string &text)
+{
+    std::vector<int> values;
+    std::stringstream stream(text);
+    std::string item;
+    while (std::getline(stream, item, ','))
+        if (!item.empty())
+            values.push_back(atoi(item.c_str()));
+    return values;
+}
+
+// true if the subsurface term comes from somewhere else than model3's light-map gather
+bool replacesGather(const BenchConfig &config)
+{
+    return config.prt || config.thicknessMap || config.pointCloud || config.translucencyCache;
+}
+
+BenchMode benchMode(const char *key, const char *option, const char *help, const char *defaults,
+                    int BenchConfig::*field, int minimum, int maximum,
+                    bool (*compatible)(const BenchConfig &config) = nullptr)
+{
+    BenchMode mode = {key, option, help, defaults, field, std::vector<int>(), minimum, maximum, compatible};
+    return mode;
+}
+
+// the swept modes, the first varies slowest: a pile is generated per instance count and
+// targets are made per resolution and light-map format
+std::vector<BenchMode> benchModes()
+{
+    std::vector<BenchMode> modes;
+    modes.push_back(benchMode("instances", "--instances", "grains in the synthetic pile (up to 1M)", "1,1000",
+                              &BenchConfig::instances, 1, 1000000));
+    modes.push_back(benchMode("width", "--resolutions", "square render and light-map sizes", "512",
+                              &BenchConfig::width, 1, 16384));
+    modes.push_back(benchMode("compact", "--compact", "compact light maps (RG16 normals, depth)", "0,1",
+                              &BenchConfig::compact, 0, 1));
+    modes.push_back(benchMode("lights", "--lights", "number of lights, clamped to the shader arrays without the light list", "2",
+                              &BenchConfig::lights, 1, INT_MAX));
+    modes.push_back(benchMode("light_list", "--light-list", "tiled light list, any light count (model3 only)", "0",
+                              &BenchConfig::lightList, 0, 1,
+                              [](const BenchConfig &c) { return c.variant == 3; }));
+    modes.push_back(benchMode("sample_step", "--sample-steps", "light-map gather step", "35",
+                              &BenchConfig::sampleStep, 1, INT_MAX));
+    // only model3's light-map gather has a mode, measured on its own
+    modes.push_back(benchMode("gather_mode", "--gather-modes", "light-map gather: 0 grid, 1 jittered, 2 adaptive (model3 only)", "0",
+                              &BenchConfig::gatherMode, 0, 2,
+                              [](const BenchConfig &c) { return c.variant == 3 && !replacesGather(c) && !c.temporal && !c.halfRes; }));
+    // the transfer replaces the light maps, it has no cascades or light list
+    modes.push_back(benchMode("prt", "--prt", "precomputed radiance transfer (model3 only)", "0",
+                              &BenchConfig::prt, 0, 1,
+                              [](const BenchConfig &c) { return c.variant == 3 && c.cascades == 1 && !c.lightList; }));
+    // the thickness map reads no light maps, cascades make no difference
+    modes.push_back(benchMode("thickness_map", "--thickness-map", "baked thickness map (model2 and model3)", "0",
+                              &BenchConfig::thicknessMap, 0, 1,
+                              [](const BenchConfig &c) { return c.variant != 1 && !c.prt && c.cascades == 1; }));
+    // the point cloud replaces the light maps and the other transfer modes
+    modes.push_back(benchMode("point_cloud", "--point-cloud", "irradiance point cloud (model3 only)", "0",
+                              &BenchConfig::pointCloud, 0, 1,
+                              [](const BenchConfig &c) {
+                                  return c.variant == 3 && !c.prt && !c.thicknessMap && c.cascades == 1 && !c.lightList;
+                              }));
+    // the cache holds one grain and reads the per-light maps
+    modes.push_back(benchMode("translucency_cache", "--translucency-cache", "texture-space cache (model3, 1 instance)", "0",
+                              &BenchConfig::translucencyCache, 0, 1,
+                              [](const BenchConfig &c) {
+                                  return c.variant == 3 && c.instances == 1 && !c.prt && !c.thicknessMap && !c.pointCloud &&
+                                         c.cascades == 1 && !c.lightList && !c.lod && !c.impostors;
+                              }));
+    // the light list replaces the cascades
+    modes.push_back(benchMode("cascades", "--cascades", "light cascades per light (model3 only)", "1",
+                              &BenchConfig::cascades, 1, INT_MAX,
+                              [](const BenchConfig &c) { return c.variant == 3 && !c.lightList; }));
+    // both replace the far grains
+    modes.push_back(benchMode("lod", "--lod", "far grains as a homogenised medium (model3 only)", "0",
+                              &BenchConfig::lod, 0, 1,
+                              [](const BenchConfig &c) { return c.variant == 3 && !c.impostors; }));
+    modes.push_back(benchMode("impostors", "--impostors", "far grains as baked impostors (model3 only)", "0",
+                              &BenchConfig::impostors, 0, 1,
+                              [](const BenchConfig &c) { return c.variant == 3; }));
+    // temporal reuse skips the light-map gather, the other modes have none and the far grains
+    // are drawn outside its targets
+    modes.push_back(benchMode("temporal", "--temporal", "reuse last frame's subsurface term (model3 only)", "0",
+                              &BenchConfig::temporal, 0, 1,
+                              [](const BenchConfig &c) { return c.variant == 3 && !replacesGather(c) && !c.lod && !c.impostors; }));
+    // so does the half-resolution pass, whose pixels do not match the light list's tiles
+    modes.push_back(benchMode("half_res", "--half-res", "subsurface at half resolution, upsampled (model3 only)", "0",
+                              &BenchConfig::halfRes, 0, 1,
+                              [](const BenchConfig &c) {
+                                  return c.variant == 3 && !replacesGather(c) && !c.lod && !c.impostors && !c.lightList && !c.temporal;
+                              }));
+    // added to whatever the lights use, the low-resolution pass leaves it to the full one
+    modes.push_back(benchMode("environment", "--environment", "spherical harmonics sky lighting (model3 only)", "0",
+                              &BenchConfig::environment, 0, 1,
+                              [](const BenchConfig &c) { return c.variant == 3; }));
+    modes.push_back(benchMode("variant", "--variants", "BSSRDF shaders (src/shaders/modelN.fs)", "3",
+                              &BenchConfig::variant, 1, 3));
+    return modes;
+}
+
+// the values of a mode's option, clamped to its range
+bool parseMode(BenchMode &mode, const std::string &text)
+{
+    mode.values = parseList(text);
+    for (unsigned int i = 0; i < mode.values.size(); i++)
+        mode.values[i] = std::max(mode.minimum, std::min(mode.maximum, mode.values[i]));
+    if (mode.values.empty())
+        std::cerr << "no values for " << mode.option << std::endl;
+    return !mode.values.empty();
+}
+
+void printUsage()
+{
+    std::vector<BenchMode> modes = benchModes();
+    printf("usage: granular_bench [options], lists are comma separated\n");
+    for (unsigned int i = 0; i < modes.size(); i++)
+        printf("  %-22s %s, default %s\n", (std::string(modes[i].option) + " list").c_str(), modes[i].help, modes[i].defaults);
+    printf("  --frames N             measured frames per configuration, default 20\n"
+           "  --warmup N             frames rendered before measuring, default 3\n"
+           "  --mesh path            grain model, default resources/objects/grain_simplified.obj\n"
+           "  --out file.json        write the results to a file instead of stdout\n"
+           "  --baseline file.json   compare against an earlier run\n"
+           "  --threshold 0.1        allowed relative slowdown before failing, default 0.1\n"
+           "  --self-test            check the light list's tile binning and exit\n");
+}
+
+bool parseOptions(int argc, char **argv, Options &options)
+{
+    options.modes = benchModes();
+    for (unsigned int i = 0; i < options.modes.size(); i++)
+        parseMode(options.modes[i], options.modes[i].defaults);
+    options.warmup = 3;
+    options.frames = 20;
+    options.mesh = "resources/objects/grain_simplified.obj";
+    options.threshold = 0.1f;
+    options.selfTest = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--help" || arg == "-h")
+            return false;
+        if (arg == "--self-test")
+        {
+            options.selfTest = true;
+            continue;
+        }
+        if (i + 1 >= argc)
+        {
+            std::cerr << "missing value for " << arg << std::endl;
+            return false;
+        }
+        std::string value = argv[++i];
+        BenchMode *mode = nullptr;
+        for (unsigned int m = 0; m < options.modes.size(); m++)
+            if (arg == options.modes[m].option)
+                mode = &options.modes[m];
+        if (mode)
+        {
+            if (!parseMode(*mode, value))
+                return false;
+        }
+        else if (arg == "--frames") options.frames = atoi(value.c_str());
+        else if (arg == "--warmup") options.warmup = atoi(value.c_str());
+        else if (arg == "--mesh") options.mesh = value;
+        else if (arg == "--out") options.out = value;
+        else if (arg == "--baseline") options.baseline = value;
+        else if (arg == "--threshold") options.threshold = (float)atof(value.c_str());
+        else
+        {
+            std::cerr << "unknown option " << arg << std::endl;
+            return false;
+        }
+    }
+    return options.frames > 0;
+}
+
+bool sameConfig(const std::vector<BenchMode> &modes, const BenchConfig &a, const BenchConfig &b)
+{
+    for (unsigned int i = 0; i < modes.size(); i++)
+        if (a.*modes[i].field != b.*modes[i].field)
+            return false;
+    return true;
+}
+
+// every combination of the modes' values that all their rules allow, in the modes' order
+std::vector<BenchConfig> sweepConfigs(const std::vector<BenchMode> &modes)
+{
+    std::vector<BenchConfig> configs;
+    std::vector<unsigned int> index(modes.size(), 0);
+    for (bool done = modes.empty(); !done; )
+    {
+        BenchConfig config = BenchConfig();
+        for (unsigned int i = 0; i < modes.size(); i++)
+            config.*modes[i].field = modes[i].values[index[i]];
+        config.height = config.width;
+        bool compatible = true;
+        for (unsigned int i = 0; i < modes.size() && compatible; i++)
+            if (config.*modes[i].field > modes[i].minimum && modes[i].compatible)
+                compatible = modes[i].compatible(config);
+        // the light list takes any number of lights
+        int requested = config.lights;
+        if (!config.lightList)
+            config.lights = std::min(config.lights, BENCH_MAX_LIGHTS);
+        // a clamped light count can repeat a configuration
+        for (unsigned int i = 0; i < configs.size() && compatible; i++)
+            compatible = !sameConfig(modes, configs[i], config);
+        if (compatible)
+        {
+            if (config.lights != requested)
+                std::cerr << "light count " << requested << " clamped to " << config.lights << std::endl;
+            configs.push_back(config);
+        }
+
+        // the next combination, the last mode varies fastest
+        int m = (int)modes.size() - 1;
+        while (m >= 0 && ++index[m] == modes[m].values.size())
+            index[m--] = 0;
+        done = m < 0;
+    }
+    return configs;
+}
+
+// true if any configuration sets field, so its resources are baked
+bool anyConfig(const std::vector<BenchConfig> &configs, int BenchConfig::*field)
+{
+    for (unsigned int i = 0; i < configs.size(); i++)
+        if (configs[i].*field)
+            return true;
+    return false;
+}
+
+GLuint createColorTexture(int width, int height)
+{
+    GLuint texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F, width, height, 0, GL_RGB, GL_FLOAT, 0);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    return texture;
+}
+
+// octahedral normals, RG16F where the driver cannot render to RG16_SNORM
+GLuint createNormalTexture(int width, int height)
+{
+    GLuint texture = createColorTexture(width, height);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RG16_SNORM, width, height, 0, GL_RG, GL_FLOAT, 0);
+    GLuint fbo;
+    glGenFramebuffers(1, &fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RG16F, width, height, 0, GL_RG, GL_FLOAT, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteFramebuffers(1, &fbo);
+    return texture;
+}
+
+GLuint createDepthTexture(int width, int height)
+{
+    GLuint texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT32F, width, height, 0, GL_DEPTH_COMPONENT, GL_FLOAT, 0);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    return texture;
+}
+
+// depth is a renderbuffer, or a texture when depthTexture is set
+GLuint createFramebuffer(GLuint color, GLuint depth, GLuint depthTexture = 0)
+{
+    GLuint fbo;
+    glGenFramebuffers(1, &fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, color, 0);
+    if (depthTexture != 0)
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthTexture, 0);
+    else
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        std::cerr << "Framebuffer not complete!" << std::endl;
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    return fbo;
+}
+
+GLuint createDepthBuffer(int width, int height)
+{
+    GLuint rbo;
+    glGenRenderbuffers(1, &rbo);
+    glBindRenderbuffer(GL_RENDERBUFFER, rbo);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT32F, width, height);
+    return rbo;
+}
+
+Targets createTargets(int width, int height, int lights, bool compact)
+{
+    Targets targets;
+    targets.width = width;
+    targets.height = height;
+    targets.compact = compact;
+    size_t texels = (size_t)width * height;
+
+    targets.color = createColorTexture(width, height);
+    targets.depth = createDepthTexture(width, height);
+    targets.fbo = createFramebuffer(targets.color, 0, targets.depth);
+    targets.mediumFBO = createFramebuffer(targets.color, 0);
+    targets.bytes = texels * (12 + 4);
+
+    for (int i = 0; i < lights; i++)
+    {
+        LightMaps &maps = targets.lights[i];
+        if (compact)
+        {
+            maps.depthRBO = 0;
+            maps.depthTexture = createDepthTexture(width, height);
+            maps.normalTexture = createNormalTexture(width, height);
+            maps.vertexTexture = 0;
+            maps.normalFBO = createFramebuffer(maps.normalTexture, 0, maps.depthTexture);
+            maps.vertexFBO = 0;
+            targets.bytes += texels * (4 + 4);
+            continue;
+        }
+        maps.depthTexture = 0;
+        maps.depthRBO = createDepthBuffer(width, height);
+        maps.normalTexture = createColorTexture(width, height);
+        maps.vertexTexture = createColorTexture(width, height);
+        maps.normalFBO = createFramebuffer(maps.normalTexture, maps.depthRBO);
+        maps.vertexFBO = createFramebuffer(maps.vertexTexture, maps.depthRBO);
+        targets.bytes += texels * (12 + 12 + 4);
+    }
+    return targets;
+}
+
+void destroyTargets(Targets &targets, int lights)
+{
+    glDeleteFramebuffers(1, &targets.fbo);
+    glDeleteFramebuffers(1, &targets.mediumFBO);
+    glDeleteTextures(1, &targets.color);
+    glDeleteTextures(1, &targets.depth);
+    for (int i = 0; i < lights; i++)
+    {
+        LightMaps &maps = targets.lights[i];
+        glDeleteFramebuffers(1, &maps.normalFBO);
+        glDeleteFramebuffers(1, &maps.vertexFBO);
+        glDeleteTextures(1, &maps.normalTexture);
+        glDeleteTextures(1, &maps.vertexTexture);
+        glDeleteRenderbuffers(1, &maps.depthRBO);
+        glDeleteTextures(1, &maps.depthTexture);
+    }
+}
+
+glm::mat4 cameraView()
+{
+    return glm::lookAt(glm::vec3(0.0f, 0.0f, radius), glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+}
+
+glm::mat4 lightSpaceMatrix(int light, const BenchConfig &config)
+{
+    return fitLightSpaceMatrix(lightDirections[light], sceneBounds, config.width);
+}
+
+// count lights from a spiral over the hemisphere facing the camera, each reaching one
+// cell of a grid over the pile so the tiles see only some of them
+std::vector<Light> benchLights(int count)
+{
+    std::vector<Light> lights;
+    int columns = (int)std::ceil(std::sqrt((float)count));
+    int rows = (count + columns - 1) / columns;
+    glm::vec3 cell = (sceneBounds.max - sceneBounds.min) / glm::vec3(columns, rows, 1.0f);
+    for (int i = 0; i < count; i++)
+    {
+        float z = 1.0f - (i + 0.5f) / count;
+        float angle = i * 2.39996323f;
+        float r = std::sqrt(1.0f - z * z);
+        Bounds region;
+        region.add(sceneBounds.min + cell * glm::vec3(i % columns, i / columns, 0.0f));
+        region.add(sceneBounds.min + cell * glm::vec3(i % columns + 1, i / columns + 1, 1.0f));
+        lights.push_back(Light(glm::vec3(r * std::cos(angle), r * std::sin(angle), z), glm::vec3(20.0f), region));
+    }
+    return lights;
+}
+
+glm::mat4 cameraProjection(const BenchConfig &config)
+{
+    return glm::perspective(glm::radians(fov), (float)config.width / (float)config.height, nearPlane, farPlane);
+}
+
+void renderLightPass(Shader &shader, Model &model, const BenchConfig &config, GLuint fbo, int light, const char *pass, PassProfiler &profiler)
+{
+    ProfileScope scope(profiler, pass);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    shader.use();
+    shader.setMat4("lightSpaceMatrix", lightSpaceMatrix(light, config));
+    shader.setMat4("model", glm::mat4(1.0f));
+    model.DrawInstanced(shader, drawnInstances);
+}
+
+// binds the light maps and the precomputed data to a translucency shader and streams the
+// frame's light and camera blocks
+void setShadingInputs(Shader &shader, const BenchConfig &config, Targets &targets)
+{
+    shader.use();
+
+    glm::mat4 lightSpaceMatrices[BENCH_MAX_LIGHTS];
+    // the light list has its own maps, the MAX_LIGHTS arrays only need to be valid
+    int fixedLights = std::min(config.lights, BENCH_MAX_LIGHTS);
+    for (int i = 0; i < fixedLights; i++)
+    {
+        glActiveTexture(GL_TEXTURE0 + i);
+        glBindTexture(GL_TEXTURE_2D, targets.compact ? targets.lights[i].depthTexture : targets.lights[i].vertexTexture);
+        shader.setInt((targets.compact ? "depthTextures[" : "vertexTextures[") + std::to_string(i) + "]", i);
+        glActiveTexture(GL_TEXTURE0 + i + BENCH_MAX_LIGHTS);
+        glBindTexture(GL_TEXTURE_2D, targets.lights[i].normalTexture);
+        shader.setInt("normalTextures[" + std::to_string(i) + "]", i + BENCH_MAX_LIGHTS);
+        lightSpaceMatrices[i] = lightSpaceMatrix(i, config);
+    }
+    streamLights(*frameStream, fixedLights, lightSpaceMatrices, lightDirections, lightRadiances);
+    shader.setInt("lightNormalMaps", LIGHT_NORMAL_ARRAY_UNIT);
+    shader.setInt("lightDepthMaps", LIGHT_DEPTH_ARRAY_UNIT);
+    if (cascades)
+    {
+        cascades->bindTextures();
+        cascades->stream(*frameStream);
+    }
+    if (lightList)
+    {
+        lightList->bindTextures();
+        shader.setInt("lightList", LIGHT_LIST_UNIT);
+        shader.setInt("lightTiles", LIGHT_TILES_UNIT);
+    }
+    if (medium)
+        shader.setVec2("lodRange", medium->lodRange);
+    if (transfer)
+        transfer->bind(shader);
+    if (thicknessMap)
+        thicknessMap->bind(shader);
+    if (cloud)
+        cloud->bind(shader);
+    if (translucencyCache)
+        translucencyCache->bind(shader);
+    if (halfRes)
+        halfRes->bind(shader);
+    if (environment)
+    {
+        for (int i = 0; i < SH_COEFFICIENTS; i++)
+            shader.setVec3("shIrradiance[" + std::to_string(i) + "]", environment->c[i]);
+        shader.setFloat("grainThickness", environmentThickness);
+    }
+
+    CameraBlock camera;
+    camera.eyePos = glm::vec3(0.0f, 0.0f, radius);
+    camera.projection = cameraProjection(config);
+    camera.view = cameraView();
+    camera.nearPlane = nearPlane;
+    camera.resolution = glm::vec2(config.width, config.height);
+    camera.farPlane = farPlane;
+    camera.padding = 0.0f;
+    streamCamera(*frameStream, camera);
+    shader.setMat4("model", glm::mat4(1.0f));
+}
+
+void renderShadingPass(Shader &shader, Model &model, const BenchConfig &config, Targets &targets, GLuint samplesQuery, PassProfiler &profiler)
+{
+    ProfileScope scope(profiler, "shading pass");
+    glBindFramebuffer(GL_FRAMEBUFFER, targets.fbo);
+    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    setShadingInputs(shader, config, targets);
+    if (temporal)
+        temporal->begin(shader, config.width, config.height);
+
+    glBeginQuery(GL_SAMPLES_PASSED, samplesQuery);
+    if (translucencyCache)
+        translucencyCache->DrawInstanced(shader);
+    else
+        model.DrawInstanced(shader, drawnInstances);
+    glEndQuery(GL_SAMPLES_PASSED);
+    if (temporal)
+        temporal->end(cameraView(), cameraProjection(config), targets.fbo);
+}
+
+void renderFrame(Shader &shader, Shader &normalShader, Shader &vertexShader, Model &model, const BenchConfig &config, Targets &targets,
+                 GLuint samplesQuery, PassProfiler &profiler)
+{
+    frameStream->beginFrame();
+    glViewport(0, 0, config.width, config.height);
+    glEnable(GL_DEPTH_TEST);
+    glDepthFunc(GL_LESS);
+    glEnable(GL_CULL_FACE);
+    glCullFace(GL_BACK);
+    if (cascades)
+    {
+        cascades->fit(cameraView(), fov, (float)config.width / (float)config.height, nearPlane, farPlane, sceneBounds, lightDirections);
+        cascades->render(normalShader, [&model](Shader &shader) { model.DrawInstanced(shader, drawnInstances); }, profiler);
+    }
+    if (lightList)
+    {
+        lightList->render(normalShader, [&model](Shader &shader) { model.DrawInstanced(shader, drawnInstances); }, sceneBounds, profiler);
+        lightList->assign(cameraView(), cameraProjection(config), config.width, config.height);
+    }
+    // the transfer, the thickness map and the point cloud need no light maps, the cache only
+    // until it is drawn
+    bool cached = translucencyCache && translucencyCache->current();
+    for (int i = 0; !cascades && !lightList && !transfer && !thicknessMap && !cloud && !cached && i < config.lights; i++)
+    {
+        renderLightPass(normalShader, model, config, targets.lights[i].normalFBO, i, "normal pre-pass", profiler);
+        if (!targets.compact)
+            renderLightPass(vertexShader, model, config, targets.lights[i].vertexFBO, i, "vertex pre-pass", profiler);
+    }
+    if (translucencyCache && !cached)
+    {
+        setShadingInputs(*cacheBakeShader, config, targets);
+        translucencyCache->render(*cacheBakeShader, *cacheDilateShader, profiler);
+        glViewport(0, 0, config.width, config.height);
+        glEnable(GL_CULL_FACE);
+    }
+    if (halfRes)
+    {
+        setShadingInputs(*lowResShader, config, targets);
+        halfRes->render(*lowResShader, [&model](Shader &shader) { model.DrawInstanced(shader, drawnInstances); }, config.width, config.height, profiler);
+    }
+    renderShadingPass(shader, model, config, targets, samplesQuery, profiler);
+    if (impostor)
+    {
+        ProfileScope scope(profiler, "impostor pass");
+        glBindFramebuffer(GL_FRAMEBUFFER, targets.fbo);
+        impostor->DrawInstanced(*impostorShader, impostorInstances);
+    }
+    if (medium)
+    {
+        ProfileScope scope(profiler, "medium pass");
+        glBindFramebuffer(GL_FRAMEBUFFER, targets.mediumFBO);
+        medium->render(*mediumShader, targets.depth, cameraProjection(config) * cameraView());
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    frameStream->endFrame();
+}
+
+void uploadInstances(GLuint buffer, const std::vector<glm::mat4> &transforms)
+{
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    glBufferData(GL_ARRAY_BUFFER, transforms.size() * sizeof(glm::mat4), transforms.empty() ? NULL : &transforms[0], GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+// irradiance of a sky brightening from a dark ground to a blue zenith, through a small
+// lat-long map so it takes the same projection as main.cpp's environment map
+SHCoefficients skyIrradiance()
+{
+    const int width = 64, height = 32;
+    std::vector<float> pixels(width * height * 3);
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++)
+        {
+            float up = latLongDirection((x + 0.5f) / width, (y + 0.5f) / height).y;
+            glm::vec3 color = up > 0.0f ? glm::mix(glm::vec3(0.8f), glm::vec3(0.3f, 0.5f, 1.0f), up) : glm::vec3(0.1f, 0.08f, 0.06f);
+            for (int c = 0; c < 3; c++)
+                pixels[(y * width + x) * 3 + c] = color[c];
+        }
+    return irradianceSH(projectLatLong(pixels.data(), width, height, 3));
+}
+
+// bakes the impostors of the grain with model3, one unit light at a time with its own
+// compact light map; the grain is drawn as instance 0 of instanceBuffer
+void bakeImpostor(GrainImpostor &grainImpostor, Model &model, float grainRadius, Shader &normalShader, GLuint instanceBuffer)
+{
+    const int mapSize = 128;
+    GLuint depthTexture = createDepthTexture(mapSize, mapSize);
+    GLuint normalTexture = createNormalTexture(mapSize, mapSize);
+    GLuint fbo = createFramebuffer(normalTexture, 0, depthTexture);
+    uploadInstances(instanceBuffer, std::vector<glm::mat4>(1, glm::mat4(1.0f)));
+    Bounds grain = modelBounds(model);
+
+    // offline, so a dense gather, of the one light the impostor is baked for
+    ShaderPermutations translucency(FileSystem::getPath("src/shaders/vertexShaderInstanced.vs"), FileSystem::getPath("src/shaders/model3.fs"));
+    ShaderDefines defines;
+    defines["MAX_LIGHTS"] = "1";
+    defines["SAMPLE_STEP"] = "4";
+    defines["COMPACT_LIGHT_MAPS"] = "1";
+    Shader &shader = translucency.get(defines);
+    Shader geometryShader(FileSystem::getPath("src/shaders/vertexShader2.vs").c_str(), FileSystem::getPath("src/shaders/impostorBake.fs").c_str());
+
+    glm::vec3 lightDirection;
+    glm::mat4 lightMatrix;
+    ImpostorShading shading;
+    shading.prepareLight = [&](const glm::vec3 &direction) {
+        lightDirection = direction;
+        lightMatrix = fitLightSpaceMatrix(direction, grain, mapSize);
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+        glViewport(0, 0, mapSize, mapSize);
+        glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        normalShader.use();
+        normalShader.setMat4("lightSpaceMatrix", lightMatrix);
+        normalShader.setMat4("model", glm::mat4(1.0f));
+        model.DrawInstanced(normalShader, 1);
+    };
+    shading.drawShaded = [&](const glm::mat4 &view, const glm::mat4 &projection, const glm::vec3 &eye) {
+        frameStream->beginFrame();
+        shader.use();
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, depthTexture);
+        shader.setInt("depthTextures[0]", 0);
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D, normalTexture);
+        shader.setInt("normalTextures[0]", 1);
+        glm::vec3 radiance(1.0f);
+        streamLights(*frameStream, 1, &lightMatrix, &lightDirection, &radiance);
+        CameraBlock camera;
+        camera.projection = projection;
+        camera.view = view;
+        camera.eyePos = eye;
+        camera.nearPlane = nearPlane;
+        camera.resolution = glm::vec2(mapSize, mapSize);
+        camera.farPlane = farPlane;
+        camera.padding = 0.0f;
+        streamCamera(*frameStream, camera);
+        shader.setMat4("model", glm::mat4(1.0f));
+        model.DrawInstanced(shader, 1);
+        frameStream->endFrame();
+    };
+    grainImpostor.bake(model, grainRadius, geometryShader, shading);
+
+    glDeleteFramebuffers(1, &fbo);
+    glDeleteTextures(1, &depthTexture);
+    glDeleteTextures(1, &normalTexture);
+}
+
+// peak resident set size in MB
+double peakRSS()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / (1024.0 * 1024.0);
+#else
+    return usage.ru_maxrss / 1024.0;
+#endif
+}
+
+// the RGB colour of the last frame rendered into targets
+std::vector<float> readColor(const Targets &targets)
+{
+    std::vector<float> pixels((size_t)targets.width * targets.height * 3);
+    glBindTexture(GL_TEXTURE_2D, targets.color);
+    glGetTexImage(GL_TEXTURE_2D, 0, GL_RGB, GL_FLOAT, &pixels[0]);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    return pixels;
+}
+
+// RMS difference of image to reference relative to the RMS of reference
+double relativeError(const std::vector<float> &image, const std::vector<float> &reference)
+{
+    double difference = 0.0, energy = 0.0;
+    for (size_t i = 0; i < image.size() && i < reference.size(); i++)
+    {
+        difference += (double)(image[i] - reference[i]) * (image[i] - reference[i]);
+        energy += (double)reference[i] * reference[i];
+    }
+    return energy > 0.0 ? std::sqrt(difference / energy) : 0.0;
+}
+
+size_t meshBytes(const Model &model)
+{
+    size_t bytes = 0;
+    for (unsigned int i = 0; i < model.meshes.size(); i++)
+        bytes += model.meshes[i].vertices.size() * sizeof(Vertex) + model.meshes[i].indices.size() * sizeof(unsigned int);
+    return bytes;
+}
+
+BenchResult runConfig(Shader &shader, Shader &normalShader, Shader &vertexShader, Model &model, const BenchConfig &config, Targets &targets,
+                      const Options &options)
+{
+    GLuint samplesQuery;
+    glGenQueries(1, &samplesQuery);
+    LightCascades configCascades(config.lights, config.cascades, config.width);
+    cascades = configCascades.enabled() ? &configCascades : nullptr;
+    LightList configLightList(config.width);
+    if (config.lightList)
+        configLightList.lights = benchLights(config.lights);
+    lightList = config.lightList ? &configLightList : nullptr;
+    // drawn by the first warmup frame, the measured frames only read it
+    if (translucencyCache)
+        translucencyCache->invalidate();
+    // the warmup frames fill the history
+    if (temporal)
+        temporal->invalidate();
+
+    PassProfiler warmupProfiler;
+    for (int i = 0; i < options.warmup; i++)
+        renderFrame(shader, normalShader, vertexShader, model, config, targets, samplesQuery, warmupProfiler);
+    glFinish();
+    warmupProfiler.cleanup();
+
+    PassProfiler profiler;
+    TimingHistory frameTimes;
+    double fragments = 0.0;
+    for (int i = 0; i < options.frames; i++)
+    {
+        std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+        profiler.beginFrame();
+        renderFrame(shader, normalShader, vertexShader, model, config, targets, samplesQuery, profiler);
+        glFinish();
+        std::chrono::duration<float, std::milli> elapsed = std::chrono::high_resolution_clock::now() - start;
+        frameTimes.push(elapsed.count());
+
+        GLuint64 samples = 0;
+        glGetQueryObjectui64v(samplesQuery, GL_QUERY_RESULT, &samples);
+        fragments += (double)samples;
+    }
+    // collect the timer queries of the last frames in flight
+    for (int i = 0; i < PROFILER_FRAMES_IN_FLIGHT; i++)
+        profiler.beginFrame();
+
+    BenchResult result;
+    result.config = config;
+    result.finite = true;
+    if (medium)
+    {
+        // the medium composites over every pixel, a bad extinction spreads to the whole frame
+        std::vector<float> color = readColor(targets);
+        for (size_t i = 0; i < color.size() && result.finite; i++)
+            result.finite = std::isfinite(color[i]);
+    }
+    result.halfResError = 0.0;
+    if (halfRes)
+    {
+        // the same frame with the full-resolution gather
+        std::vector<float> upsampled = readColor(targets);
+        HalfResTranslucency *configHalfRes = halfRes;
+        halfRes = nullptr;
+        PassProfiler referenceProfiler;
+        renderFrame(*referenceShader, normalShader, vertexShader, model, config, targets, samplesQuery, referenceProfiler);
+        glFinish();
+        referenceProfiler.cleanup();
+        halfRes = configHalfRes;
+        result.halfResError = relativeError(upsampled, readColor(targets));
+    }
+    result.gatherError = 0.0;
+    if (gridShader)
+    {
+        // the same frame with the grid gather
+        std::vector<float> adaptive = readColor(targets);
+        PassProfiler referenceProfiler;
+        renderFrame(*gridShader, normalShader, vertexShader, model, config, targets, samplesQuery, referenceProfiler);
+        glFinish();
+        referenceProfiler.cleanup();
+        result.gatherError = relativeError(adaptive, readColor(targets));
+    }
+    PassStats frame = frameTimes.stats();
+    result.msPerFrame = frame.avg;
+    result.msP50 = frame.p50;
+    result.msP95 = frame.p95;
+    result.lightPassMs = profiler.gpuStats("normal pre-pass").avg + profiler.gpuStats("vertex pre-pass").avg + profiler.gpuStats("cascade pre-pass").avg +
+                         profiler.gpuStats("light list pre-pass").avg + profiler.gpuStats("translucency cache").avg;
+    result.shadingMs = profiler.gpuStats("shading pass").avg + profiler.gpuStats("medium pass").avg +
+                      profiler.gpuStats("impostor pass").avg + profiler.gpuStats("half-res subsurface pass").avg;
+    result.fragmentsPerFrame = fragments / options.frames;
+    // fall back to the frame time if the driver has no timer queries
+    float shadingSeconds = (result.shadingMs > 0.0f ? result.shadingMs : result.msPerFrame) / 1000.0f;
+    result.fragmentsPerSecond = result.fragmentsPerFrame / shadingSeconds;
+    result.rssMB = peakRSS();
+    result.gpuMB = (targets.bytes + configCascades.bytes() + configLightList.bytes() + (medium ? medium->bytes() : 0) + (impostor ? impostor->bytes() : 0) +
+                    (transfer ? transfer->bytes() : 0) + (thicknessMap ? thicknessMap->bytes() : 0) +
+                    (cloud ? cloud->bytes() : 0) + (translucencyCache ? translucencyCache->bytes() : 0) +
+                    (temporal ? temporal->bytes() : 0) + (halfRes ? halfRes->bytes() : 0) + meshBytes(model) +
+                    (size_t)(drawnInstances + impostorInstances) * sizeof(glm::mat4)) / (1024.0 * 1024.0);
+
+    profiler.cleanup();
+    glDeleteQueries(1, &samplesQuery);
+    configCascades.cleanup();
+    configLightList.cleanup();
+    cascades = nullptr;
+    lightList = nullptr;
+    return result;
+}
+
+std::string resultToJSON(const std::vector<BenchMode> &modes, const BenchResult &r)
+{
+    std::string json = "{";
+    char value[512];
+    for (unsigned int i = 0; i < modes.size(); i++)
+    {
+        snprintf(value, sizeof(value), "\"%s\":%d,", modes[i].key, r.config.*modes[i].field);
+        json += value;
+        // the resolution is square
+        if (modes[i].field == &BenchConfig::width)
+        {
+            snprintf(value, sizeof(value), "\"height\":%d,", r.config.height);
+            json += value;
+        }
+    }
+    snprintf(value, sizeof(value),
+             "\"ms_per_frame\":%.4f,\"ms_p50\":%.4f,\"ms_p95\":%.4f,\"light_pass_gpu_ms\":%.4f,\"shading_gpu_ms\":%.4f,"
+             "\"fragments_per_frame\":%.0f,\"fragments_per_second\":%.0f,\"rss_mb\":%.2f,\"gpu_mb_estimate\":%.2f,"
+             "\"half_res_error\":%.5f,\"gather_error\":%.5f}",
+             r.msPerFrame, r.msP50, r.msP95, r.lightPassMs, r.shadingMs,
+             r.fragmentsPerFrame, r.fragmentsPerSecond, r.rssMB, r.gpuMB, r.halfResError, r.gatherError);
+    return json + value;
+}
+
+std::string escapeJSON(const char *text)
+{
+    std::string escaped;
+    for (; text && *text; text++)
+    {
+        if (*text == '"' || *text == '\\')
+            escaped += '\\';
+        escaped += *text;
+    }
+    return escaped;
+}
+
+bool findNumber(const std::string &line, const char *key, double &value)
+{
+    std::string pattern = std::string("\"") + key + "\":";
+    size_t pos = line.find(pattern);
+    if (pos == std::string::npos)
+        return false;
+    value = strtod(line.c_str() + pos + pattern.size(), nullptr);
+    return true;
+}
+
+// results are written one per line, so a baseline written by this tool is read back line by line
+std::vector<BenchResult> readBaseline(const std::vector<BenchMode> &modes, const std::string &path)
+{
+    std::vector<BenchResult> results;
+    std::ifstream file(path.c_str());
+    if (!file)
+    {
+        std::cerr << "could not read baseline " << path << std::endl;
+        return results;
+    }
+    std::string line;
+    while (std::getline(file, line))
+    {
+        double ms;
+        if (!findNumber(line, "ms_per_frame", ms))
+            continue;
+        BenchResult result = BenchResult();
+        for (unsigned int i = 0; i < modes.size(); i++)
+        {
+            // baselines from before a mode was added ran without it
+            double value = modes[i].minimum;
+            findNumber(line, modes[i].key, value);
+            result.config.*modes[i].field = (int)value;
+        }
+        result.config.height = result.config.width;
+        result.msPerFrame = (float)ms;
+        results.push_back(result);
+    }
+    return results;
+}
+
+// the modes' values as key=value pairs
+std::string describeConfig(const std::vector<BenchMode> &modes, const BenchConfig &config)
+{
+    std::string text;
+    for (unsigned int i = 0; i < modes.size(); i++)
+        text += (i > 0 ? " " : "") + std::string(modes[i].key) + "=" + std::to_string(config.*modes[i].field);
+    return text;
+}
+
+// returns false if any configuration regressed past the threshold
+bool compareWithBaseline(const std::vector<BenchMode> &modes, const std::vector<BenchResult> &results,
+                         const std::vector<BenchResult> &baseline, float threshold)
+{
+    bool passed = true;
+    for (unsigned int i = 0; i < results.size(); i++)
+    {
+        const BenchResult &current = results[i];
+        for (unsigned int j = 0; j < baseline.size(); j++)
+        {
+            if (!sameConfig(modes, current.config, baseline[j].config) || baseline[j].msPerFrame <= 0.0f)
+                continue;
+            float change = current.msPerFrame / baseline[j].msPerFrame - 1.0f;
+            bool regressed = change > threshold;
+            fprintf(stderr, "%s %s: %.3f -> %.3f ms (%+.1f%%)\n", regressed ? "REGRESSION" : "ok        ",
+                    describeConfig(modes, current.config).c_str(), baseline[j].msPerFrame, current.msPerFrame, change * 100.0f);
+            if (regressed)
+                passed = false;
+        }
+    }
+    return passed;
+}
+
+// checks that a light reaching a pixel is listed in the tile model3 reads for it, on a screen
+// that is not a whole number of tiles wide; false after printing the first miss
+bool checkLightBinning()
+{
+    const unsigned int width = 615, height = 615;
+    ShaderDefines octahedralDefines;
+    octahedralDefines["OCTAHEDRAL_NORMALS"] = "1";
+    Shader octahedralNormalShader(FileSystem::getPath("src/shaders/vertexShader2Instanced.vs").c_str(),
+                                  FileSystem::getPath("src/shaders/FBOfragmentShader2.fs").c_str(), nullptr, octahedralDefines);
+    // a light per probed pixel (p, p) whose region covers little more than that pixel, seen
+    // through an identity view-projection
+    LightList binning(16);
+    Bounds scene;
+    scene.add(glm::vec3(-1.0f));
+    scene.add(glm::vec3(1.0f));
+    std::vector<unsigned int> pixels;
+    for (unsigned int p = 0; p < width; p += 7)
+    {
+        glm::vec2 ndc = (glm::vec2((float)p) + 0.5f) / glm::vec2(width, height) * 2.0f - 1.0f;
+        Bounds region;
+        region.add(glm::vec3(ndc - 0.1f / width, 0.0f));
+        region.add(glm::vec3(ndc + 0.1f / width, 0.0f));
+        binning.lights.push_back(Light(glm::vec3(0.0f, 0.0f, 1.0f), glm::vec3(1.0f), region));
+        pixels.push_back(p);
+    }
+    PassProfiler profiler;
+    binning.render(octahedralNormalShader, [](Shader &) {}, scene, profiler);
+    binning.assign(glm::mat4(1.0f), glm::mat4(1.0f), width, height);
+    bool passed = true;
+    for (unsigned int i = 0; i < pixels.size() && passed; i++)
+    {
+        std::vector<int> listed = binning.pixelLights(pixels[i], pixels[i]);
+        passed = std::find(listed.begin(), listed.end(), (int)i) != listed.end();
+        if (!passed)
+            fprintf(stderr, "light binning: the light of pixel %u of a %u wide screen is not in its tile of %u pixels\n",
+                    pixels[i], width, binning.tileSize);
+    }
+    profiler.cleanup();
+    binning.cleanup();
+    return passed;
+}
+
+int main(int argc, char **argv)
+{
+    Options options;
+    if (!parseOptions(argc, argv, options))
+    {
+        printUsage();
+        return 2;
+    }
+
+    if (!glfwInit())
+        return 2;
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 1);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    #ifdef __APPLE__
+    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+    #endif
+    // everything is rendered offscreen
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    GLFWwindow* window = glfwCreateWindow(64, 64, "granular_bench", NULL, NULL);
+    if (!window)
+    {
+        std::cerr << "Failed to create an OpenGL 4.1 context" << std::endl;
+        glfwTerminate();
+        return 2;
+    }
+    glfwMakeContextCurrent(window);
+    if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress))
+    {
+        std::cerr << "Failed to initialize GLAD" << std::endl;
+        return 2;
+    }
+    std::string renderer = escapeJSON((const char *)glGetString(GL_RENDERER));
+    std::string version = escapeJSON((const char *)glGetString(GL_VERSION));
+    std::cerr << "granular_bench on " << renderer << " (" << version << ")" << std::endl;
+    if (options.selfTest)
+    {
+        bool passed = checkLightBinning();
+        std::cerr << "light binning " << (passed ? "ok" : "FAILED") << std::endl;
+        glfwTerminate();
+        return passed ? 0 : 1;
+    }
+
+    Model model(FileSystem::getPath(options.mesh));
+    if (model.meshes.empty())
+    {
+        std::cerr << "could not load " << options.mesh << std::endl;
+        return 2;
+    }
+    float grainRadius = modelBoundingRadius(model);
+    Bounds grainBounds = modelBounds(model);
+
+    std::vector<BenchConfig> configs = sweepConfigs(options.modes);
+    // light count and sample step are baked into the shading variants
+    std::map<int, ShaderPermutations> shaders;
+    for (unsigned int i = 0; i < configs.size(); i++)
+    {
+        std::string fragment = "src/shaders/model" + std::to_string(configs[i].variant) + ".fs";
+        if (!shaders.count(configs[i].variant))
+            shaders.insert(std::make_pair(configs[i].variant, ShaderPermutations(FileSystem::getPath("src/shaders/vertexShaderInstanced.vs"),
+                                                                                 FileSystem::getPath(fragment))));
+    }
+    Shader normalShader(FileSystem::getPath("src/shaders/vertexShader2Instanced.vs").c_str(), FileSystem::getPath("src/shaders/FBOfragmentShader2.fs").c_str());
+    ShaderDefines octahedralDefines;
+    octahedralDefines["OCTAHEDRAL_NORMALS"] = "1";
+    Shader octahedralNormalShader(FileSystem::getPath("src/shaders/vertexShader2Instanced.vs").c_str(),
+                                  FileSystem::getPath("src/shaders/FBOfragmentShader2.fs").c_str(), nullptr, octahedralDefines);
+    Shader vertexShader(FileSystem::getPath("src/shaders/vertexShader2Instanced.vs").c_str(), FileSystem::getPath("src/shaders/FBOfragmentShader3.fs").c_str());
+    ShaderPermutations mediumShaders(FileSystem::getPath("src/shaders/medium.vs"), FileSystem::getPath("src/shaders/medium.fs"));
+    float grainVolume = modelVolume(model);
+    // the material defaults of model3.fs
+    std::vector<glm::vec3> grainAlbedos(1, grainAlbedo(glm::vec3(0.8f), glm::vec3(0.2f)));
+
+    StreamBuffer stream(64 * 1024);
+    frameStream = &stream;
+
+    GLuint instanceBuffer;
+    glGenBuffers(1, &instanceBuffer);
+    model.setInstanceBuffer(instanceBuffer);
+
+    // the impostors are baked once, the far grains of each pile go to their own buffer
+    GrainImpostor grainImpostor;
+    ShaderPermutations impostorShaders(FileSystem::getPath("src/shaders/impostor.vs"), FileSystem::getPath("src/shaders/impostor.fs"));
+    GLuint impostorBuffer;
+    glGenBuffers(1, &impostorBuffer);
+    if (anyConfig(configs, &BenchConfig::impostors))
+    {
+        bakeImpostor(grainImpostor, model, grainRadius, octahedralNormalShader, instanceBuffer);
+        grainImpostor.setInstanceBuffer(impostorBuffer);
+    }
+    // the transfer is baked once for the grain shape and shared by every pile
+    GrainTransfer grainTransfer;
+    if (anyConfig(configs, &BenchConfig::prt))
+    {
+        grainTransfer.bake(model, GrainMaterial());
+        grainTransfer.upload(model);
+    }
+    GrainThickness grainThickness;
+    if (anyConfig(configs, &BenchConfig::thicknessMap))
+    {
+        grainThickness.bake(model);
+        grainThickness.upload(model);
+    }
+    SHCoefficients sky = skyIrradiance();
+    environmentThickness = meanChord(model);
+    // the point cloud's samples of the grain, the cloud is built per pile and light count
+    MeshRayCaster grainCaster(model);
+    std::vector<SurfacePoint> grainPoints;
+    if (anyConfig(configs, &BenchConfig::pointCloud))
+        grainPoints = poissonSurfacePoints(model, 256);
+    // the history of temporal-reuse configurations, sized on first use
+    TemporalTranslucency temporalHistory;
+    // the low-resolution buffer of half-resolution configurations, sized on first use
+    HalfResTranslucency halfResSubsurface;
+    // the cache's atlas of the grain, drawn per configuration
+    TranslucencyCache grainCache;
+    Shader dilateShader(FileSystem::getPath("src/shaders/fullscreen.vs").c_str(), FileSystem::getPath("src/shaders/cacheDilate.fs").c_str());
+    if (anyConfig(configs, &BenchConfig::translucencyCache))
+    {
+        grainCache.build(model);
+        grainCache.setInstanceBuffer(instanceBuffer);
+    }
+
+    std::vector<BenchResult> results;
+    // set if a configuration rendered an invalid frame
+    bool invalid = false;
+    // the pile, made again when the instance count changes
+    std::vector<glm::mat4> transforms, nearTransforms, frontTransforms, backTransforms;
+    GrainMedium sceneMedium;
+    // made again when the resolution or light-map format changes
+    Targets targets = Targets();
+    for (unsigned int i = 0; i < configs.size(); i++)
+    {
+        const BenchConfig &config = configs[i];
+        const BenchConfig *previous = i > 0 ? &configs[i - 1] : nullptr;
+        if (!previous || previous->instances != config.instances)
+        {
+            transforms = generateGrainScene(config.instances, sceneExtent, grainRadius);
+            sceneBounds = instanceBounds(grainBounds, transforms);
+            uploadInstances(instanceBuffer, transforms);
+            // the front half of the pile stays geometry
+            sceneMedium.lodRange = glm::vec2(radius - 0.5f * sceneExtent, radius);
+            nearTransforms.clear();
+            if (anyConfig(configs, &BenchConfig::lod))
+            {
+                sceneMedium.build(transforms, grainVolume, grainRadius, grainAlbedos, sceneBounds);
+                nearTransforms = sceneMedium.nearInstances(transforms, glm::vec3(0.0f, 0.0f, radius));
+            }
+            // the impostors take the grains behind the pile's centre
+            frontTransforms.clear();
+            backTransforms.clear();
+            for (unsigned int j = 0; grainImpostor.baked() && j < transforms.size(); j++)
+                (transforms[j][3].z >= 0.0f ? frontTransforms : backTransforms).push_back(transforms[j]);
+            uploadInstances(impostorBuffer, backTransforms);
+        }
+        if (!previous || previous->width != config.width || previous->compact != config.compact)
+        {
+            if (previous)
+                destroyTargets(targets, BENCH_MAX_LIGHTS);
+            targets = createTargets(config.width, config.height, BENCH_MAX_LIGHTS, config.compact != 0);
+        }
+
+        ShaderPermutations &variantShaders = shaders.find(config.variant)->second;
+        ShaderDefines defines;
+        defines["MAX_LIGHTS"] = std::to_string(std::min(config.lights, BENCH_MAX_LIGHTS));
+        defines["SAMPLE_STEP"] = std::to_string(config.sampleStep);
+        defines["COMPACT_LIGHT_MAPS"] = std::to_string(config.compact);
+        defines["LIGHT_CASCADES"] = std::to_string(config.cascades);
+        defines["LIGHT_LIST"] = std::to_string(config.lightList);
+        defines["LIGHT_TEXELS"] = std::to_string(LIGHT_TEXELS);
+        defines["LOD_FADE"] = std::to_string(config.lod);
+        defines["PRT_TRANSFER"] = std::to_string(config.prt);
+        defines["THICKNESS_MAP"] = std::to_string(config.thicknessMap);
+        transfer = config.prt ? &grainTransfer : nullptr;
+        defines["POINT_CLOUD"] = std::to_string(config.pointCloud);
+        thicknessMap = config.thicknessMap ? &grainThickness : nullptr;
+        defines["TRANSLUCENCY_CACHE"] = std::to_string(config.translucencyCache);
+        defines["TEMPORAL_REUSE"] = std::to_string(config.temporal);
+        defines["ENVIRONMENT_SH"] = std::to_string(config.environment);
+        environment = config.environment ? &sky : nullptr;
+        if (config.gatherMode == 2)
+        {
+            ShaderDefines gridDefines = defines;
+            gridDefines["GATHER_MODE"] = "0";
+            gridShader = &variantShaders.get(gridDefines);
+        }
+        defines["GATHER_MODE"] = std::to_string(config.gatherMode);
+        temporal = config.temporal ? &temporalHistory : nullptr;
+        if (config.halfRes)
+        {
+            ShaderDefines lowResDefines = defines;
+            lowResDefines["SUBSURFACE_LOW_RES"] = "1";
+            lowResShader = &variantShaders.get(lowResDefines);
+            referenceShader = &variantShaders.get(defines);
+            halfRes = &halfResSubsurface;
+        }
+        defines["SUBSURFACE_UPSAMPLE"] = std::to_string(config.halfRes);
+        if (config.translucencyCache)
+        {
+            ShaderDefines bakeDefines = defines;
+            bakeDefines["TRANSLUCENCY_CACHE_BAKE"] = "1";
+            cacheBakeShader = &variantShaders.get(bakeDefines);
+            cacheDilateShader = &dilateShader;
+            translucencyCache = &grainCache;
+        }
+        IrradianceCloud sceneCloud;
+        if (config.pointCloud)
+        {
+            sceneCloud.build(grainPoints, grainCaster, transforms, lightDirections, lightRadiances, std::min(config.lights, BENCH_MAX_LIGHTS), GrainMaterial());
+            cloud = &sceneCloud;
+        }
+        Shader &lightShader = config.compact || config.cascades > 1 || config.lightList ? octahedralNormalShader : normalShader;
+        drawnInstances = config.instances;
+        impostorInstances = 0;
+        if (config.impostors)
+        {
+            uploadInstances(instanceBuffer, frontTransforms);
+            drawnInstances = frontTransforms.size();
+            impostorInstances = backTransforms.size();
+            ShaderDefines impostorDefines;
+            impostorDefines["MAX_LIGHTS"] = defines["MAX_LIGHTS"];
+            impostorShader = &impostorShaders.get(impostorDefines);
+            impostor = &grainImpostor;
+        }
+        if (config.lod)
+        {
+            uploadInstances(instanceBuffer, nearTransforms);
+            drawnInstances = nearTransforms.size();
+            ShaderDefines mediumDefines;
+            mediumDefines["MAX_LIGHTS"] = defines["MAX_LIGHTS"];
+            mediumShader = &mediumShaders.get(mediumDefines);
+            medium = &sceneMedium;
+        }
+        BenchResult result = runConfig(variantShaders.get(defines), lightShader, vertexShader, model, config, targets, options);
+        if (config.lod || config.impostors)
+            uploadInstances(instanceBuffer, transforms);
+        medium = nullptr;
+        mediumShader = nullptr;
+        impostor = nullptr;
+        impostorShader = nullptr;
+        transfer = nullptr;
+        thicknessMap = nullptr;
+        cloud = nullptr;
+        translucencyCache = nullptr;
+        temporal = nullptr;
+        halfRes = nullptr;
+        lowResShader = nullptr;
+        referenceShader = nullptr;
+        gridShader = nullptr;
+        environment = nullptr;
+        cacheBakeShader = nullptr;
+        cacheDilateShader = nullptr;
+        sceneCloud.cleanup();
+        std::cerr << resultToJSON(options.modes, result) << std::endl;
+        if (!result.finite)
+        {
+            std::cerr << "non-finite pixels in the medium composite" << std::endl;
+            invalid = true;
+        }
+        results.push_back(result);
+    }
+    if (!configs.empty())
+        destroyTargets(targets, BENCH_MAX_LIGHTS);
+    sceneMedium.cleanup();
+    glDeleteBuffers(1, &instanceBuffer);
+    glDeleteBuffers(1, &impostorBuffer);
+    grainImpostor.cleanup();
+    grainTransfer.cleanup();
+    grainThickness.cleanup();
+    grainCache.cleanup();
+    temporalHistory.cleanup();
+    halfResSubsurface.cleanup();
+    stream.cleanup();
+    frameStream = nullptr;
+
+    std::stringstream json;
+    json << "{\n\"renderer\":\"" << renderer << "\",\n\"version\":\"" << version << "\",\n\"results\":[\n";
+    for (unsigned int i = 0; i < results.size(); i++)
+        json << resultToJSON(options.modes, results[i]) << (i + 1 < results.size() ? ",\n" : "\n");
+    json << "]\n}\n";
+
+    if (options.out.empty())
+        std::cout << json.str();
+    else
+    {
+        std::ofstream file(options.out.c_str());
+        file << json.str();
+        std::cerr << "Saved benchmark results. [ " << options.out << " ]" << std::endl;
+    }
+
+    int status = invalid ? 1 : 0;
+    if (!options.baseline.empty())
+    {
+        std::vector<BenchResult> baseline = readBaseline(options.modes, options.baseline);
+        if (!compareWithBaseline(options.modes, results, baseline, options.threshold))
+            status = 1;
+    }
+
+    glfwTerminate();
+    return status;
+}
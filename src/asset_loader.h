@@ -0,0 +1,336 @@
+#ifndef ASSET_LOADER_H
+#define ASSET_LOADER_H
+
+#include <glad/glad.h>
+
+#include "model.h"
+#include "texture_cache.h"
+#include "trace.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Multi-producer single-consumer queue: workers push without locking, the GL thread takes
+// everything pushed so far in one exchange. Items pushed by one thread come out in order.
+template <typename T>
+class LockFreeQueue
+{
+public:
+    LockFreeQueue() : head(nullptr) {}
+
+    ~LockFreeQueue()
+    {
+        std::vector<T> rest;
+        popAll(rest);
+    }
+
+    void push(const T &value)
+    {
+        Node *node = new Node;
+        node->value = value;
+        node->next = head.load(std::memory_order_relaxed);
+        while (!head.compare_exchange_weak(node->next, node, std::memory_order_release, std::memory_order_relaxed))
+            ;
+    }
+
+    // appends all queued items to out, oldest first
+    void popAll(std::vector<T> &out)
+    {
+        Node *node = head.exchange(nullptr, std::memory_order_acquire);
+        // the list is newest first, reverse it
+        Node *reversed = nullptr;
+        while (node)
+        {
+            Node *next = node->next;
+            node->next = reversed;
+            reversed = node;
+            node = next;
+        }
+        while (reversed)
+        {
+            Node *next = reversed->next;
+            out.push_back(reversed->value);
+            delete reversed;
+            reversed = next;
+        }
+    }
+
+private:
+    struct Node {
+        T value;
+        Node *next;
+    };
+    std::atomic<Node *> head;
+};
+
+// Streams models and textures in without blocking the GL thread. Worker threads run Assimp
+// and stb_image and hand the CPU-side results over through a LockFreeQueue. update(), called
+// once per frame on the GL thread, creates the GL objects for at most uploadBudget bytes per
+// frame; texels go through a pixel unpack buffer so the driver can copy them asynchronously.
+class AssetLoader
+{
+public:
+    // bytes uploaded per update(), at least one item is uploaded every frame
+    size_t uploadBudget;
+
+    AssetLoader(unsigned int threads = 2, size_t uploadBudget = 16 << 20) : uploadBudget(uploadBudget), quit(false), pending(0), stagingBuffer(0)
+    {
+        for (unsigned int i = 0; i < threads; i++)
+            workers.push_back(std::thread(&AssetLoader::run, this));
+    }
+
+    ~AssetLoader()
+    {
+        stop();
+    }
+
+    // starts loading path into model, model.loaded turns true in the update() that finishes it
+    void load(Model &model, const std::string &path)
+    {
+        model.loaded = false;
+        Request request = {&model, 0, path};
+        submit(request);
+    }
+
+    // returns a texture name right away, the texture is filled in once the image is decoded.
+    // The texture is shared through the TextureCache, hand it back with TextureCache::release.
+    unsigned int loadTexture(const std::string &path, bool gamma = false)
+    {
+        std::string key = TextureCache::key(path, gamma);
+        unsigned int texture = TextureCache::instance().acquire(key);
+        if (texture != 0)
+            return texture;
+        glGenTextures(1, &texture);
+        // registered before it is decoded so a second request for the file shares it
+        TextureCache::instance().insert(key, texture, 0);
+        Request request = {nullptr, texture, path};
+        submit(request);
+        return texture;
+    }
+
+    // true while requests are queued, decoding or waiting for upload
+    bool busy() const
+    {
+        return pending.load(std::memory_order_acquire) != 0 || !uploads.empty();
+    }
+
+    // call once per frame on the GL thread
+    void update()
+    {
+        std::vector<Upload> ready;
+        finished.popAll(ready);
+        uploads.insert(uploads.end(), ready.begin(), ready.end());
+        if (uploads.empty())
+            return;
+
+        TraceScope trace("upload assets");
+        size_t uploaded = 0;
+        while (!uploads.empty() && (uploaded == 0 || uploaded < uploadBudget))
+        {
+            uploaded += upload(uploads.front());
+            uploads.pop_front();
+        }
+    }
+
+    // joins the workers, must be called while the context is still alive (frees the staging buffer)
+    void stop()
+    {
+        if (workers.empty())
+            return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        wake.notify_all();
+        for (unsigned int i = 0; i < workers.size(); i++)
+            workers[i].join();
+        workers.clear();
+
+        std::vector<Upload> rest;
+        finished.popAll(rest);
+        rest.insert(rest.end(), uploads.begin(), uploads.end());
+        uploads.clear();
+        for (unsigned int i = 0; i < rest.size(); i++)
+        {
+            stbi_image_free(rest[i].image.pixels);
+            delete rest[i].mesh;
+        }
+        if (stagingBuffer != 0)
+            glDeleteBuffers(1, &stagingBuffer);
+        stagingBuffer = 0;
+    }
+
+private:
+    struct Request {
+        // the model to fill, or nullptr for a single texture
+        Model *model;
+        unsigned int texture;
+        std::string path;
+    };
+
+    enum UploadKind {
+        UPLOAD_IMAGE,
+        UPLOAD_MESH,
+        // the model's last item, marks it loaded
+        UPLOAD_DONE
+    };
+
+    struct Upload {
+        UploadKind kind;
+        Model *model;
+        unsigned int texture;
+        ImageData image;
+        MeshData *mesh;
+        // the model directory on UPLOAD_DONE, the image file for model images
+        std::string directory;
+    };
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool quit;
+    std::deque<Request> requests;
+    std::atomic<unsigned int> pending;
+
+    LockFreeQueue<Upload> finished;
+    // only touched on the GL thread
+    std::deque<Upload> uploads;
+    GLuint stagingBuffer;
+
+    void submit(const Request &request)
+    {
+        pending.fetch_add(1, std::memory_order_relaxed);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            requests.push_back(request);
+        }
+        wake.notify_one();
+    }
+
+    void run()
+    {
+        Trace::setThreadName("asset loader");
+        while (true)
+        {
+            Request request;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [this] { return quit || !requests.empty(); });
+                if (quit)
+                    return;
+                request = requests.front();
+                requests.pop_front();
+            }
+            if (request.model)
+                decodeModel(request);
+            else
+                decodeTexture(request);
+            pending.fetch_sub(1, std::memory_order_release);
+        }
+    }
+
+    void decodeTexture(const Request &request)
+    {
+        TraceScope trace("decode texture");
+        Upload upload = {UPLOAD_IMAGE, nullptr, request.texture, ImageData(), nullptr, ""};
+        upload.image.path = request.path;
+        if (decodeImage(request.path, upload.image))
+            finished.push(upload);
+    }
+
+    // images are queued before the meshes that use them
+    void decodeModel(const Request &request)
+    {
+        ModelData data;
+        if (Model::parse(request.path, data, request.model->gammaCorrection))
+        {
+            for (unsigned int i = 0; i < data.images.size(); i++)
+            {
+                Upload upload = {UPLOAD_IMAGE, request.model, 0, data.images[i], nullptr, data.directory + '/' + data.images[i].path};
+                finished.push(upload);
+            }
+            for (unsigned int i = 0; i < data.meshes.size(); i++)
+            {
+                Upload upload = {UPLOAD_MESH, request.model, 0, ImageData(), new MeshData(), ""};
+                upload.mesh->vertices.swap(data.meshes[i].vertices);
+                upload.mesh->indices.swap(data.meshes[i].indices);
+                upload.mesh->textures.swap(data.meshes[i].textures);
+                finished.push(upload);
+            }
+        }
+        Upload done = {UPLOAD_DONE, request.model, 0, ImageData(), nullptr, data.directory};
+        finished.push(done);
+    }
+
+    // creates the GL objects of one item, returns the number of bytes uploaded
+    size_t upload(Upload &item)
+    {
+        if (item.kind == UPLOAD_IMAGE && !item.model)
+        {
+            // a texture from loadTexture, already registered in the cache
+            size_t bytes = uploadStaged(item.texture, item.image);
+            TextureCache::instance().resize(item.texture, imageBytes(item.image));
+            stbi_image_free(item.image.pixels);
+            return bytes;
+        }
+        if (item.kind == UPLOAD_IMAGE)
+        {
+            ImageData &image = item.image;
+            size_t bytes = 0;
+            unsigned int texture = TextureCache::instance().acquire(image.key);
+            if (texture == 0)
+            {
+                // parse skips images the cache had, decode it here if it was evicted since
+                if (!image.pixels)
+                    decodeImage(item.directory, image);
+                glGenTextures(1, &texture);
+                bytes = uploadStaged(texture, image);
+                TextureCache::instance().insert(image.key, texture, imageBytes(image));
+            }
+            stbi_image_free(image.pixels);
+            item.model->addTexture(image, texture);
+            return bytes;
+        }
+        if (item.kind == UPLOAD_MESH)
+        {
+            size_t bytes = item.mesh->vertices.size() * sizeof(Vertex) + item.mesh->indices.size() * sizeof(unsigned int);
+            item.model->addMesh(*item.mesh);
+            delete item.mesh;
+            return bytes;
+        }
+        item.model->directory = item.directory;
+        item.model->loaded = true;
+        return 0;
+    }
+
+    // copies the texels into the (orphaned) staging buffer and sources the texture from it,
+    // the driver can then return before the transfer to the texture is done
+    size_t uploadStaged(unsigned int texture, const ImageData &image)
+    {
+        if (!image.pixels)
+            return 0;
+        size_t bytes = (size_t)image.width * image.height * image.components;
+        if (stagingBuffer == 0)
+            glGenBuffers(1, &stagingBuffer);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, stagingBuffer);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, bytes, NULL, GL_STREAM_DRAW);
+        void *staging = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+        if (staging)
+        {
+            memcpy(staging, image.pixels, bytes);
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+            uploadImage(texture, image, (const void *)0);
+        }
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        if (!staging)
+            uploadImage(texture, image, image.pixels);
+        return bytes;
+    }
+};
+#endif
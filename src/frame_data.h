@@ -0,0 +1,42 @@
+#ifndef FRAME_DATA_H
+#define FRAME_DATA_H
+
+#include <glm/glm.hpp>
+
+#include "shader.h"
+#include "stream_buffer.h"
+
+#include <vector>
+
+// std140 mirror of the CameraData block of the vertex and shading shaders
+struct CameraBlock {
+    glm::mat4 projection;
+    glm::mat4 view;
+    glm::vec3 eyePos;
+    float nearPlane;
+    glm::vec2 resolution;
+    float farPlane;
+    float padding;
+};
+
+// writes the LightData block for count lights (the shader's MAX_LIGHTS) and binds it.
+// In std140 the vec3 arrays have a 16 byte stride, so every element takes a vec4.
+void streamLights(StreamBuffer &stream, int count, const glm::mat4 *lightSpaceMatrices, const glm::vec3 *lightDirections, const glm::vec3 *lightRadiances)
+{
+    std::vector<glm::vec4> block;
+    block.reserve(count * 6);
+    for (int i = 0; i < count; i++)
+        for (int column = 0; column < 4; column++)
+            block.push_back(lightSpaceMatrices[i][column]);
+    for (int i = 0; i < count; i++)
+        block.push_back(glm::vec4(lightDirections[i], 0.0f));
+    for (int i = 0; i < count; i++)
+        block.push_back(glm::vec4(lightRadiances[i], 0.0f));
+    stream.bindUniforms(LIGHT_BLOCK_BINDING, &block[0], block.size() * sizeof(glm::vec4));
+}
+
+void streamCamera(StreamBuffer &stream, const CameraBlock &camera)
+{
+    stream.bindUniforms(CAMERA_BLOCK_BINDING, &camera, sizeof(CameraBlock));
+}
+#endif
@@ -0,0 +1,141 @@
+#ifndef GEOMETRY_ARENA_H
+#define GEOMETRY_ARENA_H
+
+#include <glad/glad.h>
+
+#include "trace.h"
+
+#include <cstddef>
+#include <vector>
+
+// where a mesh lives in the arena
+struct ArenaRange {
+    GLint baseVertex;
+    GLuint firstIndex;
+    GLsizei indexCount;
+};
+
+// One vertex buffer and one index buffer shared by every mesh, sub-allocated front to back,
+// with a single VAO for the vertex format. Meshes that are drawn together can then go out in
+// one glMultiDrawElementsBaseVertex call. Buffers double in size when they run out, the old
+// contents are copied over on the GPU. Templated on the vertex type so it does not depend on
+// mesh.h; every vertex type gets its own arena.
+template <typename V>
+class GeometryArena
+{
+public:
+    static GeometryArena &instance()
+    {
+        static GeometryArena arena;
+        return arena;
+    }
+
+    GLuint vao() const { return VAO; }
+
+    ArenaRange allocate(const std::vector<V> &vertices, const std::vector<unsigned int> &indices)
+    {
+        if (VAO == 0)
+            glGenVertexArrays(1, &VAO);
+        reserve(GL_ARRAY_BUFFER, VBO, vertexCapacity, vertexCount + vertices.size(), sizeof(V));
+        reserve(GL_ELEMENT_ARRAY_BUFFER, EBO, indexCapacity, indexCount + indices.size(), sizeof(unsigned int));
+
+        ArenaRange range = {(GLint)vertexCount, (GLuint)indexCount, (GLsizei)indices.size()};
+        glBindBuffer(GL_ARRAY_BUFFER, VBO);
+        if (!vertices.empty())
+            glBufferSubData(GL_ARRAY_BUFFER, vertexCount * sizeof(V), vertices.size() * sizeof(V), &vertices[0]);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, EBO);
+        if (!indices.empty())
+            glBufferSubData(GL_COPY_WRITE_BUFFER, indexCount * sizeof(unsigned int), indices.size() * sizeof(unsigned int), &indices[0]);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+        vertexCount += vertices.size();
+        indexCount += indices.size();
+        return range;
+    }
+
+    // sets the attribute layout of the arena VAO, called whenever the vertex buffer changes
+    void (*setupAttributes)();
+
+private:
+    GLuint VAO, VBO, EBO;
+    size_t vertexCount, vertexCapacity;
+    size_t indexCount, indexCapacity;
+
+    GeometryArena() : setupAttributes(nullptr), VAO(0), VBO(0), EBO(0), vertexCount(0), vertexCapacity(0), indexCount(0), indexCapacity(0) {}
+
+    // grows buffer to hold at least needed elements, keeping what is in it
+    void reserve(GLenum target, GLuint &buffer, size_t &capacity, size_t needed, size_t elementSize)
+    {
+        if (needed <= capacity)
+            return;
+        TraceScope trace("grow geometry arena");
+        size_t grown = capacity * 2 > needed ? capacity * 2 : needed;
+        GLuint bigger;
+        glGenBuffers(1, &bigger);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, bigger);
+        glBufferData(GL_COPY_WRITE_BUFFER, grown * elementSize, NULL, GL_STATIC_DRAW);
+        if (buffer != 0)
+        {
+            size_t used = target == GL_ARRAY_BUFFER ? vertexCount : indexCount;
+            glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+            glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, used * elementSize);
+            glBindBuffer(GL_COPY_READ_BUFFER, 0);
+            glDeleteBuffers(1, &buffer);
+        }
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+        buffer = bigger;
+        capacity = grown;
+
+        // re-point the VAO at the new buffer
+        glBindVertexArray(VAO);
+        if (target == GL_ARRAY_BUFFER)
+        {
+            glBindBuffer(GL_ARRAY_BUFFER, VBO);
+            if (setupAttributes)
+                setupAttributes();
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+        }
+        else
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+        glBindVertexArray(0);
+    }
+};
+
+// Collects arena ranges and draws them with one glMultiDrawElementsBaseVertex call.
+// GL 4.1 has no glMultiDrawElementsIndirect, this is the closest: one call per batch, the
+// ranges stay on the CPU. All ranges of a batch share the bound textures and uniforms.
+class ArenaBatch
+{
+public:
+    void clear()
+    {
+        counts.clear();
+        offsets.clear();
+        baseVertices.clear();
+    }
+
+    void add(const ArenaRange &range)
+    {
+        counts.push_back(range.indexCount);
+        offsets.push_back((const void *)(range.firstIndex * sizeof(unsigned int)));
+        baseVertices.push_back(range.baseVertex);
+    }
+
+    bool empty() const { return counts.empty(); }
+
+    void draw(GLuint vao) const
+    {
+        if (counts.empty())
+            return;
+        glBindVertexArray(vao);
+        glMultiDrawElementsBaseVertex(GL_TRIANGLES, &counts[0], GL_UNSIGNED_INT, &offsets[0], (GLsizei)counts.size(), &baseVertices[0]);
+        Trace::add(TRACE_DRAW_CALLS, 1);
+        glBindVertexArray(0);
+    }
+
+private:
+    std::vector<GLsizei> counts;
+    std::vector<const void *> offsets;
+    std::vector<GLint> baseVertices;
+};
+#endif
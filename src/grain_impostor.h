@@ -0,0 +1,248 @@
+#ifndef GRAIN_IMPOSTOR_H
+#define GRAIN_IMPOSTOR_H
+
+#include <glad/glad.h>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "shader.h"
+#include "model.h"
+#include "trace.h"
+
+#include <cmath>
+#include <functional>
+#include <iostream>
+#include <vector>
+
+// texture units of the impostor atlases
+#define IMPOSTOR_GEOMETRY_UNIT 0
+#define IMPOSTOR_FRONT_UNIT 1
+#define IMPOSTOR_BACK_UNIT 2
+
+// unit direction of the octahedral map at e in [-1, 1]^2, as octahedralDecode in model3.fs
+glm::vec3 octahedralDirection(glm::vec2 e)
+{
+    glm::vec3 n(e.x, e.y, 1.0f - std::fabs(e.x) - std::fabs(e.y));
+    if (n.z < 0.0f)
+    {
+        glm::vec2 folded = (1.0f - glm::abs(glm::vec2(n.y, n.x))) * glm::vec2(n.x >= 0.0f ? 1.0f : -1.0f, n.y >= 0.0f ? 1.0f : -1.0f);
+        n.x = folded.x;
+        n.y = folded.y;
+    }
+    return glm::normalize(n);
+}
+
+// how the baker shades a view with the translucency shader, supplied by the renderer
+struct ImpostorShading {
+    // called outside the baker's framebuffer before each shaded view, e.g. to draw the
+    // light maps for a light from lightDirection (grain space, towards the light)
+    std::function<void(const glm::vec3 &lightDirection)> prepareLight;
+    // draws the grain at the origin with the translucency shader for this camera, lit by a
+    // unit-radiance light from the lightDirection of the last prepareLight
+    std::function<void(const glm::mat4 &view, const glm::mat4 &projection, const glm::vec3 &eye)> drawShaded;
+};
+
+// Octahedral impostors of one grain shape. bake() renders the grain from views x views
+// directions spread over the sphere by the octahedral map, one tile of the atlases each:
+// the geometry atlas holds the grain-space normal and the depth towards the viewer (in
+// grain radii, empty texels above 1), the front and back atlases the translucency shader's
+// response to a unit light behind the viewer and behind the grain. At run time every far
+// grain is one quad (impostor.vs/fs) facing the view it is seen from; the lights are mixed
+// from the two responses by their angle to that view, so the grain's gather loop runs
+// only while baking.
+class GrainImpostor
+{
+public:
+    GrainImpostor() : views(0), tileSize(0), radius(0.0f), framebuffer(0), quadVAO(0), quadVBO(0)
+    {
+        atlases[0] = atlases[1] = atlases[2] = 0;
+    }
+
+    ~GrainImpostor()
+    {
+        cleanup();
+    }
+
+    bool baked() const { return framebuffer != 0; }
+
+    // radius is the grain's bounding radius around its origin, geometryShader is
+    // vertexShader2.vs with impostorBake.fs
+    void bake(Model &model, float radius, Shader &geometryShader, const ImpostorShading &shading, unsigned int views = 8, unsigned int tileSize = 64)
+    {
+        TraceScope trace("bake impostors");
+        cleanup();
+        this->views = views;
+        this->tileSize = tileSize;
+        this->radius = radius;
+        unsigned int size = views * tileSize;
+
+        glGenFramebuffers(1, &framebuffer);
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glGenTextures(3, atlases);
+        for (int i = 0; i < 3; i++)
+        {
+            glBindTexture(GL_TEXTURE_2D, atlases[i]);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, size, size, 0, GL_RGBA, GL_FLOAT, 0);
+            // nearest so the depth and the empty texels are not blended across the silhouette
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i, GL_TEXTURE_2D, atlases[i], 0);
+        }
+        GLuint depth;
+        glGenRenderbuffers(1, &depth);
+        glBindRenderbuffer(GL_RENDERBUFFER, depth);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT32F, size, size);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            std::cout << "Impostor framebuffer not complete!" << std::endl;
+        const GLenum all[3] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2};
+        glDrawBuffers(3, all);
+        glClearColor(0.0f, 0.0f, 0.0f, 2.0f);
+        glClear(GL_COLOR_BUFFER_BIT);
+        glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+
+        GLint viewport[4];
+        glGetIntegerv(GL_VIEWPORT, viewport);
+        glEnable(GL_DEPTH_TEST);
+        glEnable(GL_SCISSOR_TEST);
+        glm::mat4 projection = glm::ortho(-radius, radius, -radius, radius, 0.5f * radius, 3.5f * radius);
+        for (unsigned int y = 0; y < views; y++)
+            for (unsigned int x = 0; x < views; x++)
+            {
+                glm::vec3 direction = viewDirection(x, y);
+                glm::vec3 eye = direction * 2.0f * radius;
+                glm::mat4 view = glm::lookAt(eye, glm::vec3(0.0f), viewUp(direction));
+
+                // grain-space normal and depth into attachment 0
+                beginTile(x, y, GL_COLOR_ATTACHMENT0);
+                geometryShader.use();
+                geometryShader.setMat4("lightSpaceMatrix", projection * view);
+                geometryShader.setMat4("model", glm::mat4(1.0f));
+                geometryShader.setMat3("normalMatrix", glm::mat3(1.0f));
+                geometryShader.setVec3("viewDirection", direction);
+                geometryShader.setFloat("radius", radius);
+                model.Draw(geometryShader);
+
+                // lit from behind the viewer, then from behind the grain
+                for (int side = 0; side < 2; side++)
+                {
+                    glDisable(GL_SCISSOR_TEST);
+                    shading.prepareLight(side == 0 ? direction : -direction);
+                    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+                    glEnable(GL_SCISSOR_TEST);
+                    beginTile(x, y, side == 0 ? GL_COLOR_ATTACHMENT1 : GL_COLOR_ATTACHMENT2);
+                    shading.drawShaded(view, projection, eye);
+                }
+            }
+        glDisable(GL_SCISSOR_TEST);
+        glDrawBuffers(3, all);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glDeleteRenderbuffers(1, &depth);
+        glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+
+        // one quad per instance, the corners are placed by impostor.vs
+        const float corners[8] = {-1.0f, -1.0f, 1.0f, -1.0f, -1.0f, 1.0f, 1.0f, 1.0f};
+        glGenVertexArrays(1, &quadVAO);
+        glGenBuffers(1, &quadVBO);
+        glBindVertexArray(quadVAO);
+        glBindBuffer(GL_ARRAY_BUFFER, quadVBO);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(corners), corners, GL_STATIC_DRAW);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float), (void*)0);
+        glBindVertexArray(0);
+    }
+
+    // attach a buffer of per-instance glm::mat4 model matrices at attribute locations 7-10,
+    // like Mesh::setInstanceBuffer
+    void setInstanceBuffer(unsigned int buffer)
+    {
+        glBindVertexArray(quadVAO);
+        glBindBuffer(GL_ARRAY_BUFFER, buffer);
+        for (unsigned int i = 0; i < 4; i++)
+        {
+            glEnableVertexAttribArray(7 + i);
+            glVertexAttribPointer(7 + i, 4, GL_FLOAT, GL_FALSE, sizeof(glm::mat4), (void*)(i * sizeof(glm::vec4)));
+            glVertexAttribDivisor(7 + i, 1);
+        }
+        glBindVertexArray(0);
+    }
+
+    // draws count grains as quads with impostor.vs/fs, CameraData and LightData must be bound
+    void DrawInstanced(Shader &shader, unsigned int count)
+    {
+        if (!baked() || count == 0)
+            return;
+        shader.use();
+        for (int i = 0; i < 3; i++)
+        {
+            glActiveTexture(GL_TEXTURE0 + IMPOSTOR_GEOMETRY_UNIT + i);
+            glBindTexture(GL_TEXTURE_2D, atlases[i]);
+        }
+        glActiveTexture(GL_TEXTURE0);
+        shader.setInt("impostorGeometry", IMPOSTOR_GEOMETRY_UNIT);
+        shader.setInt("impostorFront", IMPOSTOR_FRONT_UNIT);
+        shader.setInt("impostorBack", IMPOSTOR_BACK_UNIT);
+        shader.setInt("impostorViews", views);
+        shader.setFloat("impostorRadius", radius);
+        glBindVertexArray(quadVAO);
+        glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, count);
+        Trace::add(TRACE_DRAW_CALLS, 1);
+        glBindVertexArray(0);
+    }
+
+    size_t bytes() const
+    {
+        return baked() ? (size_t)views * tileSize * views * tileSize * 8 * 3 : 0;
+    }
+
+    // must be called while the context is still alive
+    void cleanup()
+    {
+        if (framebuffer != 0)
+        {
+            glDeleteFramebuffers(1, &framebuffer);
+            glDeleteTextures(3, atlases);
+        }
+        if (quadVAO != 0)
+        {
+            glDeleteVertexArrays(1, &quadVAO);
+            glDeleteBuffers(1, &quadVBO);
+        }
+        framebuffer = quadVAO = quadVBO = 0;
+        atlases[0] = atlases[1] = atlases[2] = 0;
+    }
+
+    // direction of view tile (x, y) in grain space, towards the viewer
+    glm::vec3 viewDirection(unsigned int x, unsigned int y) const
+    {
+        return octahedralDirection(glm::vec2(x + 0.5f, y + 0.5f) / (float)views * 2.0f - 1.0f);
+    }
+
+    // up vector of the views, impostor.vs builds the quads from the same one
+    static glm::vec3 viewUp(const glm::vec3 &direction)
+    {
+        return std::fabs(direction.y) > 0.99f ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+    }
+
+private:
+    unsigned int views;
+    unsigned int tileSize;
+    float radius;
+    GLuint framebuffer;
+    // geometry, front and back response
+    GLuint atlases[3];
+    GLuint quadVAO, quadVBO;
+
+    // restricts drawing to tile (x, y) of one attachment and clears its depth
+    void beginTile(unsigned int x, unsigned int y, GLenum attachment)
+    {
+        glDrawBuffer(attachment);
+        glViewport(x * tileSize, y * tileSize, tileSize, tileSize);
+        glScissor(x * tileSize, y * tileSize, tileSize, tileSize);
+        glClear(GL_DEPTH_BUFFER_BIT);
+    }
+};
+#endif
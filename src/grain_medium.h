@@ -0,0 +1,221 @@
+#ifndef GRAIN_MEDIUM_H
+#define GRAIN_MEDIUM_H
+
+#include <glad/glad.h>
+
+#include <glm/glm.hpp>
+
+#include "shader.h"
+#include "model.h"
+#include "light_space.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// texture units of the medium pass, it runs on its own after the grains
+#define MEDIUM_VOLUME_UNIT 0
+#define MEDIUM_DEPTH_UNIT 1
+
+// enclosed volume of a closed model (divergence theorem over its triangles)
+float modelVolume(const Model &model)
+{
+    double volume = 0.0;
+    for (unsigned int i = 0; i < model.meshes.size(); i++)
+    {
+        const Mesh &mesh = model.meshes[i];
+        for (unsigned int j = 0; j + 2 < mesh.indices.size(); j += 3)
+        {
+            glm::vec3 a = mesh.vertices[mesh.indices[j]].Position;
+            glm::vec3 b = mesh.vertices[mesh.indices[j + 1]].Position;
+            glm::vec3 c = mesh.vertices[mesh.indices[j + 2]].Position;
+            volume += glm::dot(a, glm::cross(b, c)) / 6.0;
+        }
+    }
+    return (float)std::fabs(volume);
+}
+
+// mean length of a chord through a closed convex model, 4 V / S (Cauchy): how far light
+// crossing the grain in a random direction travels inside it
+float meanChord(const Model &model)
+{
+    double area = 0.0;
+    for (unsigned int i = 0; i < model.meshes.size(); i++)
+    {
+        const Mesh &mesh = model.meshes[i];
+        for (unsigned int j = 0; j + 2 < mesh.indices.size(); j += 3)
+        {
+            glm::vec3 a = mesh.vertices[mesh.indices[j]].Position;
+            glm::vec3 b = mesh.vertices[mesh.indices[j + 1]].Position;
+            glm::vec3 c = mesh.vertices[mesh.indices[j + 2]].Position;
+            area += 0.5 * glm::length(glm::cross(b - a, c - a));
+        }
+    }
+    return area > 0.0 ? (float)(4.0 * modelVolume(model) / area) : 0.0f;
+}
+
+// albedo of a grain seen from far away, from its reduced scattering and absorption
+glm::vec3 grainAlbedo(const glm::vec3 &sigmaSPrime, const glm::vec3 &sigmaA)
+{
+    return sigmaSPrime / (sigmaSPrime + sigmaA);
+}
+
+// Far-field LOD of a grain aggregate. The grains are voxelised into a 3D texture of packing
+// fraction (alpha) and volume-weighted grain albedo (rgb), and medium.fs ray-marches it as a
+// homogenised participating medium: extinction 3 f / (4 r) for grains of radius r at packing
+// fraction f, single scattering of the LightData lights with a short shadow march. Its cost
+// depends on the grid and the screen, not on the grain count. Grains nearer than
+// lodRange.y stay geometry (nearInstances), model3 dithers them out over lodRange (LOD_FADE)
+// while the medium fades in over the same range.
+class GrainMedium
+{
+public:
+    // distance from the eye where the grains start fading into the medium, and where only
+    // the medium is left
+    glm::vec2 lodRange;
+
+    GrainMedium() : lodRange(5.0f, 10.0f), volume(0), emptyVAO(0), grainRadius(0.0f) {}
+
+    ~GrainMedium()
+    {
+        cleanup();
+    }
+
+    bool built() const { return volume != 0; }
+
+    // voxelises grains of grainVolume model-space volume and radius bounding radius placed
+    // by transforms into at most resolution voxels along the longest axis of their bounds.
+    // albedos holds one albedo per grain, or a single one for all of them.
+    void build(const std::vector<glm::mat4> &transforms, float grainVolume, float radius, const std::vector<glm::vec3> &albedos, const Bounds &scene, unsigned int resolution = 64)
+    {
+        TraceScope trace("voxelise grains");
+        cleanup();
+        if (transforms.empty() || scene.empty() || albedos.empty())
+            return;
+        // pad by a voxel so the trilinear splat at the border stays inside
+        glm::vec3 size = scene.max - scene.min;
+        float voxel = std::max(size.x, std::max(size.y, size.z)) / std::max(resolution, 2u);
+        bounds.min = scene.min - glm::vec3(voxel);
+        bounds.max = scene.max + glm::vec3(voxel);
+        grid = glm::max(glm::ivec3(glm::ceil((bounds.max - bounds.min) / voxel)), glm::ivec3(2));
+        bounds.max = bounds.min + glm::vec3(grid) * voxel;
+
+        size_t voxels = (size_t)grid.x * grid.y * grid.z;
+        std::vector<float> filled(voxels, 0.0f);
+        std::vector<glm::vec3> albedo(voxels, glm::vec3(0.0f));
+        float scaledRadius = 0.0f;
+        for (unsigned int i = 0; i < transforms.size(); i++)
+        {
+            // grains are uniformly scaled
+            float scale = std::cbrt(std::fabs(glm::determinant(glm::mat3(transforms[i]))));
+            float grain = grainVolume * scale * scale * scale;
+            scaledRadius += radius * scale;
+            glm::vec3 color = albedos[albedos.size() == transforms.size() ? i : 0];
+
+            // trilinear splat of the grain's volume around its centre
+            glm::vec3 cell = (glm::vec3(transforms[i][3]) - bounds.min) / voxel - 0.5f;
+            glm::ivec3 base = glm::ivec3(glm::floor(cell));
+            glm::vec3 f = cell - glm::vec3(base);
+            for (int corner = 0; corner < 8; corner++)
+            {
+                glm::ivec3 offset(corner & 1, (corner >> 1) & 1, (corner >> 2) & 1);
+                glm::ivec3 at = glm::clamp(base + offset, glm::ivec3(0), grid - 1);
+                glm::vec3 w = glm::mix(1.0f - f, f, glm::vec3(offset));
+                float share = grain * w.x * w.y * w.z;
+                size_t index = ((size_t)at.z * grid.y + at.y) * grid.x + at.x;
+                filled[index] += share;
+                albedo[index] += color * share;
+            }
+        }
+        grainRadius = scaledRadius / transforms.size();
+
+        // rgb albedo, a packing fraction (random close packing is the most grains can fill)
+        std::vector<glm::vec4> texels(voxels);
+        float voxelVolume = voxel * voxel * voxel;
+        for (size_t i = 0; i < voxels; i++)
+        {
+            glm::vec3 color = filled[i] > 0.0f ? albedo[i] / filled[i] : glm::vec3(0.0f);
+            texels[i] = glm::vec4(color, std::min(filled[i] / voxelVolume, 0.64f));
+        }
+
+        glGenTextures(1, &volume);
+        glBindTexture(GL_TEXTURE_3D, volume);
+        glTexImage3D(GL_TEXTURE_3D, 0, GL_RGBA16F, grid.x, grid.y, grid.z, 0, GL_RGBA, GL_FLOAT, &texels[0]);
+        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glBindTexture(GL_TEXTURE_3D, 0);
+        glGenVertexArrays(1, &emptyVAO);
+    }
+
+    // the transforms of the grains that are still drawn as geometry from eye
+    std::vector<glm::mat4> nearInstances(const std::vector<glm::mat4> &transforms, const glm::vec3 &eye) const
+    {
+        std::vector<glm::mat4> near;
+        for (unsigned int i = 0; i < transforms.size(); i++)
+            if (glm::length(glm::vec3(transforms[i][3]) - eye) < lodRange.y + grainRadius)
+                near.push_back(transforms[i]);
+        return near;
+    }
+
+    // composites the medium over the bound framebuffer, which must not have sceneDepth
+    // attached; CameraData and LightData must be bound, viewProjection is the camera's
+    void render(Shader &shader, GLuint sceneDepth, const glm::mat4 &viewProjection)
+    {
+        if (!built())
+            return;
+        shader.use();
+        glActiveTexture(GL_TEXTURE0 + MEDIUM_VOLUME_UNIT);
+        glBindTexture(GL_TEXTURE_3D, volume);
+        shader.setInt("mediumVolume", MEDIUM_VOLUME_UNIT);
+        glActiveTexture(GL_TEXTURE0 + MEDIUM_DEPTH_UNIT);
+        glBindTexture(GL_TEXTURE_2D, sceneDepth);
+        shader.setInt("sceneDepth", MEDIUM_DEPTH_UNIT);
+        glActiveTexture(GL_TEXTURE0);
+        shader.setVec3("boundsMin", bounds.min);
+        shader.setVec3("boundsMax", bounds.max);
+        shader.setFloat("grainRadius", grainRadius);
+        shader.setVec2("lodRange", lodRange);
+        shader.setMat4("inverseViewProjection", glm::inverse(viewProjection));
+
+        // out = inscattered + transmittance * scene
+        glDisable(GL_DEPTH_TEST);
+        glDisable(GL_CULL_FACE);
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_ONE, GL_SRC_ALPHA);
+        glBindVertexArray(emptyVAO);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+        glBindVertexArray(0);
+        glDisable(GL_BLEND);
+        glEnable(GL_DEPTH_TEST);
+    }
+
+    size_t bytes() const
+    {
+        return built() ? (size_t)grid.x * grid.y * grid.z * 8 : 0;
+    }
+
+    // must be called while the context is still alive
+    void cleanup()
+    {
+        if (volume != 0)
+            glDeleteTextures(1, &volume);
+        if (emptyVAO != 0)
+            glDeleteVertexArrays(1, &emptyVAO);
+        volume = 0;
+        emptyVAO = 0;
+    }
+
+private:
+    GLuint volume;
+    // the fullscreen triangle is made from gl_VertexID, core profiles still need a VAO
+    GLuint emptyVAO;
+    glm::ivec3 grid;
+    Bounds bounds;
+    // mean world-space grain radius
+    float grainRadius;
+};
+#endif
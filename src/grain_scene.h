@@ -0,0 +1,63 @@
+#ifndef GRAIN_SCENE_H
+#define GRAIN_SCENE_H
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "model.h"
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <vector>
+
+// radius of the sphere around the origin that encloses every vertex of the model
+float modelBoundingRadius(const Model &model)
+{
+    float radius = 0.0f;
+    for (unsigned int i = 0; i < model.meshes.size(); i++)
+        for (unsigned int j = 0; j < model.meshes[i].vertices.size(); j++)
+            radius = std::max(radius, glm::length(model.meshes[i].vertices[j].Position));
+    return radius;
+}
+
+// Generates transforms for a pile of grains. The grains sit on a jittered cubic lattice
+// inside [-extent, extent]^3 and are scaled down as the count grows, so the scene keeps the
+// same size as more grains are added. packing is the fraction of a lattice cell
+// filled by a grain's bounding sphere diameter.
+std::vector<glm::mat4> generateGrainScene(unsigned int count, float extent, float grainRadius, unsigned int seed = 1, float packing = 0.8f)
+{
+    std::vector<glm::mat4> transforms;
+    transforms.reserve(count);
+    if (count == 0 || grainRadius <= 0.0f)
+        return transforms;
+
+    unsigned int perAxis = (unsigned int)std::ceil(std::cbrt((double)count));
+    float cell = 2.0f * extent / perAxis;
+    float scale = 0.5f * cell * packing / grainRadius;
+    float jitter = 0.5f * cell * (1.0f - packing);
+
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+    std::uniform_real_distribution<float> angle(0.0f, 2.0f * 3.14159265359f);
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        unsigned int x = i % perAxis;
+        unsigned int y = (i / perAxis) % perAxis;
+        unsigned int z = i / (perAxis * perAxis);
+        glm::vec3 center = glm::vec3(-extent) + cell * (glm::vec3(x, y, z) + 0.5f);
+        center += jitter * glm::vec3(unit(rng), unit(rng), unit(rng));
+
+        glm::vec3 axis = glm::vec3(unit(rng), unit(rng), unit(rng));
+        if (glm::length(axis) < 1e-3f)
+            axis = glm::vec3(0.0f, 1.0f, 0.0f);
+
+        glm::mat4 transform = glm::translate(glm::mat4(1.0f), center);
+        transform = glm::rotate(transform, angle(rng), glm::normalize(axis));
+        transform = glm::scale(transform, glm::vec3(scale));
+        transforms.push_back(transform);
+    }
+    return transforms;
+}
+#endif
@@ -0,0 +1,305 @@
+#ifndef GRAIN_THICKNESS_H
+#define GRAIN_THICKNESS_H
+
+#include <glad/glad.h>
+
+#include <glm/glm.hpp>
+
+#include "shader.h"
+#include "model.h"
+#include "mesh.h"
+#include "sh_lighting.h"
+#include "light_space.h"
+#include "grain_transfer.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <thread>
+#include <vector>
+
+// texture unit of the thickness map, after the transfer unit
+#define THICKNESS_MAP_UNIT (PRT_TRANSFER_UNIT + 1)
+// entries of MeshRayCaster's traversal stack, a tree of depth d needs d + 1
+#define RAY_CASTER_STACK 64
+
+// Bounding volume hierarchy over the triangles of one model, in model space, for ray casts
+// on the CPU. Nodes split their triangles at the median centroid along their longest axis,
+// down to RAY_CASTER_STACK - 1 levels so the traversal stack never overflows (median splits
+// reach that only past 2^63 triangles).
+class MeshRayCaster
+{
+public:
+    MeshRayCaster(const Model &model)
+    {
+        for (unsigned int m = 0; m < model.meshes.size(); m++)
+        {
+            const Mesh &mesh = model.meshes[m];
+            for (unsigned int j = 0; j + 2 < mesh.indices.size(); j += 3)
+            {
+                Triangle triangle;
+                for (int k = 0; k < 3; k++)
+                {
+                    triangle.p[k] = mesh.vertices[mesh.indices[j + k]].Position;
+                    triangle.n[k] = mesh.vertices[mesh.indices[j + k]].Normal;
+                }
+                triangles.push_back(triangle);
+            }
+        }
+        if (triangles.empty())
+            return;
+        nodes.resize(1);
+        build(0, 0, triangles.size(), 0);
+    }
+
+    // nearest hit along the unit direction from origin further than minDistance, with the
+    // interpolated normal there; false if the ray leaves the model
+    bool cast(const glm::vec3 &origin, const glm::vec3 &direction, float minDistance, float &distance, glm::vec3 &normal) const
+    {
+        if (nodes.empty())
+            return false;
+        glm::vec3 inverse = 1.0f / direction;
+        distance = FLT_MAX;
+        int hit = -1;
+        float hitU = 0.0f, hitV = 0.0f;
+        // the deepest path holds one pending sibling per level and the node being popped
+        int stack[RAY_CASTER_STACK];
+        int size = 0;
+        stack[size++] = 0;
+        while (size > 0)
+        {
+            const Node &node = nodes[stack[--size]];
+            if (!hitsBox(node, origin, inverse, distance))
+                continue;
+            if (node.count > 0)
+            {
+                for (int i = node.first; i < node.first + node.count; i++)
+                {
+                    float t, u, v;
+                    if (hitsTriangle(triangles[i], origin, direction, t, u, v) && t > minDistance && t < distance)
+                    {
+                        distance = t;
+                        hit = i;
+                        hitU = u;
+                        hitV = v;
+                    }
+                }
+                continue;
+            }
+            stack[size++] = node.left;
+            stack[size++] = node.left + 1;
+        }
+        if (hit < 0)
+            return false;
+        const Triangle &triangle = triangles[hit];
+        normal = glm::normalize(triangle.n[0] * (1.0f - hitU - hitV) + triangle.n[1] * hitU + triangle.n[2] * hitV);
+        return true;
+    }
+
+private:
+    struct Triangle {
+        glm::vec3 p[3];
+        glm::vec3 n[3];
+    };
+    // a leaf if count > 0, otherwise its children are left and left + 1
+    struct Node {
+        glm::vec3 min, max;
+        int first, count;
+        int left;
+    };
+    std::vector<Triangle> triangles;
+    std::vector<Node> nodes;
+
+    // fills node index, level levels below the root, with the subtree of triangles
+    // [first, first + count)
+    void build(int index, int first, int count, int level)
+    {
+        Node node;
+        node.min = glm::vec3(FLT_MAX);
+        node.max = glm::vec3(-FLT_MAX);
+        for (int i = first; i < first + count; i++)
+            for (int k = 0; k < 3; k++)
+            {
+                node.min = glm::min(node.min, triangles[i].p[k]);
+                node.max = glm::max(node.max, triangles[i].p[k]);
+            }
+        node.first = first;
+        node.count = count;
+        node.left = 0;
+        if (count > 4 && level + 1 < RAY_CASTER_STACK)
+        {
+            glm::vec3 size = node.max - node.min;
+            int axis = size.x > size.y ? (size.x > size.z ? 0 : 2) : (size.y > size.z ? 1 : 2);
+            int half = count / 2;
+            std::nth_element(triangles.begin() + first, triangles.begin() + first + half, triangles.begin() + first + count,
+                             [axis](const Triangle &a, const Triangle &b) {
+                                 return a.p[0][axis] + a.p[1][axis] + a.p[2][axis] < b.p[0][axis] + b.p[1][axis] + b.p[2][axis];
+                             });
+            node.count = 0;
+            node.left = nodes.size();
+            nodes.resize(nodes.size() + 2);
+            build(node.left, first, half, level + 1);
+            build(node.left + 1, first + half, count - half, level + 1);
+        }
+        nodes[index] = node;
+    }
+
+    // slab test against the node's box, only hits nearer than maxDistance count
+    static bool hitsBox(const Node &node, const glm::vec3 &origin, const glm::vec3 &inverse, float maxDistance)
+    {
+        glm::vec3 t0 = (node.min - origin) * inverse;
+        glm::vec3 t1 = (node.max - origin) * inverse;
+        glm::vec3 tNear = glm::min(t0, t1);
+        glm::vec3 tFar = glm::max(t0, t1);
+        float enter = std::max(std::max(tNear.x, tNear.y), std::max(tNear.z, 0.0f));
+        float exit = std::min(std::min(tFar.x, tFar.y), std::min(tFar.z, maxDistance));
+        return enter <= exit;
+    }
+
+    // Moller-Trumbore, both sides
+    static bool hitsTriangle(const Triangle &triangle, const glm::vec3 &origin, const glm::vec3 &direction, float &t, float &u, float &v)
+    {
+        glm::vec3 e1 = triangle.p[1] - triangle.p[0];
+        glm::vec3 e2 = triangle.p[2] - triangle.p[0];
+        glm::vec3 p = glm::cross(direction, e2);
+        float det = glm::dot(e1, p);
+        if (std::fabs(det) < 1e-12f)
+            return false;
+        float inverseDet = 1.0f / det;
+        glm::vec3 s = origin - triangle.p[0];
+        u = glm::dot(s, p) * inverseDet;
+        if (u < 0.0f || u > 1.0f)
+            return false;
+        glm::vec3 q = glm::cross(s, e1);
+        v = glm::dot(direction, q) * inverseDet;
+        if (v < 0.0f || u + v > 1.0f)
+            return false;
+        t = glm::dot(e2, q) * inverseDet;
+        return true;
+    }
+};
+
+// Object-space thickness of one grain shape. For every vertex x and direction w, bake() casts
+// a ray from just inside x towards w and projects onto SH the distance to where it leaves the
+// grain (the thickness light from w crosses to reach x, 0 where x faces w) and the cosine
+// between w and the surface normal there. The shaders (THICKNESS_MAP) read the nine
+// coefficient pairs of a vertex from a buffer texture and evaluate them for any light in
+// grain space, so model2 and model3 need no light-map pre-pass and any grain rotation or
+// instance works. Both functions are discontinuous at grazing directions, order 2 keeps
+// their smooth part.
+class GrainThickness
+{
+public:
+    // per vertex nine (distance, cosine) coefficients, meshes in model order
+    std::vector<glm::vec2> coefficients;
+
+    GrainThickness() : buffer(0), texture(0), base(0), uploadedBytes(0) {}
+
+    ~GrainThickness()
+    {
+        cleanup();
+    }
+
+    void bake(const Model &model, unsigned int threads = std::thread::hardware_concurrency(), unsigned int directions = 128)
+    {
+        TraceScope trace("bake thickness");
+        MeshRayCaster caster(model);
+        std::vector<glm::vec3> positions, normals;
+        for (unsigned int m = 0; m < model.meshes.size(); m++)
+            for (unsigned int j = 0; j < model.meshes[m].vertices.size(); j++)
+            {
+                positions.push_back(model.meshes[m].vertices[j].Position);
+                normals.push_back(glm::normalize(model.meshes[m].vertices[j].Normal));
+            }
+        size_t count = positions.size();
+        Bounds bounds = modelBounds(model);
+        float epsilon = 1e-4f * glm::length(bounds.max - bounds.min);
+
+        // spherical Fibonacci set, as in GrainTransfer::bake
+        std::vector<glm::vec3> sphere(directions);
+        for (unsigned int d = 0; d < directions; d++)
+        {
+            float z = 1.0f - (2.0f * d + 1.0f) / directions;
+            float r = std::sqrt(1.0f - z * z);
+            float phi = d * 2.39996323f;
+            sphere[d] = glm::vec3(r * std::cos(phi), r * std::sin(phi), z);
+        }
+        float weight = 4.0f * 3.14159265f / directions;
+        coefficients.assign(count * SH_COEFFICIENTS, glm::vec2(0.0f));
+        parallelFor(count, threads, [&](size_t i) {
+            float basis[SH_COEFFICIENTS];
+            glm::vec3 origin = positions[i] - normals[i] * epsilon;
+            for (unsigned int d = 0; d < directions; d++)
+            {
+                float distance;
+                glm::vec3 normal;
+                glm::vec2 value(0.0f, std::max(glm::dot(normals[i], sphere[d]), 0.0f));
+                if (caster.cast(origin, sphere[d], 0.0f, distance, normal))
+                    value = glm::vec2(std::max(distance - epsilon, 0.0f), glm::dot(normal, sphere[d]));
+                shBasis(sphere[d], basis);
+                for (int k = 0; k < SH_COEFFICIENTS; k++)
+                    coefficients[i * SH_COEFFICIENTS + k] += value * (basis[k] * weight);
+            }
+        });
+    }
+
+    // uploads the coefficients as a buffer texture indexed like the arena vertices of model
+    // (gl_VertexID - base), the meshes must already be on the GPU
+    void upload(const Model &model)
+    {
+        cleanup();
+        if (coefficients.empty())
+            return;
+        GLint first, end;
+        modelVertexRange(model, first, end);
+        base = first;
+        std::vector<glm::vec2> texels((size_t)(end - first) * SH_COEFFICIENTS, glm::vec2(0.0f));
+        size_t vertex = 0;
+        for (unsigned int m = 0; m < model.meshes.size(); m++)
+            for (unsigned int j = 0; j < model.meshes[m].vertices.size(); j++, vertex++)
+                std::copy(coefficients.begin() + vertex * SH_COEFFICIENTS, coefficients.begin() + (vertex + 1) * SH_COEFFICIENTS,
+                          texels.begin() + (size_t)(model.meshes[m].range.baseVertex - first + j) * SH_COEFFICIENTS);
+        glGenBuffers(1, &buffer);
+        glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+        glBufferData(GL_TEXTURE_BUFFER, texels.size() * sizeof(glm::vec2), &texels[0], GL_STATIC_DRAW);
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+        glGenTextures(1, &texture);
+        glBindTexture(GL_TEXTURE_BUFFER, texture);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_RG32F, buffer);
+        glBindTexture(GL_TEXTURE_BUFFER, 0);
+        uploadedBytes = texels.size() * sizeof(glm::vec2);
+    }
+
+    // binds the map to THICKNESS_MAP_UNIT and sets the shader's sampler and base
+    void bind(Shader &shader) const
+    {
+        glActiveTexture(GL_TEXTURE0 + THICKNESS_MAP_UNIT);
+        glBindTexture(GL_TEXTURE_BUFFER, texture);
+        glActiveTexture(GL_TEXTURE0);
+        shader.setInt("thicknessMap", THICKNESS_MAP_UNIT);
+        shader.setInt("thicknessBase", base);
+    }
+
+    bool uploaded() const { return texture != 0; }
+
+    size_t bytes() const { return uploaded() ? uploadedBytes : 0; }
+
+    // must be called while the context is still alive
+    void cleanup()
+    {
+        if (texture != 0)
+        {
+            glDeleteTextures(1, &texture);
+            glDeleteBuffers(1, &buffer);
+        }
+        texture = buffer = 0;
+        uploadedBytes = 0;
+    }
+
+private:
+    GLuint buffer, texture;
+    GLint base;
+    size_t uploadedBytes;
+};
+#endif
@@ -0,0 +1,275 @@
+#ifndef GRAIN_TRANSFER_H
+#define GRAIN_TRANSFER_H
+
+#include <glad/glad.h>
+
+#include <glm/glm.hpp>
+
+#include "shader.h"
+#include "model.h"
+#include "mesh.h"
+#include "sh_lighting.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <thread>
+#include <vector>
+
+// texture unit of the transfer buffer, after the mesh material units
+#define PRT_TRANSFER_UNIT (MESH_TEXTURE_UNIT_BASE + MESH_TEXTURE_TYPES * MESH_TEXTURES_PER_TYPE)
+
+// the material uniforms of model3.fs, with its defaults
+struct GrainMaterial {
+    glm::vec3 sigmaSPrime;
+    glm::vec3 sigmaA;
+    float g;
+    float n;
+    // model units to the units of sigma
+    float thicknessScale;
+
+    GrainMaterial() : sigmaSPrime(0.8f), sigmaA(0.2f), g(0.0f), n(1.6f), thicknessScale(4.0f) {}
+};
+
+// calls work(i) for i in [0, count), interleaved over threads
+template <typename F>
+void parallelFor(size_t count, unsigned int threads, const F &work)
+{
+    threads = std::max(threads, 1u);
+    std::vector<std::thread> workers;
+    for (unsigned int t = 0; t < threads; t++)
+        workers.push_back(std::thread([&work, count, threads, t]() {
+            for (size_t i = t; i < count; i += threads)
+                work(i);
+        }));
+    for (unsigned int t = 0; t < threads; t++)
+        workers[t].join();
+}
+
+// the arena vertices [first, end) the meshes of model occupy, gl_VertexID - first indexes
+// per-vertex data in model order
+void modelVertexRange(const Model &model, GLint &first, GLint &end)
+{
+    first = INT_MAX;
+    end = 0;
+    for (unsigned int m = 0; m < model.meshes.size(); m++)
+    {
+        first = std::min(first, model.meshes[m].range.baseVertex);
+        end = std::max(end, model.meshes[m].range.baseVertex + (GLint)model.meshes[m].vertices.size());
+    }
+}
+
+// CPU versions of the model3.fs BSSRDF terms, see the shader for the references
+
+float boundaryA(float n)
+{
+    float C1, C2;
+    if (n >= 1.0f)
+    {
+        C1 = (-9.23372f + 22.2272f * n - 20.9292f * n * n + 10.2291f * n * n * n - 2.54396f * n * n * n * n + 0.254913f * n * n * n * n * n) / 2.0f;
+        C2 = (-1641.1f + 135.926f / (n * n * n) - 656.175f / (n * n) + 1376.53f / n + 1213.67f * n - 568.556f * n * n + 164.798f * n * n * n - 27.0181f * n * n * n * n + 1.91826f * n * n * n * n * n) / 3.0f;
+    }
+    else
+    {
+        C1 = (0.919317f - 3.4793f * n + 6.75335f * n * n - 7.80989f * n * n * n + 4.98554f * n * n * n * n - 1.36881f * n * n * n * n * n) / 2.0f;
+        C2 = (0.828421f - 2.62051f * n + 3.36231f * n * n - 1.95284f * n * n * n + 0.236494f * n * n * n * n + 0.145787f * n * n * n * n * n) / 3.0f;
+    }
+    float Ce = 0.5f * (1.0f - C2);
+    float Cphi = 0.25f * (1.0f - C1);
+    return Cphi == 0.0f ? 0.0f : (1.0f - Ce) / (2.0f * Cphi);
+}
+
+// BSSRDF_distance: dipole at distance r
+glm::vec3 dipoleProfile(float r, const GrainMaterial &material)
+{
+    glm::vec3 sigmaTPrime = material.sigmaSPrime + material.sigmaA;
+    glm::vec3 albedoPrime = material.sigmaSPrime / sigmaTPrime;
+    glm::vec3 D = 1.0f / (3.0f * sigmaTPrime);
+    glm::vec3 sigmaTr = glm::sqrt(material.sigmaA / D);
+    glm::vec3 zr = 1.0f / sigmaTPrime;
+    glm::vec3 zv = zr + 4.0f * boundaryA(material.n) * D;
+    glm::vec3 dr = glm::sqrt(zr * zr + r * r);
+    glm::vec3 dv = glm::sqrt(zv * zv + r * r);
+    glm::vec3 real = (sigmaTr * dr + 1.0f) / (dr * dr * dr * sigmaTPrime) * glm::exp(-sigmaTr * dr);
+    glm::vec3 virt = zv * (1.0f + sigmaTr * dv) / (dv * dv * dv * sigmaTPrime) * glm::exp(-sigmaTr * dv);
+    return albedoPrime / (4.0f * 3.14159265f) * (real + virt);
+}
+
+// SingleScattering2 at distance r without its phase function, Fresnel and cosine factors
+glm::vec3 singleScatteringProfile(float r, const GrainMaterial &material)
+{
+    glm::vec3 sigmaS = material.sigmaSPrime / (1.0f - material.g);
+    glm::vec3 sigmaT = sigmaS + material.sigmaA;
+    glm::vec3 tCrit = 1.0f / sigmaT;
+    glm::vec3 d = glm::sqrt(r * r + tCrit * tCrit);
+    return sigmaS / sigmaT * glm::exp(-sigmaT * (d + tCrit)) / (d * d);
+}
+
+// Fresnel transmittance from air into the grain at incidence cosI
+float fresnelTransmittance(float cosI, float n)
+{
+    cosI = std::min(std::max(cosI, 0.0f), 1.0f);
+    float sinT = std::sqrt(1.0f - cosI * cosI) / n;
+    float cosT = std::sqrt(std::max(1.0f - sinT * sinT, 0.0f));
+    float Rs = (cosI - n * cosT) / (cosI + n * cosT);
+    float Rp = (cosT - n * cosI) / (cosT + n * cosI);
+    return 1.0f - 0.5f * (Rs * Rs + Rp * Rp);
+}
+
+// Precomputed radiance transfer of one grain shape. For every vertex x_o, bake() projects
+// onto SH the subsurface light reaching it from a unit directional light w, the same dipole
+// plus single-scattering sum the model3.fs gather does over light-map texels:
+//     T(w) = sum_i A_i (R(|x_o - x_i|) / pi + S(|x_o - x_i|) p) Ft(n_i.w) max(n_i.w, 0)
+// over the vertices x_i with their surface areas A_i. Every vertex facing w counts as lit,
+// which holds for convex grains. The phase function p is taken as its mean 1/4pi, exact for
+// the default g = 0. Only the Fresnel lobe of x_i depends on w, so each x_i's lobe is
+// projected once and the bake is O(vertices^2 * 9), spread over threads. model3
+// (PRT_TRANSFER) then shades with one dot product per vertex and light, for any grain
+// rotation, without light maps; the view-dependent Fresnel term is applied at run time.
+class GrainTransfer
+{
+public:
+    // per vertex, meshes in model order
+    std::vector<SHCoefficients> transfer;
+
+    GrainTransfer() : buffer(0), texture(0), base(0), uploadedBytes(0) {}
+
+    ~GrainTransfer()
+    {
+        cleanup();
+    }
+
+    void bake(const Model &model, const GrainMaterial &material, unsigned int threads = std::thread::hardware_concurrency(), unsigned int directions = 256)
+    {
+        TraceScope trace("bake transfer");
+        std::vector<glm::vec3> positions, normals;
+        std::vector<float> areas;
+        for (unsigned int m = 0; m < model.meshes.size(); m++)
+        {
+            const Mesh &mesh = model.meshes[m];
+            size_t first = positions.size();
+            for (unsigned int j = 0; j < mesh.vertices.size(); j++)
+            {
+                positions.push_back(mesh.vertices[j].Position);
+                normals.push_back(glm::normalize(mesh.vertices[j].Normal));
+            }
+            areas.resize(positions.size(), 0.0f);
+            // a third of every triangle to each corner
+            for (unsigned int j = 0; j + 2 < mesh.indices.size(); j += 3)
+            {
+                glm::vec3 a = mesh.vertices[mesh.indices[j]].Position;
+                glm::vec3 b = mesh.vertices[mesh.indices[j + 1]].Position;
+                glm::vec3 c = mesh.vertices[mesh.indices[j + 2]].Position;
+                float third = glm::length(glm::cross(b - a, c - a)) / 6.0f;
+                for (int k = 0; k < 3; k++)
+                    areas[first + mesh.indices[j + k]] += third;
+            }
+        }
+        size_t count = positions.size();
+
+        // SH of every vertex's Fresnel-weighted cosine lobe, on a spherical Fibonacci set
+        std::vector<SHCoefficients> lobes(count);
+        std::vector<glm::vec3> sphere(directions);
+        for (unsigned int d = 0; d < directions; d++)
+        {
+            float z = 1.0f - (2.0f * d + 1.0f) / directions;
+            float r = std::sqrt(1.0f - z * z);
+            float phi = d * 2.39996323f;
+            sphere[d] = glm::vec3(r * std::cos(phi), r * std::sin(phi), z);
+        }
+        float weight = 4.0f * 3.14159265f / directions;
+        parallelFor(count, threads, [&](size_t i) {
+            float basis[SH_COEFFICIENTS];
+            for (unsigned int d = 0; d < directions; d++)
+            {
+                float cosI = glm::dot(normals[i], sphere[d]);
+                if (cosI <= 0.0f)
+                    continue;
+                shBasis(sphere[d], basis);
+                float lobe = fresnelTransmittance(cosI, material.n) * cosI * weight;
+                for (int k = 0; k < SH_COEFFICIENTS; k++)
+                    lobes[i].c[k] += glm::vec3(basis[k] * lobe);
+            }
+        });
+
+        float scale = material.thicknessScale;
+        float meanPhase = 1.0f / (4.0f * 3.14159265f);
+        transfer.assign(count, SHCoefficients());
+        parallelFor(count, threads, [&](size_t o) {
+            for (size_t i = 0; i < count; i++)
+            {
+                // model3 skips the gathered point the fragment itself sits on
+                if (glm::dot(normals[o], normals[i]) > 0.999f)
+                    continue;
+                float r = glm::length(positions[o] - positions[i]) * scale;
+                glm::vec3 response = areas[i] * scale * scale * (dipoleProfile(r, material) / 3.14159265f + singleScatteringProfile(r, material) * meanPhase);
+                for (int k = 0; k < SH_COEFFICIENTS; k++)
+                    transfer[o].c[k] += response * lobes[i].c[k];
+            }
+        });
+    }
+
+    // uploads the transfer as a buffer texture indexed like the arena vertices of model
+    // (gl_VertexID - base), the meshes must already be on the GPU
+    void upload(const Model &model)
+    {
+        cleanup();
+        if (transfer.empty())
+            return;
+        GLint first, end;
+        modelVertexRange(model, first, end);
+        base = first;
+        // nine RGB texels per vertex, other models' vertices in between stay zero
+        std::vector<glm::vec3> texels((size_t)(end - first) * SH_COEFFICIENTS, glm::vec3(0.0f));
+        size_t vertex = 0;
+        for (unsigned int m = 0; m < model.meshes.size(); m++)
+            for (unsigned int j = 0; j < model.meshes[m].vertices.size(); j++, vertex++)
+            {
+                size_t at = (size_t)(model.meshes[m].range.baseVertex - first + j) * SH_COEFFICIENTS;
+                for (int k = 0; k < SH_COEFFICIENTS; k++)
+                    texels[at + k] = transfer[vertex].c[k];
+            }
+        glGenBuffers(1, &buffer);
+        glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+        glBufferData(GL_TEXTURE_BUFFER, texels.size() * sizeof(glm::vec3), &texels[0], GL_STATIC_DRAW);
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+        glGenTextures(1, &texture);
+        glBindTexture(GL_TEXTURE_BUFFER, texture);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_RGB32F, buffer);
+        glBindTexture(GL_TEXTURE_BUFFER, 0);
+        uploadedBytes = texels.size() * sizeof(glm::vec3);
+    }
+
+    // binds the transfer to PRT_TRANSFER_UNIT and sets the shader's sampler and base
+    void bind(Shader &shader) const
+    {
+        glActiveTexture(GL_TEXTURE0 + PRT_TRANSFER_UNIT);
+        glBindTexture(GL_TEXTURE_BUFFER, texture);
+        glActiveTexture(GL_TEXTURE0);
+        shader.setInt("transfer", PRT_TRANSFER_UNIT);
+        shader.setInt("transferBase", base);
+    }
+
+    bool uploaded() const { return texture != 0; }
+
+    size_t bytes() const { return uploaded() ? uploadedBytes : 0; }
+
+    // must be called while the context is still alive
+    void cleanup()
+    {
+        if (texture != 0)
+        {
+            glDeleteTextures(1, &texture);
+            glDeleteBuffers(1, &buffer);
+        }
+        texture = buffer = 0;
+        uploadedBytes = 0;
+    }
+
+private:
+    GLuint buffer, texture;
+    GLint base;
+    size_t uploadedBytes;
+};
+#endif
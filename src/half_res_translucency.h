@@ -0,0 +1,138 @@
+#ifndef HALF_RES_TRANSLUCENCY_H
+#define HALF_RES_TRANSLUCENCY_H
+
+#include <glad/glad.h>
+
+#include <glm/glm.hpp>
+
+#include "shader.h"
+#include "profiler.h"
+#include "temporal_translucency.h"
+
+#include <functional>
+#include <iostream>
+
+// texture units of the low-resolution subsurface term and geometry, after the temporal units
+#define HALF_RES_SUBSURFACE_UNIT (TEMPORAL_GEOMETRY_UNIT + 1)
+#define HALF_RES_GEOMETRY_UNIT (TEMPORAL_GEOMETRY_UNIT + 2)
+
+// Subsurface scattering at half the width and height of the view. render() draws the
+// SUBSURFACE_LOW_RES variant of model3 into a quarter-size buffer holding the subsurface term
+// of the lights and the geometry it was gathered for (normal and view depth); the full-size
+// view pass then uses the SUBSURFACE_UPSAMPLE variant, which skips the gather, shades the
+// specular per pixel and takes the subsurface term from the four nearest low-resolution
+// texels weighted bilinearly and by how closely their depth and normal match the pixel's
+// (a joint-bilateral upsample), so the term does not bleed across silhouettes.
+class HalfResTranslucency
+{
+public:
+    // relative view-depth difference at which a texel's weight falls to exp(-1/2)
+    float depthSigma;
+    // exponent of the normal cosine in a texel's weight
+    float normalPower;
+
+    HalfResTranslucency() : depthSigma(0.02f), normalPower(8.0f), width(0), height(0), framebuffer(0), depthBuffer(0)
+    {
+        textures[0] = textures[1] = 0;
+    }
+
+    ~HalfResTranslucency()
+    {
+        cleanup();
+    }
+
+    // draws the subsurface term for a width x height view (the buffer is recreated on
+    // resize); shader is the SUBSURFACE_LOW_RES variant with its light inputs set and draw
+    // draws the scene with it
+    void render(Shader &shader, const std::function<void(Shader &)> &draw, unsigned int width, unsigned int height, PassProfiler &profiler)
+    {
+        ProfileScope scope(profiler, "half-res subsurface pass");
+        unsigned int lowWidth = (width + 1) / 2, lowHeight = (height + 1) / 2;
+        if (lowWidth != this->width || lowHeight != this->height)
+            resize(lowWidth, lowHeight);
+        GLint viewport[4];
+        glGetIntegerv(GL_VIEWPORT, viewport);
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glViewport(0, 0, this->width, this->height);
+        // alpha 0 marks the texels no fragment wrote
+        glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+        draw(shader);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+    }
+
+    // binds the buffer to the SUBSURFACE_UPSAMPLE variant of the view pass
+    void bind(Shader &shader) const
+    {
+        shader.use();
+        glActiveTexture(GL_TEXTURE0 + HALF_RES_SUBSURFACE_UNIT);
+        glBindTexture(GL_TEXTURE_2D, textures[0]);
+        glActiveTexture(GL_TEXTURE0 + HALF_RES_GEOMETRY_UNIT);
+        glBindTexture(GL_TEXTURE_2D, textures[1]);
+        glActiveTexture(GL_TEXTURE0);
+        shader.setInt("lowResSubsurface", HALF_RES_SUBSURFACE_UNIT);
+        shader.setInt("lowResGeometry", HALF_RES_GEOMETRY_UNIT);
+        shader.setFloat("upsampleDepthSigma", depthSigma);
+        shader.setFloat("upsampleNormalPower", normalPower);
+    }
+
+    size_t bytes() const
+    {
+        // subsurface and geometry in RGBA16F plus a 32-bit depth buffer
+        return (size_t)width * height * (8 * 2 + 4);
+    }
+
+    // must be called while the context is still alive
+    void cleanup()
+    {
+        if (framebuffer != 0)
+        {
+            glDeleteFramebuffers(1, &framebuffer);
+            glDeleteRenderbuffers(1, &depthBuffer);
+            glDeleteTextures(2, textures);
+        }
+        framebuffer = depthBuffer = 0;
+        textures[0] = textures[1] = 0;
+        width = height = 0;
+    }
+
+private:
+    unsigned int width, height;
+    GLuint framebuffer, depthBuffer;
+    // subsurface term, geometry
+    GLuint textures[2];
+
+    void resize(unsigned int width, unsigned int height)
+    {
+        cleanup();
+        this->width = width;
+        this->height = height;
+        glGenFramebuffers(1, &framebuffer);
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glGenTextures(2, textures);
+        for (int k = 0; k < 2; k++)
+        {
+            glBindTexture(GL_TEXTURE_2D, textures[k]);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, width, height, 0, GL_RGBA, GL_FLOAT, 0);
+            // read with texelFetch, the upsample does its own filtering
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + k, GL_TEXTURE_2D, textures[k], 0);
+        }
+        const GLenum all[2] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1};
+        glDrawBuffers(2, all);
+        glGenRenderbuffers(1, &depthBuffer);
+        glBindRenderbuffer(GL_RENDERBUFFER, depthBuffer);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT32F, width, height);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthBuffer);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            std::cout << "Half-resolution translucency framebuffer not complete!" << std::endl;
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+};
+#endif
@@ -0,0 +1,283 @@
+#ifndef IRRADIANCE_CLOUD_H
+#define IRRADIANCE_CLOUD_H
+
+#include <glad/glad.h>
+
+#include <glm/glm.hpp>
+
+#include "shader.h"
+#include "model.h"
+#include "grain_transfer.h"
+#include "grain_thickness.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <thread>
+#include <vector>
+
+// texture unit of the cloud's node buffer, after the thickness map unit
+#define IRRADIANCE_CLOUD_UNIT (THICKNESS_MAP_UNIT + 1)
+// vec4s per node in the node buffer: centre and radius, power and skip index
+#define CLOUD_NODE_TEXELS 2
+// points per octree leaf
+#define CLOUD_LEAF_POINTS 8
+
+// A sample of a grain's surface, in grain space, standing for area of it
+struct SurfacePoint {
+    glm::vec3 position;
+    glm::vec3 normal;
+    float area;
+};
+
+// Poisson-disk samples of the model's surface: area-weighted random candidates, kept if no
+// kept point is closer than the spacing count points of equal area would have
+std::vector<SurfacePoint> poissonSurfacePoints(const Model &model, unsigned int count, unsigned int seed = 7)
+{
+    std::vector<SurfacePoint> points;
+    std::vector<glm::vec3> corners, normals;
+    std::vector<float> cumulative;
+    float total = 0.0f;
+    for (unsigned int m = 0; m < model.meshes.size(); m++)
+    {
+        const Mesh &mesh = model.meshes[m];
+        for (unsigned int j = 0; j + 2 < mesh.indices.size(); j += 3)
+        {
+            for (int k = 0; k < 3; k++)
+            {
+                corners.push_back(mesh.vertices[mesh.indices[j + k]].Position);
+                normals.push_back(mesh.vertices[mesh.indices[j + k]].Normal);
+            }
+            size_t first = corners.size() - 3;
+            total += 0.5f * glm::length(glm::cross(corners[first + 1] - corners[first], corners[first + 2] - corners[first]));
+            cumulative.push_back(total);
+        }
+    }
+    if (cumulative.empty() || count == 0)
+        return points;
+
+    // a hexagonal packing of count discs, relaxed a little so the dart throwing can fill it
+    float spacing = 0.75f * std::sqrt(2.0f * total / (std::sqrt(3.0f) * count));
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+    for (unsigned int attempt = 0; attempt < 30 * count && points.size() < count; attempt++)
+    {
+        size_t triangle = std::lower_bound(cumulative.begin(), cumulative.end(), uniform(rng) * total) - cumulative.begin();
+        triangle = std::min(triangle, cumulative.size() - 1);
+        float u = uniform(rng), v = uniform(rng);
+        if (u + v > 1.0f)
+        {
+            u = 1.0f - u;
+            v = 1.0f - v;
+        }
+        const glm::vec3 *p = &corners[triangle * 3];
+        const glm::vec3 *n = &normals[triangle * 3];
+        glm::vec3 position = p[0] + (p[1] - p[0]) * u + (p[2] - p[0]) * v;
+        bool spaced = true;
+        for (unsigned int i = 0; spaced && i < points.size(); i++)
+            spaced = glm::length(points[i].position - position) >= spacing;
+        if (!spaced)
+            continue;
+        SurfacePoint point;
+        point.position = position;
+        point.normal = glm::normalize(n[0] * (1.0f - u - v) + n[1] * u + n[2] * v);
+        points.push_back(point);
+    }
+    for (unsigned int i = 0; i < points.size(); i++)
+        points[i].area = total / points.size();
+    return points;
+}
+
+// Hierarchical irradiance point cloud for the dipole (Jensen and Buhler 2002). build() places
+// a grain's Poisson-disk surface points on every instance, computes their irradiance from the
+// lights on the CPU (Fresnel transmitted, self-shadowed by ray casts against the grain; other
+// grains do not shadow), and sorts them into an octree whose nodes hold their total power
+// (irradiance times area), power-weighted centre and bounding radius. The tree is flattened
+// depth first into a buffer texture where every node stores the index after its subtree, so
+// model3 (POINT_CLOUD) walks it without a stack: a node whose radius looks smaller than error
+// times its distance is taken as one source, otherwise its children are visited. That
+// replaces the light-map grid with about O(log N) dipole evaluations per fragment.
+class IrradianceCloud
+{
+public:
+    // the largest radius / distance a node may have to be evaluated as a whole
+    float error;
+
+    IrradianceCloud() : error(0.3f), buffer(0), texture(0), nodeCount(0) {}
+
+    ~IrradianceCloud()
+    {
+        cleanup();
+    }
+
+    bool built() const { return texture != 0; }
+
+    // points are the grain's surface samples, caster its ray caster, transforms place the
+    // grains and directions (towards the lights) and radiances describe count lights
+    void build(const std::vector<SurfacePoint> &points, const MeshRayCaster &caster, const std::vector<glm::mat4> &transforms,
+               const glm::vec3 *directions, const glm::vec3 *radiances, int count, const GrainMaterial &material,
+               unsigned int threads = std::thread::hardware_concurrency())
+    {
+        TraceScope trace("build irradiance cloud");
+        cleanup();
+        if (points.empty() || transforms.empty())
+            return;
+
+        // irradiance of every point of every grain
+        size_t total = points.size() * transforms.size();
+        std::vector<CloudPoint> cloud(total);
+        float epsilon = 1e-3f * std::sqrt(points[0].area);
+        parallelFor(transforms.size(), threads, [&](size_t g) {
+            const glm::mat4 &transform = transforms[g];
+            // grains are uniformly scaled
+            float scale2 = std::fabs(glm::determinant(glm::mat3(transform)));
+            scale2 = std::pow(scale2, 2.0f / 3.0f);
+            glm::mat3 toGrain = glm::transpose(glm::mat3(transform));
+            for (unsigned int i = 0; i < points.size(); i++)
+            {
+                glm::vec3 irradiance(0.0f);
+                for (int l = 0; l < count; l++)
+                {
+                    glm::vec3 w = glm::normalize(toGrain * directions[l]);
+                    float cosI = glm::dot(points[i].normal, w);
+                    float distance;
+                    glm::vec3 normal;
+                    if (cosI <= 0.0f || caster.cast(points[i].position + points[i].normal * epsilon, w, 0.0f, distance, normal))
+                        continue;
+                    irradiance += radiances[l] * (fresnelTransmittance(cosI, material.n) * cosI);
+                }
+                CloudPoint &point = cloud[g * points.size() + i];
+                point.position = glm::vec3(transform * glm::vec4(points[i].position, 1.0f));
+                point.area = points[i].area * scale2;
+                point.power = irradiance * point.area;
+            }
+        });
+
+        // octree, flattened depth first
+        std::vector<glm::vec4> texels;
+        texels.reserve(total * 2 * CLOUD_NODE_TEXELS);
+        Bounds bounds;
+        for (size_t i = 0; i < total; i++)
+            bounds.add(cloud[i].position);
+        glm::vec3 centre = 0.5f * (bounds.min + bounds.max);
+        glm::vec3 size = bounds.max - bounds.min;
+        float half = 0.5f * std::max(size.x, std::max(size.y, size.z));
+        addNode(cloud, 0, total, centre, half, texels, 0);
+        nodeCount = texels.size() / CLOUD_NODE_TEXELS;
+
+        glGenBuffers(1, &buffer);
+        glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+        glBufferData(GL_TEXTURE_BUFFER, texels.size() * sizeof(glm::vec4), &texels[0], GL_STATIC_DRAW);
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+        glGenTextures(1, &texture);
+        glBindTexture(GL_TEXTURE_BUFFER, texture);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, buffer);
+        glBindTexture(GL_TEXTURE_BUFFER, 0);
+    }
+
+    // binds the nodes to IRRADIANCE_CLOUD_UNIT and sets the shader's uniforms
+    void bind(Shader &shader) const
+    {
+        glActiveTexture(GL_TEXTURE0 + IRRADIANCE_CLOUD_UNIT);
+        glBindTexture(GL_TEXTURE_BUFFER, texture);
+        glActiveTexture(GL_TEXTURE0);
+        shader.setInt("cloudNodes", IRRADIANCE_CLOUD_UNIT);
+        shader.setInt("cloudNodeCount", nodeCount);
+        shader.setFloat("cloudError", error);
+    }
+
+    int nodes() const { return nodeCount; }
+
+    size_t bytes() const { return (size_t)nodeCount * CLOUD_NODE_TEXELS * sizeof(glm::vec4); }
+
+    // must be called while the context is still alive
+    void cleanup()
+    {
+        if (texture != 0)
+        {
+            glDeleteTextures(1, &texture);
+            glDeleteBuffers(1, &buffer);
+        }
+        texture = buffer = 0;
+        nodeCount = 0;
+    }
+
+private:
+    struct CloudPoint {
+        glm::vec3 position;
+        float area;
+        glm::vec3 power;
+    };
+
+    GLuint buffer, texture;
+    int nodeCount;
+
+    // appends the subtree of cloud[first, first + count) in the cube at centre with half
+    // size half, its points are reordered by octant
+    void addNode(std::vector<CloudPoint> &cloud, size_t first, size_t count, const glm::vec3 &centre, float half, std::vector<glm::vec4> &texels, int depth)
+    {
+        if (count == 0)
+            return;
+        size_t index = texels.size() / CLOUD_NODE_TEXELS;
+        texels.resize(texels.size() + CLOUD_NODE_TEXELS);
+        if (count == 1)
+        {
+            const CloudPoint &point = cloud[first];
+            // a point stands for a disc of its area
+            texels[index * CLOUD_NODE_TEXELS] = glm::vec4(point.position, std::sqrt(point.area / 3.14159265f));
+            texels[index * CLOUD_NODE_TEXELS + 1] = glm::vec4(point.power, (float)(index + 1));
+            return;
+        }
+
+        // power-weighted centre (area-weighted where there is no power), bounding radius
+        glm::vec3 power(0.0f), weighted(0.0f), areaWeighted(0.0f);
+        float weight = 0.0f, area = 0.0f;
+        for (size_t i = first; i < first + count; i++)
+        {
+            float w = cloud[i].power.x + cloud[i].power.y + cloud[i].power.z;
+            power += cloud[i].power;
+            weighted += cloud[i].position * w;
+            weight += w;
+            areaWeighted += cloud[i].position * cloud[i].area;
+            area += cloud[i].area;
+        }
+        glm::vec3 position = weight > 0.0f ? weighted / weight : areaWeighted / area;
+        float radius = 0.0f;
+        for (size_t i = first; i < first + count; i++)
+            radius = std::max(radius, glm::length(cloud[i].position - position) + std::sqrt(cloud[i].area / 3.14159265f));
+        texels[index * CLOUD_NODE_TEXELS] = glm::vec4(position, radius);
+
+        if (count <= CLOUD_LEAF_POINTS || depth >= 20)
+        {
+            for (size_t i = first; i < first + count; i++)
+                addNode(cloud, i, 1, centre, half, texels, depth + 1);
+        }
+        else
+        {
+            // partition into octants in place
+            size_t begin[9];
+            begin[0] = first;
+            size_t end = first + count;
+            for (int octant = 0; octant < 8; octant++)
+            {
+                size_t next = std::partition(cloud.begin() + begin[octant], cloud.begin() + end, [&](const CloudPoint &point) {
+                    return octantOf(point.position, centre) == octant;
+                }) - cloud.begin();
+                begin[octant + 1] = next;
+            }
+            for (int octant = 0; octant < 8; octant++)
+            {
+                glm::vec3 offset((octant & 1) ? 0.5f : -0.5f, (octant & 2) ? 0.5f : -0.5f, (octant & 4) ? 0.5f : -0.5f);
+                addNode(cloud, begin[octant], begin[octant + 1] - begin[octant], centre + offset * half, 0.5f * half, texels, depth + 1);
+            }
+        }
+        texels[index * CLOUD_NODE_TEXELS + 1] = glm::vec4(power, (float)(texels.size() / CLOUD_NODE_TEXELS));
+    }
+
+    static int octantOf(const glm::vec3 &position, const glm::vec3 &centre)
+    {
+        return (position.x >= centre.x ? 1 : 0) | (position.y >= centre.y ? 2 : 0) | (position.z >= centre.z ? 4 : 0);
+    }
+};
+#endif
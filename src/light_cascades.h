@@ -0,0 +1,173 @@
+#ifndef LIGHT_CASCADES_H
+#define LIGHT_CASCADES_H
+
+#include <glad/glad.h>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "shader.h"
+#include "stream_buffer.h"
+#include "light_space.h"
+#include "light_map_array.h"
+#include "profiler.h"
+
+#include <cmath>
+#include <functional>
+#include <vector>
+
+// Cascaded light maps for scenes much larger than a grain. The camera frustum, clipped to
+// the scene depth range, is split into cascades; every light gets one compact light map
+// (octahedral normals plus depth, see setupCompactLightMap in main.cpp) per cascade with
+// its ortho box fitted to that slice, so texel density follows the camera. All maps live
+// in a LightMapArray, layer light * cascades + cascade, and model3 picks the cascade per
+// fragment from its view depth (LIGHT_CASCADES). The nearest cascade is redrawn every
+// frame, the others take turns, one per frame.
+class LightCascades
+{
+public:
+    // split between uniform (0) and logarithmic (1) cascade distances
+    float splitBlend;
+
+    LightCascades(unsigned int lights, unsigned int cascades, unsigned int size)
+        : splitBlend(0.75f), lights(lights), cascades(cascades), size(size), next(1), rendered(false)
+    {
+        if (!enabled())
+            return;
+        unsigned int layers = lights * cascades;
+        maps.allocate(layers, size);
+        matrices.assign(layers, glm::mat4(1.0f));
+        fitted.assign(layers, glm::mat4(1.0f));
+        splits.assign(cascades, 0.0f);
+    }
+
+    ~LightCascades()
+    {
+        cleanup();
+    }
+
+    // a single cascade is just the fitted light map of main.cpp
+    bool enabled() const { return cascades > 1; }
+
+    // splits the camera frustum between nearPlane and farPlane, clipped to the view depth of
+    // scene, and fits every light's ortho box to each slice
+    void fit(const glm::mat4 &view, float fov, float aspect, float nearPlane, float farPlane, const Bounds &scene, const glm::vec3 *lightDirections)
+    {
+        if (!enabled() || scene.empty())
+            return;
+        // the camera looks down -z
+        Bounds viewScene = scene.transformed(view);
+        float first = std::max(nearPlane, -viewScene.max.z);
+        float last = std::min(farPlane, -viewScene.min.z);
+        if (last <= first)
+            last = first + 1e-3f;
+
+        float sliceNear = first;
+        for (unsigned int c = 0; c < cascades; c++)
+        {
+            float t = (float)(c + 1) / cascades;
+            float uniform = first + (last - first) * t;
+            float logarithmic = first * std::pow(last / first, t);
+            splits[c] = c + 1 == cascades ? farPlane : splitBlend * logarithmic + (1.0f - splitBlend) * uniform;
+
+            // world space corners of the slice
+            glm::mat4 toWorld = glm::inverse(glm::perspective(glm::radians(fov), aspect, sliceNear, std::max(splits[c], sliceNear + 1e-3f)) * view);
+            Bounds slice;
+            for (int i = 0; i < 8; i++)
+            {
+                glm::vec4 corner = toWorld * glm::vec4(i & 1 ? 1.0f : -1.0f, i & 2 ? 1.0f : -1.0f, i & 4 ? 1.0f : -1.0f, 1.0f);
+                slice.add(glm::vec3(corner) / corner.w);
+            }
+            Bounds focus = slice.intersected(scene);
+            if (focus.empty())
+                focus = scene;
+            for (unsigned int light = 0; light < lights; light++)
+                fitted[light * cascades + c] = fitLightSpaceMatrix(lightDirections[light], focus, scene, size);
+            sliceNear = splits[c];
+        }
+    }
+
+    // redraws the nearest cascade and the next of the others for every light (all of them the
+    // first time) with the octahedral normal shader; draw issues the scene's draw calls
+    void render(Shader &shader, const std::function<void(Shader &)> &draw, PassProfiler &profiler)
+    {
+        if (!enabled())
+            return;
+        ProfileScope scope(profiler, "cascade pre-pass");
+        GLint viewport[4];
+        glGetIntegerv(GL_VIEWPORT, viewport);
+        glViewport(0, 0, size, size);
+        glEnable(GL_DEPTH_TEST);
+        glEnable(GL_CULL_FACE);
+        glCullFace(GL_BACK);
+        shader.use();
+        shader.setMat4("model", glm::mat4(1.0f));
+        shader.setMat3("normalMatrix", glm::mat3(1.0f));
+        for (unsigned int c = 0; c < cascades; c++)
+        {
+            if (rendered && c != 0 && c != next)
+                continue;
+            for (unsigned int light = 0; light < lights; light++)
+            {
+                unsigned int layer = light * cascades + c;
+                maps.beginLayer(layer);
+                // the matrix the map was drawn with is the one the shading pass must use
+                matrices[layer] = fitted[layer];
+                shader.setMat4("lightSpaceMatrix", matrices[layer]);
+                draw(shader);
+            }
+        }
+        next = next + 1 < cascades ? next + 1 : 1;
+        rendered = true;
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+    }
+
+    // binds the maps to LIGHT_NORMAL_ARRAY_UNIT and LIGHT_DEPTH_ARRAY_UNIT
+    void bindTextures() const
+    {
+        if (enabled())
+            maps.bindTextures();
+    }
+
+    // writes the CascadeData block: the light-space matrix of every layer, then the far
+    // distance of every cascade (std140 gives the float array a 16 byte stride)
+    void stream(StreamBuffer &stream) const
+    {
+        if (!enabled())
+            return;
+        std::vector<glm::vec4> block;
+        block.reserve(matrices.size() * 4 + cascades);
+        for (unsigned int i = 0; i < matrices.size(); i++)
+            for (int column = 0; column < 4; column++)
+                block.push_back(matrices[i][column]);
+        for (unsigned int c = 0; c < cascades; c++)
+            block.push_back(glm::vec4(splits[c], 0.0f, 0.0f, 0.0f));
+        stream.bindUniforms(CASCADE_BLOCK_BINDING, &block[0], block.size() * sizeof(glm::vec4));
+    }
+
+    size_t bytes() const
+    {
+        return maps.bytes();
+    }
+
+    // must be called while the context is still alive
+    void cleanup()
+    {
+        maps.cleanup();
+    }
+
+private:
+    unsigned int lights;
+    unsigned int cascades;
+    unsigned int size;
+    LightMapArray maps;
+    // per layer, the matrices the maps were last drawn with and the latest fitted ones
+    std::vector<glm::mat4> matrices;
+    std::vector<glm::mat4> fitted;
+    std::vector<float> splits;
+    // the far cascade redrawn next frame
+    unsigned int next;
+    bool rendered;
+};
+#endif
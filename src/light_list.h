@@ -0,0 +1,250 @@
+#ifndef LIGHT_LIST_H
+#define LIGHT_LIST_H
+
+#include <glad/glad.h>
+
+#include <glm/glm.hpp>
+
+#include "shader.h"
+#include "light_space.h"
+#include "light_map_array.h"
+#include "profiler.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <vector>
+
+// texture units of the light list and the tile lists
+#define LIGHT_LIST_UNIT 6
+#define LIGHT_TILES_UNIT 7
+// vec4s per light in the light list: lightSpaceMatrix columns, direction and map layer, radiance
+#define LIGHT_TEXELS 6
+
+// a directional light that only reaches the region box (the whole scene if it is empty)
+struct Light {
+    // towards the light
+    glm::vec3 direction;
+    glm::vec3 radiance;
+    Bounds region;
+
+    Light(const glm::vec3 &direction, const glm::vec3 &radiance, const Bounds &region = Bounds())
+        : direction(direction), radiance(radiance), region(region) {}
+};
+
+// Any number of lights for model3 (LIGHT_LIST). GL 4.1 has no storage buffers, so the light
+// list is a buffer texture of LIGHT_TEXELS vec4s per light, and every light has a compact
+// light map in one LightMapArray with its ortho box fitted to its region. assign() bins the
+// lights into screen tiles on the CPU by the screen rectangle of their region; the tile
+// buffer texture holds the tile size and tiles per row, then an (offset, count) pair per
+// tile, then the light indices the pairs point at. A fragment only loops over its tile's
+// lights. The maps are redrawn only after invalidate(), the tiles are rebuilt every frame.
+class LightList
+{
+public:
+    std::vector<Light> lights;
+    // screen tile size in pixels
+    unsigned int tileSize;
+
+    LightList(unsigned int mapSize, unsigned int tileSize = 32)
+        : tileSize(tileSize), mapSize(mapSize), lightBuffer(0), lightTexture(0), tileBuffer(0), tileTexture(0), dirty(true), maxTileLights(0)
+    {
+        glGenBuffers(1, &lightBuffer);
+        glGenTextures(1, &lightTexture);
+        glGenBuffers(1, &tileBuffer);
+        glGenTextures(1, &tileTexture);
+    }
+
+    ~LightList()
+    {
+        cleanup();
+    }
+
+    // call after changing lights or the scene, the next render() redraws the maps
+    void invalidate() { dirty = true; }
+
+    // fits the maps to the lights' regions within scene and redraws them with the octahedral
+    // normal shader if anything changed; draw issues the scene's draw calls
+    void render(Shader &shader, const std::function<void(Shader &)> &draw, const Bounds &scene, PassProfiler &profiler)
+    {
+        if (!dirty || lights.empty())
+            return;
+        ProfileScope scope(profiler, "light list pre-pass");
+        if (maps.layerCount() != lights.size())
+            maps.allocate(lights.size(), mapSize);
+
+        regions.resize(lights.size());
+        std::vector<glm::vec4> texels;
+        texels.reserve(lights.size() * LIGHT_TEXELS);
+        GLint viewport[4];
+        glGetIntegerv(GL_VIEWPORT, viewport);
+        glViewport(0, 0, mapSize, mapSize);
+        glEnable(GL_DEPTH_TEST);
+        glEnable(GL_CULL_FACE);
+        glCullFace(GL_BACK);
+        shader.use();
+        shader.setMat4("model", glm::mat4(1.0f));
+        shader.setMat3("normalMatrix", glm::mat3(1.0f));
+        for (unsigned int i = 0; i < lights.size(); i++)
+        {
+            regions[i] = lights[i].region.empty() ? scene : lights[i].region.intersected(scene);
+            glm::mat4 lightSpaceMatrix = fitLightSpaceMatrix(lights[i].direction, regions[i], scene, mapSize);
+            maps.beginLayer(i);
+            shader.setMat4("lightSpaceMatrix", lightSpaceMatrix);
+            if (!regions[i].empty())
+                draw(shader);
+
+            for (int column = 0; column < 4; column++)
+                texels.push_back(lightSpaceMatrix[column]);
+            texels.push_back(glm::vec4(lights[i].direction, (float)i));
+            texels.push_back(glm::vec4(lights[i].radiance, 0.0f));
+        }
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+
+        glBindBuffer(GL_TEXTURE_BUFFER, lightBuffer);
+        glBufferData(GL_TEXTURE_BUFFER, texels.size() * sizeof(glm::vec4), &texels[0], GL_STATIC_DRAW);
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+        glBindTexture(GL_TEXTURE_BUFFER, lightTexture);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, lightBuffer);
+        glBindTexture(GL_TEXTURE_BUFFER, 0);
+        dirty = false;
+    }
+
+    // bins the lights into width x height pixel tiles for this camera
+    void assign(const glm::mat4 &view, const glm::mat4 &projection, unsigned int width, unsigned int height)
+    {
+        TraceScope trace("assign lights");
+        unsigned int tilesX = (width + tileSize - 1) / tileSize;
+        unsigned int tilesY = (height + tileSize - 1) / tileSize;
+        unsigned int tiles = tilesX * tilesY;
+
+        // screen rectangle of every light's region in tiles, first x, first y, last x, last y
+        std::vector<glm::ivec4> rects(regions.size());
+        std::vector<int> counts(tiles, 0);
+        glm::mat4 viewProjection = projection * view;
+        for (unsigned int i = 0; i < regions.size(); i++)
+        {
+            rects[i] = screenTiles(regions[i], viewProjection, width, height, tilesX, tilesY);
+            for (int y = rects[i].y; y <= rects[i].w; y++)
+                for (int x = rects[i].x; x <= rects[i].z; x++)
+                    counts[y * tilesX + x]++;
+        }
+
+        // header, (offset, count) per tile, indices
+        tileData.assign(2 + 2 * tiles, 0);
+        tileData[0] = tileSize;
+        tileData[1] = tilesX;
+        int offset = 2 + 2 * tiles;
+        maxTileLights = 0;
+        for (unsigned int t = 0; t < tiles; t++)
+        {
+            tileData[2 + 2 * t] = offset;
+            offset += counts[t];
+            maxTileLights = std::max(maxTileLights, (unsigned int)counts[t]);
+            counts[t] = 0;
+        }
+        tileData.resize(offset, 0);
+        for (unsigned int i = 0; i < regions.size(); i++)
+            for (int y = rects[i].y; y <= rects[i].w; y++)
+                for (int x = rects[i].x; x <= rects[i].z; x++)
+                {
+                    unsigned int t = y * tilesX + x;
+                    tileData[tileData[2 + 2 * t] + counts[t]++] = i;
+                    tileData[3 + 2 * t] = counts[t];
+                }
+
+        glBindBuffer(GL_TEXTURE_BUFFER, tileBuffer);
+        glBufferData(GL_TEXTURE_BUFFER, tileData.size() * sizeof(int), &tileData[0], GL_STREAM_DRAW);
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+        glBindTexture(GL_TEXTURE_BUFFER, tileTexture);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_R32I, tileBuffer);
+        glBindTexture(GL_TEXTURE_BUFFER, 0);
+    }
+
+    // binds the light list, the tiles and the maps to their units
+    void bindTextures() const
+    {
+        glActiveTexture(GL_TEXTURE0 + LIGHT_LIST_UNIT);
+        glBindTexture(GL_TEXTURE_BUFFER, lightTexture);
+        glActiveTexture(GL_TEXTURE0 + LIGHT_TILES_UNIT);
+        glBindTexture(GL_TEXTURE_BUFFER, tileTexture);
+        glActiveTexture(GL_TEXTURE0);
+        maps.bindTextures();
+    }
+
+    // most lights any tile of the last assign() had
+    unsigned int busiestTile() const { return maxTileLights; }
+
+    // the lights model3 loops over at pixel (x, y), as of the last assign()
+    std::vector<int> pixelLights(unsigned int x, unsigned int y) const
+    {
+        if (tileData.size() < 2)
+            return std::vector<int>();
+        unsigned int t = (y / tileData[0]) * tileData[1] + x / tileData[0];
+        if (3 + 2 * t >= tileData.size())
+            return std::vector<int>();
+        std::vector<int>::const_iterator first = tileData.begin() + tileData[2 + 2 * t];
+        return std::vector<int>(first, first + tileData[3 + 2 * t]);
+    }
+
+    size_t bytes() const
+    {
+        return maps.bytes() + lights.size() * LIGHT_TEXELS * sizeof(glm::vec4) + tileData.size() * sizeof(int);
+    }
+
+    // must be called while the context is still alive
+    void cleanup()
+    {
+        maps.cleanup();
+        if (lightBuffer != 0)
+        {
+            glDeleteBuffers(1, &lightBuffer);
+            glDeleteTextures(1, &lightTexture);
+            glDeleteBuffers(1, &tileBuffer);
+            glDeleteTextures(1, &tileTexture);
+        }
+        lightBuffer = lightTexture = tileBuffer = tileTexture = 0;
+        dirty = true;
+    }
+
+private:
+    unsigned int mapSize;
+    LightMapArray maps;
+    // the part of the scene each light reaches, as of the last render()
+    std::vector<Bounds> regions;
+    GLuint lightBuffer, lightTexture;
+    GLuint tileBuffer, tileTexture;
+    std::vector<int> tileData;
+    bool dirty;
+    unsigned int maxTileLights;
+
+    // tiles of tileSize pixels (model3 finds a fragment's as gl_FragCoord / tileSize) covered
+    // by the box on screen, an empty range (first > last) if it is off screen
+    glm::ivec4 screenTiles(const Bounds &box, const glm::mat4 &viewProjection, unsigned int width, unsigned int height, unsigned int tilesX, unsigned int tilesY) const
+    {
+        glm::ivec4 none(0, 0, -1, -1);
+        glm::ivec4 all(0, 0, tilesX - 1, tilesY - 1);
+        if (box.empty())
+            return none;
+        glm::vec2 low(FLT_MAX), high(-FLT_MAX);
+        for (int i = 0; i < 8; i++)
+        {
+            glm::vec4 clip = viewProjection * glm::vec4(box.corner(i), 1.0f);
+            // a corner behind the camera, the box may cover anything
+            if (clip.w <= 0.0f)
+                return all;
+            glm::vec2 ndc = glm::vec2(clip) / clip.w;
+            low = glm::min(low, ndc);
+            high = glm::max(high, ndc);
+        }
+        if (high.x < -1.0f || high.y < -1.0f || low.x > 1.0f || low.y > 1.0f)
+            return none;
+        glm::vec2 tilesPerUnit = 0.5f * glm::vec2(width, height) / (float)tileSize;
+        low = glm::clamp((low + 1.0f) * tilesPerUnit, glm::vec2(0.0f), glm::vec2(tilesX - 1, tilesY - 1));
+        high = glm::clamp((high + 1.0f) * tilesPerUnit, glm::vec2(0.0f), glm::vec2(tilesX - 1, tilesY - 1));
+        return glm::ivec4((int)low.x, (int)low.y, (int)high.x, (int)high.y);
+    }
+};
+#endif
@@ -0,0 +1,122 @@
+#ifndef LIGHT_MAP_ARRAY_H
+#define LIGHT_MAP_ARRAY_H
+
+#include <glad/glad.h>
+
+#include <iostream>
+#include <vector>
+
+// texture units of the light-map arrays, after the per-light maps and before the materials
+#define LIGHT_NORMAL_ARRAY_UNIT 4
+#define LIGHT_DEPTH_ARRAY_UNIT 5
+
+// Compact light maps (octahedral normals plus depth, see setupCompactLightMap in main.cpp)
+// for many maps of one size, kept in two GL_TEXTURE_2D_ARRAYs with a framebuffer per layer.
+// The shaders read them as lightNormalMaps and lightDepthMaps.
+class LightMapArray
+{
+public:
+    LightMapArray() : normals(0), depths(0), layers(0), size(0) {}
+
+    ~LightMapArray()
+    {
+        cleanup();
+    }
+
+    unsigned int layerCount() const { return layers; }
+    unsigned int mapSize() const { return size; }
+
+    // (re)creates layers maps of size x size, the old contents are lost
+    void allocate(unsigned int layers, unsigned int size)
+    {
+        cleanup();
+        if (layers == 0 || size == 0)
+            return;
+        this->layers = layers;
+        this->size = size;
+        glGenTextures(1, &depths);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, depths);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_DEPTH_COMPONENT32F, size, size, layers, 0, GL_DEPTH_COMPONENT, GL_FLOAT, 0);
+        // filtering depth across the silhouette would make up points between the grain and the far plane
+        setParameters(GL_NEAREST);
+        glGenTextures(1, &normals);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, normals);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RG16_SNORM, size, size, layers, 0, GL_RG, GL_FLOAT, 0);
+        setParameters(GL_LINEAR);
+
+        framebuffers.resize(layers);
+        glGenFramebuffers(layers, &framebuffers[0]);
+        for (unsigned int layer = 0; layer < layers; layer++)
+        {
+            glBindFramebuffer(GL_FRAMEBUFFER, framebuffers[layer]);
+            glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, normals, 0, layer);
+            glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, depths, 0, layer);
+            glDrawBuffer(GL_COLOR_ATTACHMENT0);
+            // GL 4.1 does not require SNORM formats to be renderable, RG16F has the same size
+            if (layer == 0 && glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            {
+                glBindTexture(GL_TEXTURE_2D_ARRAY, normals);
+                glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RG16F, size, size, layers, 0, GL_RG, GL_FLOAT, 0);
+                glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, normals, 0, layer);
+                std::cout << "RG16_SNORM is not renderable, using RG16F for the light-map normals" << std::endl;
+            }
+            if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+                std::cout << "Light-map array framebuffer not complete!" << std::endl;
+        }
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    }
+
+    // binds and clears the layer's framebuffer, the viewport must be set to mapSize()
+    void beginLayer(unsigned int layer)
+    {
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffers[layer]);
+        glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    }
+
+    // binds the arrays to LIGHT_NORMAL_ARRAY_UNIT and LIGHT_DEPTH_ARRAY_UNIT
+    void bindTextures() const
+    {
+        glActiveTexture(GL_TEXTURE0 + LIGHT_NORMAL_ARRAY_UNIT);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, normals);
+        glActiveTexture(GL_TEXTURE0 + LIGHT_DEPTH_ARRAY_UNIT);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, depths);
+        glActiveTexture(GL_TEXTURE0);
+    }
+
+    size_t bytes() const
+    {
+        return (size_t)size * size * layers * (4 + 4);
+    }
+
+    // must be called while the context is still alive
+    void cleanup()
+    {
+        if (!framebuffers.empty())
+            glDeleteFramebuffers(framebuffers.size(), &framebuffers[0]);
+        framebuffers.clear();
+        if (normals != 0)
+            glDeleteTextures(1, &normals);
+        if (depths != 0)
+            glDeleteTextures(1, &depths);
+        normals = 0;
+        depths = 0;
+        layers = 0;
+    }
+
+private:
+    GLuint normals, depths;
+    std::vector<GLuint> framebuffers;
+    unsigned int layers;
+    unsigned int size;
+
+    void setParameters(GLint filter)
+    {
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, filter);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, filter);
+    }
+};
+#endif
@@ -0,0 +1,115 @@
+#ifndef LIGHT_SPACE_H
+#define LIGHT_SPACE_H
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "model.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <vector>
+
+// axis-aligned bounding box, empty until a point is added
+struct Bounds {
+    glm::vec3 min;
+    glm::vec3 max;
+
+    Bounds() : min(FLT_MAX), max(-FLT_MAX) {}
+
+    bool empty() const { return min.x > max.x; }
+
+    void add(const glm::vec3 &point)
+    {
+        min = glm::min(min, point);
+        max = glm::max(max, point);
+    }
+
+    void add(const Bounds &bounds)
+    {
+        if (bounds.empty())
+            return;
+        add(bounds.min);
+        add(bounds.max);
+    }
+
+    glm::vec3 corner(int i) const
+    {
+        return glm::vec3(i & 1 ? max.x : min.x, i & 2 ? max.y : min.y, i & 4 ? max.z : min.z);
+    }
+
+    // overlap of the two boxes, empty if they do not touch
+    Bounds intersected(const Bounds &other) const
+    {
+        Bounds bounds;
+        glm::vec3 low = glm::max(min, other.min);
+        glm::vec3 high = glm::min(max, other.max);
+        if (empty() || other.empty() || low.x > high.x || low.y > high.y || low.z > high.z)
+            return bounds;
+        bounds.min = low;
+        bounds.max = high;
+        return bounds;
+    }
+
+    // bounds of the eight corners after transform
+    Bounds transformed(const glm::mat4 &transform) const
+    {
+        Bounds bounds;
+        if (empty())
+            return bounds;
+        for (int i = 0; i < 8; i++)
+            bounds.add(glm::vec3(transform * glm::vec4(corner(i), 1.0f)));
+        return bounds;
+    }
+};
+
+Bounds modelBounds(const Model &model)
+{
+    Bounds bounds;
+    for (unsigned int i = 0; i < model.meshes.size(); i++)
+        for (unsigned int j = 0; j < model.meshes[i].vertices.size(); j++)
+            bounds.add(model.meshes[i].vertices[j].Position);
+    return bounds;
+}
+
+// bounds of a model drawn once per transform
+Bounds instanceBounds(const Bounds &model, const std::vector<glm::mat4> &transforms)
+{
+    Bounds bounds;
+    for (unsigned int i = 0; i < transforms.size(); i++)
+        bounds.add(model.transformed(transforms[i]));
+    return bounds;
+}
+
+// Light view looking along -lightDir at focus, with the ortho box fitted to focus across
+// and to scene along the light, so surfaces between the light and focus are still drawn.
+// The box is square so the light-map texels are, and padded by a couple of texels of a
+// mapSize map so the silhouette does not touch the border.
+glm::mat4 fitLightSpaceMatrix(glm::vec3 lightDir, const Bounds &focus, const Bounds &scene, unsigned int mapSize)
+{
+    if (focus.empty())
+        return glm::mat4(1.0f);
+    glm::vec3 center = 0.5f * (focus.min + focus.max);
+    float extent = 0.5f * glm::length(focus.max - focus.min);
+    glm::vec3 direction = glm::normalize(lightDir);
+    glm::vec3 up = std::fabs(direction.y) > 0.99f ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+    glm::mat4 lightView = glm::lookAt(center + direction * (extent + 1.0f), center, up);
+
+    Bounds light = focus.transformed(lightView);
+    glm::vec2 middle = 0.5f * glm::vec2(light.min + light.max);
+    float half = 0.5f * std::max(light.max.x - light.min.x, light.max.y - light.min.y);
+    half *= 1.0f + 4.0f / std::max(mapSize, 8u);
+    light.add(scene.transformed(lightView));
+    // the view looks down -z, depth padded so the closest and farthest points are not clipped
+    float depthPadding = 0.01f * (light.max.z - light.min.z) + 1e-4f;
+    glm::mat4 lightProjection = glm::ortho(middle.x - half, middle.x + half, middle.y - half, middle.y + half,
+                                           -light.max.z - depthPadding, -light.min.z + depthPadding);
+    return lightProjection * lightView;
+}
+
+glm::mat4 fitLightSpaceMatrix(glm::vec3 lightDir, const Bounds &bounds, unsigned int mapSize)
+{
+    return fitLightSpaceMatrix(lightDir, bounds, bounds, mapSize);
+}
+#endif
@@ -3,9 +3,25 @@
 #include "libraries/GLFW/glfw3.h"
 #include <iostream>
 #include "shader.h"
+#include "shader_permutations.h"
+#include "shader_reloader.h"
+#include "asset_loader.h"
+#include "frame_data.h"
+#include "light_space.h"
+#include "light_cascades.h"
+#include "light_list.h"
+#include "sh_lighting.h"
+#include "grain_transfer.h"
+#include "grain_thickness.h"
+#include "irradiance_cloud.h"
+#include "translucency_cache.h"
+#include "temporal_translucency.h"
+#include "half_res_translucency.h"
+#include "grain_medium.h"
 #include "sphere.h"
 #include "model.h"
 #include "filesystem.h"
+#include "profiler.h"
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "libraries/stb_image.h"
@@ -28,6 +44,9 @@ unsigned int SCR_HEIGHT = 1000;
 double lastTime = glfwGetTime();
 int nbFrames = 0;
 
+// per-pass GPU/CPU timings (toggle the overlay with O)
+PassProfiler profiler;
+
 // object 
 float objectRadius = 2.5f;
 
@@ -42,10 +61,55 @@ float fov = 45.0f;
 float nearPlane = 0.5f;
 float farPlane = 20.0f;
 
-float leftBoundary = -2.5f;
-float rightBoundary = 2.5f; 
-float bottomBoundary = -2.5f;
-float topBoundary = 2.5f;
+// light-map size per light, independent of the window (the gather cost of model3 is
+// (size / sampleStep)^2 per light), the ortho bounds are fitted to sceneBounds
+unsigned int lightMapSizes[] = {1000, 1000};
+Bounds sceneBounds;
+// camera-fitted cascades per light for large grain aggregates (1 keeps the single map
+// above), they replace the per-light maps and share one size
+unsigned int lightCascades = 1;
+unsigned int cascadeMapSize = 1024;
+// read the lights from a light list with screen-tiled culling instead of the fixed
+// lightDirections arrays, for any number of lights with their own regions (see light_list.h);
+// replaces the per-light maps and the cascades
+bool useLightList = false;
+unsigned int lightListMapSize = 1024;
+// lat-long HDR environment added to the lights through spherical harmonics (see
+// sh_lighting.h), projected once on load; left off if the file cannot be read
+bool environmentLighting = false;
+const char *environmentMapPath = "resources/textures/environment.exr";
+SHCoefficients environmentIrradiance;
+// distance the environment's light crosses the grain to reach the far side, the grain's mean
+// chord once the model has loaded
+float environmentThickness = 1.0f;
+// shade the subsurface part from the grain's precomputed radiance transfer instead of the
+// light-map gather (see grain_transfer.h), baked on the CPU once the model has loaded
+bool usePRT = false;
+GrainTransfer grainTransfer;
+// read the thickness towards each light from the grain's baked thickness map instead of the
+// light maps (see grain_thickness.h), ray cast on the CPU once the model has loaded
+bool useThicknessMap = false;
+GrainThickness grainThickness;
+// shade the dipole from a hierarchical irradiance point cloud instead of the light-map gather
+// (see irradiance_cloud.h), built on the CPU once the model has loaded
+bool usePointCloud = false;
+unsigned int pointCloudSamples = 1024;
+IrradianceCloud irradianceCloud;
+// keep the lights' subsurface term in a texture-space cache of the grain, redrawn only when
+// the lights or the shading options change, and draw the view pass from it (see
+// translucency_cache.h); needs the light maps, not the transfer, thickness map or cloud
+bool useTranslucencyCache = false;
+unsigned int translucencyCacheSize = 2048;
+TranslucencyCache translucencyCache;
+// reuse the previous frame's subsurface term where the surface reprojects onto itself and
+// gather only the rest plus a rotating share of the screen (see temporal_translucency.h)
+bool useTemporalReuse = false;
+TemporalTranslucency temporalTranslucency;
+// gather the subsurface term at half the width and height and upsample it into the view
+// pass with a joint-bilateral filter (see half_res_translucency.h); light-map gather only, not
+// with the light list, whose tiles are in full-size pixels (checkOptions refuses the rest)
+bool useHalfResTranslucency = false;
+HalfResTranslucency halfResTranslucency;
 
 // MSAA (0 for none)
 int MSAA_SampleCount = 0;
@@ -55,6 +119,8 @@ GLuint FramebufferName;
 GLuint depthTextures[2];
 GLuint normalTextures[2];
 GLuint vertexTextures[2];
+// one framebuffer per light for the compact light maps (normal map plus depth texture)
+GLuint lightMapFramebuffers[2];
 
 GLuint hdrFBO;
 GLuint colorBuffer;
@@ -74,6 +140,18 @@ glm::vec3 lightRadiances[] = {
     };
 glm::mat4 lightSpaceMatrices[2];
 
+// translucency shader options, baked into the shader variant (see translucencyDefines)
+// toggle with 1 (dipole), 2 (single scattering), 3 (specular) and G (gather mode)
+int sampleStep = 35;
+bool enableDipole = true;
+bool enableSingleScattering = true;
+bool enableSpecular = true;
+// 0 regular grid, 1 jittered grid, 2 adaptive (coarse grid refined where it varies)
+int gatherMode = 0;
+// store light-map normals octahedral encoded in RG16_SNORM and rebuild positions from the
+// light's depth (8 bytes per texel) instead of RGB32F normal and position maps (28 bytes)
+bool compactLightMaps = true;
+
 
 
 
@@ -83,6 +161,67 @@ glm::mat4 viewMatrix = glm::lookAt(cameraPos, glm::vec3(0.0f, 0.0f, 0.0f), glm::
 glm::mat4 projectionMatrix = glm::perspective(glm::radians(fov), (float)SCR_WIDTH/(float)SCR_HEIGHT, nearPlane, farPlane); // Calculate projection matrix
 
 
+// writes this frame's camera and light uniform blocks, shared by all passes of the frame
+void streamFrameData(StreamBuffer &stream)
+{
+    CameraBlock camera;
+    camera.projection = projectionMatrix;
+    camera.view = viewMatrix;
+    camera.eyePos = cameraPos;
+    camera.nearPlane = nearPlane;
+    camera.resolution = glm::vec2(SCR_WIDTH, SCR_HEIGHT);
+    camera.farPlane = farPlane;
+    camera.padding = 0.0f;
+    streamCamera(stream, camera);
+    streamLights(stream, sizeof(lightDirections)/sizeof(lightDirections[0]), lightSpaceMatrices, lightDirections, lightRadiances);
+}
+
+// defines selecting the model3.fs variant for the current options
+ShaderDefines translucencyDefines()
+{
+    ShaderDefines defines;
+    defines["MAX_LIGHTS"] = std::to_string(sizeof(lightDirections)/sizeof(lightDirections[0]));
+    defines["SAMPLE_STEP"] = std::to_string(sampleStep);
+    defines["ENABLE_DIPOLE"] = enableDipole ? "1" : "0";
+    defines["ENABLE_SINGLE_SCATTERING"] = enableSingleScattering ? "1" : "0";
+    defines["ENABLE_SPECULAR"] = enableSpecular ? "1" : "0";
+    defines["GATHER_MODE"] = std::to_string(gatherMode);
+    defines["COMPACT_LIGHT_MAPS"] = compactLightMaps ? "1" : "0";
+    defines["LIGHT_CASCADES"] = std::to_string(lightCascades);
+    defines["LIGHT_LIST"] = useLightList ? "1" : "0";
+    defines["LIGHT_TEXELS"] = std::to_string(LIGHT_TEXELS);
+    defines["ENVIRONMENT_SH"] = environmentLighting ? "1" : "0";
+    defines["PRT_TRANSFER"] = usePRT ? "1" : "0";
+    defines["THICKNESS_MAP"] = useThicknessMap ? "1" : "0";
+    defines["POINT_CLOUD"] = usePointCloud ? "1" : "0";
+    defines["TRANSLUCENCY_CACHE"] = useTranslucencyCache ? "1" : "0";
+    defines["TEMPORAL_REUSE"] = useTemporalReuse ? "1" : "0";
+    defines["SUBSURFACE_UPSAMPLE"] = useHalfResTranslucency ? "1" : "0";
+    return defines;
+}
+
+// false after printing why if the options above cannot be combined; model3 would otherwise
+// drop one of them without a word while the other is still baked and bound
+bool checkOptions()
+{
+    // the cache bake draws the grain's atlas, it picks no screen tile or cascade and reads the
+    // per-light maps the transfer, thickness map and cloud do without
+    if (useTranslucencyCache && (useLightList || lightCascades > 1 || usePRT || useThicknessMap || usePointCloud))
+    {
+        std::cout << "The translucency cache cannot be combined with the light list, cascades, PRT, thickness maps or the point cloud" << std::endl;
+        return false;
+    }
+    // the half-resolution pass upsamples the light-map gather, its pixels are not the light
+    // list's and the other modes have no gather to upsample
+    if (useHalfResTranslucency && (useLightList || usePRT || useThicknessMap || usePointCloud || useTranslucencyCache || useTemporalReuse))
+    {
+        std::cout << "Half-resolution translucency cannot be combined with the light list, PRT, thickness maps, the point cloud, "
+                     "the translucency cache or temporal reuse" << std::endl;
+        return false;
+    }
+    return true;
+}
+
 // set up color buffer for HDR rendering
 void setupColorBuffer()
 {
@@ -111,6 +250,64 @@ void setupColorBuffer()
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
 }
 
+// binds the light maps and the precomputed data to the translucency shader and sets its
+// model matrix, shared by the view passes and the cache bake
+void setTranslucencyInputs(Shader &shader)
+{
+    shader.use();
+    // pass normal and vertex (or depth) textures to the shader
+    for (unsigned int i = 0; i < sizeof(lightDirections)/sizeof(lightDirections[0]); i++)
+    {
+        glActiveTexture(GL_TEXTURE0 + i);
+        glBindTexture(GL_TEXTURE_2D, compactLightMaps ? depthTextures[i] : vertexTextures[i]);
+        shader.setInt((compactLightMaps ? "depthTextures[" : "vertexTextures[") + std::to_string(i) + "]", i);
+    }
+
+    for (unsigned int i = 0; i < sizeof(lightDirections)/sizeof(lightDirections[0]); i++)
+    {
+        glActiveTexture(GL_TEXTURE0 + i + 2);
+        glBindTexture(GL_TEXTURE_2D, normalTextures[i]);
+        shader.setInt("normalTextures[" + std::to_string(i) + "]", i + 2);
+    }
+    // bound by LightCascades::bindTextures or LightList::bindTextures when they are used
+    shader.setInt("lightNormalMaps", LIGHT_NORMAL_ARRAY_UNIT);
+    shader.setInt("lightDepthMaps", LIGHT_DEPTH_ARRAY_UNIT);
+    shader.setInt("lightList", LIGHT_LIST_UNIT);
+    shader.setInt("lightTiles", LIGHT_TILES_UNIT);
+    for (int i = 0; environmentLighting && i < SH_COEFFICIENTS; i++)
+        shader.setVec3("shIrradiance[" + std::to_string(i) + "]", environmentIrradiance.c[i]);
+    if (environmentLighting)
+        shader.setFloat("grainThickness", environmentThickness);
+    if (usePRT)
+        grainTransfer.bind(shader);
+    if (useThicknessMap)
+        grainThickness.bind(shader);
+    if (usePointCloud)
+        irradianceCloud.bind(shader);
+    if (useTranslucencyCache)
+        translucencyCache.bind(shader);
+    // set again by TemporalTranslucency::begin for the passes that keep a history
+    if (useTemporalReuse)
+        shader.setBool("historyValid", false);
+    if (useHalfResTranslucency)
+        halfResTranslucency.bind(shader);
+
+    // camera and light data come from the uniform blocks written by streamFrameData
+    // set model matrix to identity matrix
+    glm::mat4 modelMatrix = glm::mat4(1.0f);
+    shader.setMat4("model", modelMatrix);
+    shader.setMat3("normalMatrix", glm::transpose(glm::inverse(glm::mat3(modelMatrix))));
+}
+
+// draws the object for a view pass, from the cache's atlas mesh when it is used
+void drawTranslucent(Shader &shader, Model &model)
+{
+    if (useTranslucencyCache)
+        translucencyCache.Draw(shader);
+    else
+        model.Draw(shader);
+}
+
 void rendertoHDR(Shader &shader, Model &model)
 {
     glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
@@ -121,49 +318,10 @@ void rendertoHDR(Shader &shader, Model &model)
         glEnable(GL_DEPTH_TEST);
         glDepthFunc(GL_LESS);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-        shader.use();
-        // pass normal and vertex textures to the shader
-        for (unsigned int i = 0; i < sizeof(lightDirections)/sizeof(lightDirections[0]); i++)
-        {
-            glActiveTexture(GL_TEXTURE0 + i);
-            glBindTexture(GL_TEXTURE_2D, vertexTextures[i]);
-            shader.setInt("vertexTextures[" + std::to_string(i) + "]", i);
-        }
-
-        for (unsigned int i = 0; i < sizeof(lightDirections)/sizeof(lightDirections[0]); i++)
-        {
-            glActiveTexture(GL_TEXTURE0 + i + 2);
-            glBindTexture(GL_TEXTURE_2D, normalTextures[i]);
-            shader.setInt("normalTextures[" + std::to_string(i) + "]", i + 2);
-        }
-
-
-        // MVP matrices to be used in the vertex shader
-        shader.setMat4("projection", projectionMatrix);
-        shader.setMat4("view", viewMatrix);
-        // set model matrix to identity matrix
-        glm::mat4 modelMatrix = glm::mat4(1.0f);
-        shader.setMat4("model", modelMatrix);
-        shader.setMat3("normalMatrix", glm::transpose(glm::inverse(glm::mat3(modelMatrix))));
-
-        shader.setFloat("farPlane", nearPlane);
-        shader.setFloat("nearPlane", farPlane);
-
-        // set light properties
-        for (unsigned int i = 0; i < sizeof(lightDirections)/sizeof(lightDirections[0]); i++)
-        {
-            shader.setVec3("lightDirections[" + std::to_string(i) + "]", lightDirections[i]);
-            shader.setVec3("lightRadiances[" + std::to_string(i) + "]", lightRadiances[i]);
-            shader.setMat4("lightSpaceMatrices[" + std::to_string(i) + "]", lightSpaceMatrices[i]);
-        }
-        shader.setInt("numLights", sizeof(lightDirections)/sizeof(lightDirections[0]));
-        shader.setVec3("eyePos", cameraPos);
-
-        // Pass screen resolution to the shader
-        shader.setVec2("resolution", glm::vec2(SCR_WIDTH, SCR_HEIGHT));
+        setTranslucencyInputs(shader);
         
         // draw object
-        model.Draw(shader);
+        drawTranslucent(shader, model);
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
 }
 
@@ -177,52 +335,39 @@ void rendertoSDR(Shader &shader, Model &model)
         glEnable(GL_DEPTH_TEST);
         glDepthFunc(GL_LESS);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-        shader.use();
-        // pass normal and vertex textures to the shader
-        for (unsigned int i = 0; i < sizeof(lightDirections)/sizeof(lightDirections[0]); i++)
-        {
-            glActiveTexture(GL_TEXTURE0 + i);
-            glBindTexture(GL_TEXTURE_2D, vertexTextures[i]);
-            shader.setInt("vertexTextures[" + std::to_string(i) + "]", i);
-        }
-
-        for (unsigned int i = 0; i < sizeof(lightDirections)/sizeof(lightDirections[0]); i++)
-        {
-            glActiveTexture(GL_TEXTURE0 + i + 2);
-            glBindTexture(GL_TEXTURE_2D, normalTextures[i]);
-            shader.setInt("normalTextures[" + std::to_string(i) + "]", i + 2);
-        }
-
-
-        // MVP matrices to be used in the vertex shader
-        shader.setMat4("projection", projectionMatrix);
-        shader.setMat4("view", viewMatrix);
-        // set model matrix to identity matrix
-        glm::mat4 modelMatrix = glm::mat4(1.0f);
-        shader.setMat4("model", modelMatrix);
-        shader.setMat3("normalMatrix", glm::transpose(glm::inverse(glm::mat3(modelMatrix))));
-
-        shader.setFloat("farPlane", nearPlane);
-        shader.setFloat("nearPlane", farPlane);
-
-        // set light properties
-        for (unsigned int i = 0; i < sizeof(lightDirections)/sizeof(lightDirections[0]); i++)
-        {
-            shader.setVec3("lightDirections[" + std::to_string(i) + "]", lightDirections[i]);
-            shader.setVec3("lightRadiances[" + std::to_string(i) + "]", lightRadiances[i]);
-            shader.setMat4("lightSpaceMatrices[" + std::to_string(i) + "]", lightSpaceMatrices[i]);
-        }
-        shader.setInt("numLights", sizeof(lightDirections)/sizeof(lightDirections[0]));
-        shader.setVec3("eyePos", cameraPos);
-
-        // Pass screen resolution to the shader
-        shader.setVec2("resolution", glm::vec2(SCR_WIDTH, SCR_HEIGHT));
+        setTranslucencyInputs(shader);
+        if (useTemporalReuse)
+            temporalTranslucency.begin(shader, SCR_WIDTH, SCR_HEIGHT);
         
         // draw object
-        model.Draw(shader);
+        drawTranslucent(shader, model);
+        if (useTemporalReuse)
+            temporalTranslucency.end(viewMatrix, projectionMatrix);
     // glBindFramebuffer(GL_FRAMEBUFFER, 0);
 }
 
+// load a lat-long EXR environment and project its irradiance onto SH
+bool loadEnvironmentSH(const char *filename, SHCoefficients &irradiance)
+{
+    TraceScope trace("loadEnvironmentSH");
+    float *pixels = nullptr;
+    int width = 0, height = 0;
+    const char *err = nullptr;
+    int ret = LoadEXR(&pixels, &width, &height, filename, &err);
+    if (ret != TINYEXR_SUCCESS)
+    {
+        fprintf(stderr, "Load EXR err: %s\n", err ? err : filename);
+        if (err)
+            FreeEXRErrorMessage(err);
+        return false;
+    }
+    // LoadEXR returns RGBA
+    irradiance = irradianceSH(projectLatLong(pixels, width, height, 4));
+    free(pixels);
+    printf("Loaded environment. [ %s ] %dx%d\n", filename, width, height);
+    return true;
+}
+
 // use tinyexr to save HDR image
 // modified from tinyexr/examples/rgbe2exr/rgbe2exr.cc
 void saveHDRImage(const char *filename, const float *colorBuffer)
@@ -297,7 +442,7 @@ void saveHDRImage(const char *filename, const float *colorBuffer)
 
 
 
-void setupDepthBuffer(GLuint &texture)
+void setupDepthBuffer(GLuint &texture, unsigned int size)
 {
     // The framebuffer, which regroups 0, 1, or more textures, and 0 or 1 depth buffer.
     glGenFramebuffers(1, &FramebufferName);
@@ -306,7 +451,7 @@ void setupDepthBuffer(GLuint &texture)
     glGenTextures(1, &texture);
 
     glBindTexture(GL_TEXTURE_2D, texture);
-    glTexImage2D(GL_TEXTURE_2D, 0,GL_DEPTH_COMPONENT32F, SCR_HEIGHT, SCR_WIDTH, 0,GL_DEPTH_COMPONENT, GL_FLOAT, 0);
+    glTexImage2D(GL_TEXTURE_2D, 0,GL_DEPTH_COMPONENT32F, size, size, 0,GL_DEPTH_COMPONENT, GL_FLOAT, 0);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 
@@ -325,7 +470,7 @@ void setupDepthBuffer(GLuint &texture)
 }
 
 
-void setupNormalBuffer(GLuint &texture)
+void setupNormalBuffer(GLuint &texture, unsigned int size)
 {
     glGenFramebuffers(1, &FramebufferName);
     glBindFramebuffer(GL_FRAMEBUFFER, FramebufferName);
@@ -333,7 +478,7 @@ void setupNormalBuffer(GLuint &texture)
     glGenTextures(1, &texture);
 
     glBindTexture(GL_TEXTURE_2D, texture);
-    glTexImage2D(GL_TEXTURE_2D, 0,GL_RGB32F, SCR_HEIGHT, SCR_WIDTH, 0,GL_RGB, GL_FLOAT, 0);
+    glTexImage2D(GL_TEXTURE_2D, 0,GL_RGB32F, size, size, 0,GL_RGB, GL_FLOAT, 0);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
@@ -361,7 +506,7 @@ void cleanupNormalBuffer(GLuint &texture) {
     glDeleteFramebuffers(1, &FramebufferName);
 }
 
-void setupVertexBuffer(GLuint &texture)
+void setupVertexBuffer(GLuint &texture, unsigned int size)
 {
     glGenFramebuffers(1, &FramebufferName);
     glBindFramebuffer(GL_FRAMEBUFFER, FramebufferName);
@@ -369,7 +514,7 @@ void setupVertexBuffer(GLuint &texture)
     glGenTextures(1, &texture);
 
     glBindTexture(GL_TEXTURE_2D, texture);
-    glTexImage2D(GL_TEXTURE_2D, 0,GL_RGB32F, SCR_HEIGHT, SCR_WIDTH, 0,GL_RGB, GL_FLOAT, 0);
+    glTexImage2D(GL_TEXTURE_2D, 0,GL_RGB32F, size, size, 0,GL_RGB, GL_FLOAT, 0);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
@@ -397,24 +542,86 @@ void cleanupVertexBuffer(GLuint &texture) {
     glDeleteFramebuffers(1, &FramebufferName);
 }
 
+// normal map and depth texture of one light sharing a framebuffer, the light-space position
+// is rebuilt from the depth in the shading pass so no position map is needed
+void setupCompactLightMap(int index)
+{
+    unsigned int size = lightMapSizes[index];
+    glGenFramebuffers(1, &lightMapFramebuffers[index]);
+    glBindFramebuffer(GL_FRAMEBUFFER, lightMapFramebuffers[index]);
+
+    glGenTextures(1, &normalTextures[index]);
+    glBindTexture(GL_TEXTURE_2D, normalTextures[index]);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RG16_SNORM, size, size, 0, GL_RG, GL_FLOAT, 0);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, normalTextures[index], 0);
+
+    glGenTextures(1, &depthTextures[index]);
+    glBindTexture(GL_TEXTURE_2D, depthTextures[index]);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT32F, size, size, 0, GL_DEPTH_COMPONENT, GL_FLOAT, 0);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    // filtering depth across the silhouette would make up points between the grain and the far plane
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, depthTextures[index], 0);
+
+    glDrawBuffer(GL_COLOR_ATTACHMENT0);
+
+    // GL 4.1 does not require SNORM formats to be renderable, RG16F has the same size
+    if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+    {
+        glBindTexture(GL_TEXTURE_2D, normalTextures[index]);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RG16F, size, size, 0, GL_RG, GL_FLOAT, 0);
+        std::cout << "RG16_SNORM is not renderable, using RG16F for the light-map normals" << std::endl;
+    }
+    if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+    {
+        printf("Framebuffer not complete\n");
+        return;
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+void cleanupCompactLightMap(int index) {
+    glDeleteTextures(1, &normalTextures[index]);
+    glDeleteTextures(1, &depthTextures[index]);
+    glDeleteFramebuffers(1, &lightMapFramebuffers[index]);
+}
+
+// inverse of the octahedral encoding in FBOfragmentShader2.fs
+glm::vec3 octahedralDecode(float x, float y)
+{
+    glm::vec3 n(x, y, 1.0f - fabs(x) - fabs(y));
+    if (n.z < 0.0f)
+    {
+        n.x = (1.0f - fabs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+        n.y = (1.0f - fabs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+    }
+    return glm::normalize(n);
+}
+
 void rendertoNormalTexture(Shader &shader, Model &model, int index, glm::vec3 lightDir, GLuint texture)
 {
+    unsigned int size = lightMapSizes[index];
     glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-    glBindFramebuffer(GL_FRAMEBUFFER, FramebufferName);
+    glBindFramebuffer(GL_FRAMEBUFFER, compactLightMaps ? lightMapFramebuffers[index] : FramebufferName);
+    glViewport(0, 0, size, size);
     shader.use();
 
+    {
+    ProfileScope scope(profiler, "normal pre-pass");
     //TODO probably do not need to do this again
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-    // MVP matrices to be used in the vertex shader
-    glm::mat4 lightView = glm::lookAt(radius*normalize(lightDir), glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
-    // float leftBoundary = -2.5f, rightBoundary = 2.5f, bottomBoundary = -2.5f, topBoundary = 2.5f;
-    // calculate the length of the light direction vector
-    float distToCamera = glm::length(radius*normalize(lightDir));
-    glm::mat4 lightProjection = glm::ortho(leftBoundary, rightBoundary, bottomBoundary, topBoundary, nearPlane, farPlane);
-    glm::mat4 lightSpaceMatrix = lightProjection * lightView;
+    // MVP matrices to be used in the vertex shader, the ortho bounds are fitted to the model
+    glm::mat4 lightSpaceMatrix = fitLightSpaceMatrix(lightDir, sceneBounds, lightMapSizes[index]);
     shader.setMat4("lightSpaceMatrix", lightSpaceMatrix);
     lightSpaceMatrices[index] = lightSpaceMatrix;
     // set model matrix to identity matrix
@@ -429,20 +636,47 @@ void rendertoNormalTexture(Shader &shader, Model &model, int index, glm::vec3 li
 
     // draw object
     model.Draw(shader);
+    }
 
 
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glViewport(0, 0, SCR_WIDTH, SCR_HEIGHT);
 
     glActiveTexture(GL_TEXTURE0);
     glBindTexture(GL_TEXTURE_2D, texture);
 
     if (DoOnce)
     {
+    ProfileScope scope(profiler, "readback");
     // For testing
-    GLfloat* pixels_float = new GLfloat[SCR_HEIGHT * SCR_WIDTH * 3];
-    unsigned char* pixels = new unsigned char[SCR_HEIGHT * SCR_WIDTH * 3];
-    glGetTexImage(GL_TEXTURE_2D, 0, GL_RGB, GL_FLOAT, pixels_float);
-    for (int i = 0; i < SCR_HEIGHT * SCR_WIDTH * 3; i++)
+    GLfloat* pixels_float = new GLfloat[size * size * 3];
+    unsigned char* pixels = new unsigned char[size * size * 3];
+    if (compactLightMaps)
+    {
+        {
+        TraceScope trace("glGetTexImage");
+        glGetTexImage(GL_TEXTURE_2D, 0, GL_RG, GL_FLOAT, pixels_float);
+        }
+        Trace::add(TRACE_BYTES_READ_BACK, size * size * 2 * sizeof(GLfloat));
+        // decode back to xyz, from the end so the two channel texels are not overwritten
+        for (int i = size * size - 1; i >= 0; i--)
+        {
+            float x = pixels_float[2 * i], y = pixels_float[2 * i + 1];
+            glm::vec3 normal = (x == 0.0f && y == 0.0f) ? glm::vec3(0.0f) : octahedralDecode(x, y);
+            pixels_float[3 * i + 0] = normal.x;
+            pixels_float[3 * i + 1] = normal.y;
+            pixels_float[3 * i + 2] = normal.z;
+        }
+    }
+    else
+    {
+        {
+        TraceScope trace("glGetTexImage");
+        glGetTexImage(GL_TEXTURE_2D, 0, GL_RGB, GL_FLOAT, pixels_float);
+        }
+        Trace::add(TRACE_BYTES_READ_BACK, size * size * 3 * sizeof(GLfloat));
+    }
+    for (int i = 0; i < size * size * 3; i++)
     {
         // cout << pixels_float[i] << " ";
         pixels[i] = static_cast<unsigned char>(pixels_float[i] * 255.0f);
@@ -452,31 +686,32 @@ void rendertoNormalTexture(Shader &shader, Model &model, int index, glm::vec3 li
     std::stringstream filename;
     filename << "output/normalTexture" << texture << ".png";
     std::string fullPath = FileSystem::getPath(filename.str());
-    stbi_write_png(fullPath.c_str(), SCR_WIDTH, SCR_HEIGHT, 3, pixels, 0);
+    {
+    TraceScope trace("stbi_write_png");
+    stbi_write_png(fullPath.c_str(), size, size, 3, pixels, 0);
+    }
     }
 
 }
 
 void rendertoVertexTexture(Shader &shader, Model &model, int index, glm::vec3 lightDir, GLuint texture)
 {
+    unsigned int size = lightMapSizes[index];
     glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
     glBindFramebuffer(GL_FRAMEBUFFER, FramebufferName);
+    glViewport(0, 0, size, size);
     shader.use();
 
+    {
+    ProfileScope scope(profiler, "vertex pre-pass");
     //TODO probably do not need to do this again
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-    // glViewport(0, 0, SCR_WIDTH, SCR_HEIGHT);
     // glEnable(GL_DEPTH_TEST);
-    // MVP matrices to be used in the vertex shader
-    glm::mat4 lightView = glm::lookAt(radius*normalize(lightDir), glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
-    // float leftBoundary = -2.5f, rightBoundary = 2.5f, bottomBoundary = -2.5f, topBoundary = 2.5f;
-    // calculate the length of the light direction vector
-    float distToCamera = glm::length(radius*normalize(lightDir));
-    glm::mat4 lightProjection = glm::ortho(leftBoundary, rightBoundary, bottomBoundary, topBoundary, nearPlane, farPlane);
-    glm::mat4 lightSpaceMatrix = lightProjection * lightView;
+    // MVP matrices to be used in the vertex shader, the ortho bounds are fitted to the model
+    glm::mat4 lightSpaceMatrix = fitLightSpaceMatrix(lightDir, sceneBounds, lightMapSizes[index]);
     shader.setMat4("lightSpaceMatrix", lightSpaceMatrix);
     lightSpaceMatrices[index] = lightSpaceMatrix;
     // set model matrix to identity matrix
@@ -494,19 +729,26 @@ void rendertoVertexTexture(Shader &shader, Model &model, int index, glm::vec3 li
 
     // Reset to default culling mode after drawing
     glCullFace(GL_BACK);
+    }
 
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glViewport(0, 0, SCR_WIDTH, SCR_HEIGHT);
 
     glActiveTexture(GL_TEXTURE0);
     glBindTexture(GL_TEXTURE_2D, texture);
 
     if (DoOnce)
     {
+    ProfileScope scope(profiler, "readback");
     // For testing
-    GLfloat* pixels_float = new GLfloat[SCR_HEIGHT * SCR_WIDTH * 3];
-    unsigned char* pixels = new unsigned char[SCR_HEIGHT * SCR_WIDTH * 3];
+    GLfloat* pixels_float = new GLfloat[size * size * 3];
+    unsigned char* pixels = new unsigned char[size * size * 3];
+    {
+    TraceScope trace("glGetTexImage");
     glGetTexImage(GL_TEXTURE_2D, 0, GL_RGB, GL_FLOAT, pixels_float);
-    for (int i = 0; i < SCR_HEIGHT * SCR_WIDTH * 3; i++)
+    }
+    Trace::add(TRACE_BYTES_READ_BACK, size * size * 3 * sizeof(GLfloat));
+    for (int i = 0; i < size * size * 3; i++)
     {
         // cout << pixels_float[i] << " ";
         pixels[i] = static_cast<unsigned char>(pixels_float[i] * 255.0f/5.0);
@@ -517,12 +759,16 @@ void rendertoVertexTexture(Shader &shader, Model &model, int index, glm::vec3 li
     filename << "output/vertexTexture" << texture << ".png";
 
     std::string fullPath = FileSystem::getPath(filename.str());
-    stbi_write_png(fullPath.c_str(), SCR_WIDTH, SCR_HEIGHT, 3, pixels, 0);
+    {
+    TraceScope trace("stbi_write_png");
+    stbi_write_png(fullPath.c_str(), size, size, 3, pixels, 0);
+    }
     }
 }
 
 void rendertoDepthTexture(Shader &shader, Model &model, int index, glm::vec3 lightDir, GLuint texture)
 {
+    unsigned int size = lightMapSizes[index];
     
     
     
@@ -530,20 +776,17 @@ void rendertoDepthTexture(Shader &shader, Model &model, int index, glm::vec3 lig
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
     glBindFramebuffer(GL_FRAMEBUFFER, FramebufferName);
+    glViewport(0, 0, size, size);
     shader.use();
 
+    {
+    ProfileScope scope(profiler, "depth pass");
     //TODO probably do not need to do this again
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-    // glViewport(0, 0, SCR_WIDTH, SCR_HEIGHT);
     // glEnable(GL_DEPTH_TEST);
-    // MVP matrices to be used in the vertex shader
-    glm::mat4 lightView = glm::lookAt(radius*normalize(lightDir), glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
-    // float leftBoundary = -2.5f, rightBoundary = 2.5f, bottomBoundary = -2.5f, topBoundary = 2.5f;
-    // calculate the length of the light direction vector
-    float distToCamera = glm::length(radius*normalize(lightDir));
-    glm::mat4 lightProjection = glm::ortho(leftBoundary, rightBoundary, bottomBoundary, topBoundary, nearPlane, farPlane);
-    glm::mat4 lightSpaceMatrix = lightProjection * lightView;
+    // MVP matrices to be used in the vertex shader, the ortho bounds are fitted to the model
+    glm::mat4 lightSpaceMatrix = fitLightSpaceMatrix(lightDir, sceneBounds, lightMapSizes[index]);
     shader.setMat4("lightSpaceMatrix", lightSpaceMatrix);
     lightSpaceMatrices[index] = lightSpaceMatrix;
     // set model matrix to identity matrix
@@ -561,17 +804,24 @@ void rendertoDepthTexture(Shader &shader, Model &model, int index, glm::vec3 lig
 
     // Reset to default culling mode after drawing
     glCullFace(GL_BACK);
+    }
 
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glViewport(0, 0, SCR_WIDTH, SCR_HEIGHT);
 
     glActiveTexture(GL_TEXTURE0);
     glBindTexture(GL_TEXTURE_2D, texture);
 
+    ProfileScope scope(profiler, "readback");
     // For testing
-    GLfloat* pixels_float = new GLfloat[SCR_HEIGHT * SCR_WIDTH];
-    unsigned char* pixels = new unsigned char[SCR_HEIGHT * SCR_WIDTH];
+    GLfloat* pixels_float = new GLfloat[size * size];
+    unsigned char* pixels = new unsigned char[size * size];
+    {
+    TraceScope trace("glGetTexImage");
     glGetTexImage(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, GL_FLOAT, pixels_float);
-    for (int i = 0; i < SCR_HEIGHT * SCR_WIDTH; i++)
+    }
+    Trace::add(TRACE_BYTES_READ_BACK, size * size * sizeof(GLfloat));
+    for (int i = 0; i < size * size; i++)
     {
         // cout << pixels_float[i] << " ";
         pixels[i] = static_cast<unsigned char>(pixels_float[i] * 255.0f);
@@ -581,7 +831,10 @@ void rendertoDepthTexture(Shader &shader, Model &model, int index, glm::vec3 lig
     std::stringstream filename;
     filename << "output/depthTexture" << texture << ".png";
     std::string fullPath = FileSystem::getPath(filename.str());
-    stbi_write_png(fullPath.c_str(), SCR_WIDTH, SCR_HEIGHT, 1, pixels, 0);
+    {
+    TraceScope trace("stbi_write_png");
+    stbi_write_png(fullPath.c_str(), size, size, 1, pixels, 0);
+    }
 }
 
 // Registering a callback function that gets called each time the window is resized.
@@ -605,6 +858,8 @@ void scroll_callback(GLFWwindow* window, double xoffset, double yoffset);
 
 int main(void)
 {
+    if (!checkOptions())
+        return -1;
 
     GLFWwindow* window;
 
@@ -644,14 +899,31 @@ int main(void)
             return -1; 
         }
 
+    // record a Chrome trace (open in Perfetto / chrome://tracing) when GRANULAR_TRACE=<file.json> is set
+    if (getenv("GRANULAR_TRACE") != nullptr)
+        Trace::start(getenv("GRANULAR_TRACE"));
+
     // Registering the callback function on window resize to make sure OpenGL renders the image in the rightBoundary size whenever the window is resized.
     glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
-    Shader ourShader(FileSystem::getPath("src/shaders/vertexShader.vs").c_str(), FileSystem::getPath("src/shaders/model3.fs").c_str());
+    // model3 variants are compiled on first use
+    ShaderPermutations translucency(FileSystem::getPath("src/shaders/vertexShader.vs"), FileSystem::getPath("src/shaders/model3.fs"));
     Shader FBOShader(FileSystem::getPath("src/shaders/vertexShader2.vs").c_str(), FileSystem::getPath("src/shaders/FBOfragmentShader.fs").c_str());
     //normals
-    Shader FBOShader2(FileSystem::getPath("src/shaders/vertexShader2.vs").c_str(), FileSystem::getPath("src/shaders/FBOfragmentShader2.fs").c_str());
+    ShaderDefines normalDefines;
+    normalDefines["OCTAHEDRAL_NORMALS"] = compactLightMaps || lightCascades > 1 || useLightList ? "1" : "0";
+    Shader FBOShader2(FileSystem::getPath("src/shaders/vertexShader2.vs").c_str(), FileSystem::getPath("src/shaders/FBOfragmentShader2.fs").c_str(), nullptr, normalDefines);
     //vertices
     Shader FBOShader3(FileSystem::getPath("src/shaders/vertexShader2.vs").c_str(), FileSystem::getPath("src/shaders/FBOfragmentShader3.fs").c_str());
+
+    // rebuild the shaders in the background when their files are saved
+    ShaderReloader shaderReloader(window);
+    shaderReloader.watch(translucency);
+    shaderReloader.watch(FBOShader);
+    shaderReloader.watch(FBOShader2);
+    shaderReloader.watch(FBOShader3);
+    // the cache's dilation, its bake uses the TRANSLUCENCY_CACHE_BAKE variant of translucency
+    Shader cacheDilateShader(FileSystem::getPath("src/shaders/fullscreen.vs").c_str(), FileSystem::getPath("src/shaders/cacheDilate.fs").c_str());
+    shaderReloader.watch(cacheDilateShader);
     
 
     // Query the maximum number of samples
@@ -660,8 +932,11 @@ int main(void)
     std::cout << "Max MSAA samples: " << maxSamples << std::endl;
 
     
+    if (environmentLighting)
+        environmentLighting = loadEnvironmentSH(FileSystem::getPath(environmentMapPath).c_str(), environmentIrradiance);
+
     // Linking the shaders
-        ourShader.use();
+        translucency.get(translucencyDefines()).use();
 
     // Enable depth test
         glEnable(GL_DEPTH_TEST);
@@ -671,7 +946,10 @@ int main(void)
 
     // load models
     // -----------
-    Model ourModel(FileSystem::getPath("resources/objects/grain3.obj"));
+    // parsed on the loader threads and uploaded a little every frame, see the render loop
+    AssetLoader assetLoader;
+    Model ourModel;
+    assetLoader.load(ourModel, FileSystem::getPath("resources/objects/grain3.obj"));
 
 
     
@@ -695,21 +973,120 @@ int main(void)
 
     
 
-    //for each light source, render the scene depth to a texture
-    for (unsigned int i = 0; i < sizeof(lightDirections)/sizeof(lightDirections[0]); i++)
-    {
-        setupNormalBuffer(normalTextures[i]);
-        rendertoNormalTexture(FBOShader2, ourModel, i, lightDirections[i], normalTextures[i]);
-        setupVertexBuffer(vertexTextures[i]);
-        rendertoVertexTexture(FBOShader3, ourModel, i, lightDirections[i], vertexTextures[i]);
-        setupDepthBuffer(depthTextures[i]);
-        rendertoDepthTexture(FBOShader, ourModel, i, lightDirections[i], depthTextures[i]);
-    }
+    // the light maps are made once the model is on the GPU
+    bool lightMapsReady = false;
+
+    // per-frame uniform blocks
+    StreamBuffer frameStream(64 * 1024);
+
+    const unsigned int lightCount = sizeof(lightDirections)/sizeof(lightDirections[0]);
+    LightCascades cascades(lightCount, useLightList ? 1 : lightCascades, cascadeMapSize);
+    LightList lightList(lightListMapSize);
+    for (unsigned int i = 0; useLightList && i < lightCount; i++)
+        lightList.lights.push_back(Light(lightDirections[i], lightRadiances[i]));
 
     /* Loop until the user closes the window */
     // The render loop
     while (!glfwWindowShouldClose(window))
     {
+        profiler.beginFrame();
+        TraceScope frameTrace("frame");
+        shaderReloader.update();
+        assetLoader.update();
+
+        // keep the window responsive while the model streams in
+        if (!ourModel.loaded)
+        {
+            glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            glfwSwapBuffers(window);
+            glfwPollEvents();
+            continue;
+        }
+
+        if (!lightMapsReady)
+        {
+            sceneBounds = modelBounds(ourModel);
+            //for each light source, render the scene depth to a texture
+            lightList.invalidate();
+            // the transfer, the thickness map and the point cloud replace the per-light maps
+            for (unsigned int i = 0; !cascades.enabled() && !useLightList && !usePRT && !useThicknessMap && !usePointCloud &&
+                                     i < sizeof(lightDirections)/sizeof(lightDirections[0]); i++)
+            {
+                if (compactLightMaps)
+                {
+                    // the normal pass fills the depth texture as well
+                    setupCompactLightMap(i);
+                    rendertoNormalTexture(FBOShader2, ourModel, i, lightDirections[i], normalTextures[i]);
+                    continue;
+                }
+                setupNormalBuffer(normalTextures[i], lightMapSizes[i]);
+                rendertoNormalTexture(FBOShader2, ourModel, i, lightDirections[i], normalTextures[i]);
+                setupVertexBuffer(vertexTextures[i], lightMapSizes[i]);
+                rendertoVertexTexture(FBOShader3, ourModel, i, lightDirections[i], vertexTextures[i]);
+                setupDepthBuffer(depthTextures[i], lightMapSizes[i]);
+                rendertoDepthTexture(FBOShader, ourModel, i, lightDirections[i], depthTextures[i]);
+            }
+            if (environmentLighting)
+                environmentThickness = meanChord(ourModel);
+            if (usePRT && !grainTransfer.uploaded())
+            {
+                grainTransfer.bake(ourModel, GrainMaterial());
+                grainTransfer.upload(ourModel);
+            }
+            if (useThicknessMap && !grainThickness.uploaded())
+            {
+                grainThickness.bake(ourModel);
+                grainThickness.upload(ourModel);
+            }
+            if (usePointCloud && !irradianceCloud.built())
+            {
+                MeshRayCaster caster(ourModel);
+                irradianceCloud.build(poissonSurfacePoints(ourModel, pointCloudSamples), caster, std::vector<glm::mat4>(1, glm::mat4(1.0f)),
+                                      lightDirections, lightRadiances, lightCount, GrainMaterial());
+            }
+            if (useTranslucencyCache && !translucencyCache.built())
+                translucencyCache.build(ourModel, translucencyCacheSize);
+            lightMapsReady = true;
+        }
+
+        if (cascades.enabled())
+        {
+            cascades.fit(viewMatrix, fov, (float)SCR_WIDTH/(float)SCR_HEIGHT, nearPlane, farPlane, sceneBounds, lightDirections);
+            cascades.render(FBOShader2, [&ourModel](Shader &shader) { ourModel.Draw(shader); }, profiler);
+            cascades.bindTextures();
+        }
+        if (useLightList)
+        {
+            lightList.render(FBOShader2, [&ourModel](Shader &shader) { ourModel.Draw(shader); }, sceneBounds, profiler);
+            lightList.assign(viewMatrix, projectionMatrix, SCR_WIDTH, SCR_HEIGHT);
+            lightList.bindTextures();
+        }
+
+        frameStream.beginFrame();
+        streamFrameData(frameStream);
+        cascades.stream(frameStream);
+
+        // redrawn only after invalidate(), the light maps are still those of the lights
+        if (useTranslucencyCache && !translucencyCache.current())
+        {
+            ShaderDefines bakeDefines = translucencyDefines();
+            bakeDefines["TRANSLUCENCY_CACHE_BAKE"] = "1";
+            Shader &bakeShader = translucency.get(bakeDefines);
+            setTranslucencyInputs(bakeShader);
+            translucencyCache.render(bakeShader, cacheDilateShader, profiler);
+        }
+        // the subsurface term the view passes upsample
+        if (useHalfResTranslucency)
+        {
+            ShaderDefines lowResDefines = translucencyDefines();
+            lowResDefines["SUBSURFACE_UPSAMPLE"] = "0";
+            lowResDefines["SUBSURFACE_LOW_RES"] = "1";
+            Shader &lowResShader = translucency.get(lowResDefines);
+            setTranslucencyInputs(lowResShader);
+            halfResTranslucency.render(lowResShader, [&ourModel](Shader &shader) { drawTranslucent(shader, ourModel); }, SCR_WIDTH, SCR_HEIGHT, profiler);
+        }
+
         if (DoOnce)
         {
             
@@ -719,8 +1096,12 @@ int main(void)
             
             // glViewport(0, 0, SCR_WIDTH, SCR_HEIGHT);
             // Render to HDR buffer
-            rendertoHDR(ourShader, ourModel);
+            {
+            ProfileScope scope(profiler, "hdr pass");
+            rendertoHDR(translucency.get(translucencyDefines()), ourModel);
+            }
 
+            ProfileScope scope(profiler, "blit/readback");
             glBindFramebuffer(GL_READ_FRAMEBUFFER, hdrFBO);
             glBindFramebuffer(GL_DRAW_FRAMEBUFFER, intermediateFBO);
             glBlitFramebuffer(0, 0, SCR_WIDTH, SCR_HEIGHT, 0, 0, SCR_WIDTH, SCR_HEIGHT, GL_COLOR_BUFFER_BIT, GL_NEAREST);
@@ -732,14 +1113,21 @@ int main(void)
             // Save HDR image
             float *pixelBuffer = new float[SCR_WIDTH * SCR_HEIGHT * 3];
             glBindTexture(GL_TEXTURE_2D, screenTexture);
+            {
+            TraceScope trace("glGetTexImage");
             glGetTexImage(GL_TEXTURE_2D, 0, GL_RGB, GL_FLOAT, pixelBuffer);
+            }
+            Trace::add(TRACE_BYTES_READ_BACK, SCR_WIDTH * SCR_HEIGHT * 3 * sizeof(GLfloat));
             // for (int i = 0; i < SCR_WIDTH * SCR_HEIGHT * 3; i++)
             // {
             //     cout << pixelBuffer[i] << " ";
             // }
             //unbind the texture
             glBindTexture(GL_TEXTURE_2D, 0);
+            {
+            TraceScope trace("saveHDRImage");
             saveHDRImage(FileSystem::getPath("output/hdrOutput.exr").c_str(), pixelBuffer);
+            }
             DoOnce = false;
 
             // printf("Depth texture saved\n");
@@ -747,15 +1135,27 @@ int main(void)
         
         
 
-        for (unsigned int i = 0; i < sizeof(lightDirections)/sizeof(lightDirections[0]); i++)
+        // the cache keeps the lights' term, the light maps only change with it; the transfer,
+        // the thickness map and the point cloud read none
+        for (unsigned int i = 0; !cascades.enabled() && !useLightList && !useTranslucencyCache && !usePRT && !useThicknessMap &&
+                                 !usePointCloud &&
+                                 i < sizeof(lightDirections)/sizeof(lightDirections[0]); i++)
         {
             rendertoNormalTexture(FBOShader2, ourModel, i, lightDirections[i], normalTextures[i]);
-            rendertoVertexTexture(FBOShader3, ourModel, i, lightDirections[i], vertexTextures[i]);
+            if (!compactLightMaps)
+                rendertoVertexTexture(FBOShader3, ourModel, i, lightDirections[i], vertexTextures[i]);
         }
 
         glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-        rendertoSDR(ourShader, ourModel);
+        {
+        ProfileScope scope(profiler, "sdr pass");
+        rendertoSDR(translucency.get(translucencyDefines()), ourModel);
+        }
+
+        if (profiler.showOverlay)
+            profiler.drawOverlay(SCR_WIDTH);
+        frameStream.endFrame();
 
         //check for key input
         key_callback(window);
@@ -776,13 +1176,33 @@ int main(void)
         glfwPollEvents();
 
         CalculateFrameRate(window);
+        Trace::frameEnd();
     }
     // cleanup
-    for (unsigned int i = 0; i < sizeof(lightDirections)/sizeof(lightDirections[0]); i++)
+    assetLoader.stop();
+    for (unsigned int i = 0; lightMapsReady && !cascades.enabled() && !useLightList && i < sizeof(lightDirections)/sizeof(lightDirections[0]); i++)
     {
+        if (compactLightMaps)
+        {
+            cleanupCompactLightMap(i);
+            continue;
+        }
         cleanupNormalBuffer(normalTextures[i]);
         cleanupVertexBuffer(vertexTextures[i]);
     }
+    shaderReloader.stop();
+    cascades.cleanup();
+    lightList.cleanup();
+    grainTransfer.cleanup();
+    grainThickness.cleanup();
+    irradianceCloud.cleanup();
+    translucencyCache.cleanup();
+    temporalTranslucency.cleanup();
+    halfResTranslucency.cleanup();
+    frameStream.cleanup();
+    profiler.print(std::cout);
+    profiler.cleanup();
+    Trace::dump();
 
     glfwTerminate();
     return 0;
@@ -796,11 +1216,20 @@ void CalculateFrameRate(GLFWwindow* window)
     nbFrames++;
     if (currentTime - lastTime >= 1.0) { // If last prinf() was more than 1 sec ago
         // printf and reset timer
-        glfwSetWindowTitle(window, ("OpenGL Reference " + std::to_string(nbFrames) + " FPS").c_str());
+        glfwSetWindowTitle(window, ("OpenGL Reference " + std::to_string(nbFrames) + " FPS | " + profiler.summary()).c_str());
         nbFrames = 0;
         lastTime += 1.0;
     }
 }
+// true once when the key goes from pressed to released
+bool keyReleased(GLFWwindow* window, int key)
+{
+    static bool keyDown[GLFW_KEY_LAST + 1] = {false};
+    bool pressed = glfwGetKey(window, key) == GLFW_PRESS;
+    bool released = keyDown[key] && !pressed;
+    keyDown[key] = pressed;
+    return released;
+}
 // void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods)
 inline void key_callback(GLFWwindow* window)
 
@@ -821,6 +1250,33 @@ inline void key_callback(GLFWwindow* window)
     {
         horizontalAngle += cameraSpeed;
     }
+    // toggles act on key release
+    if (keyReleased(window, GLFW_KEY_O))
+    {
+        profiler.showOverlay = !profiler.showOverlay;
+    }
+    if (keyReleased(window, GLFW_KEY_1))
+    {
+        enableDipole = !enableDipole;
+        translucencyCache.invalidate();
+        temporalTranslucency.invalidate();
+    }
+    if (keyReleased(window, GLFW_KEY_2))
+    {
+        enableSingleScattering = !enableSingleScattering;
+        translucencyCache.invalidate();
+        temporalTranslucency.invalidate();
+    }
+    if (keyReleased(window, GLFW_KEY_3))
+    {
+        enableSpecular = !enableSpecular;
+    }
+    if (keyReleased(window, GLFW_KEY_G))
+    {
+        gatherMode = (gatherMode + 1) % 3;
+        translucencyCache.invalidate();
+        temporalTranslucency.invalidate();
+    }
 
 // Calculate the new camera position using the angles and the radius
 cameraPos.x = radius * cos(verticalAngle) * sin(horizontalAngle);
@@ -6,7 +6,9 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 
+#include "geometry_arena.h"
 #include "shader.h"
+#include "trace.h"
 
 #include <string>
 #include <vector>
@@ -14,6 +16,15 @@ using namespace std;
 
 #define MAX_BONE_INFLUENCE 4
 
+// material textures get fixed units by sampler name: texture_<type>N sits on
+// MESH_TEXTURE_UNIT_BASE + type * MESH_TEXTURES_PER_TYPE + N - 1 (types in the order of
+// meshTextureTypes). The units below the base are left to the light maps.
+#define MESH_TEXTURE_UNIT_BASE 8
+#define MESH_TEXTURES_PER_TYPE 4
+#define MESH_TEXTURE_TYPES 4
+
+static const char *meshTextureTypes[MESH_TEXTURE_TYPES] = {"texture_diffuse", "texture_specular", "texture_normal", "texture_height"};
+
 struct Vertex {
     // position
     glm::vec3 Position;
@@ -43,7 +54,9 @@ public:
     vector<Vertex>       vertices;
     vector<unsigned int> indices;
     vector<Texture>      textures;
+    // the shared VAO of the geometry arena and where this mesh sits in it
     unsigned int VAO;
+    ArenaRange   range;
 
     // constructor
     Mesh(vector<Vertex> vertices, vector<unsigned int> indices, vector<Texture> textures)
@@ -54,69 +67,133 @@ public:
 
         // now that we have all the required data, set the vertex buffers and its attribute pointers.
         setupMesh();
+        resolveTextureUnits();
     }
 
     // render the mesh
     void Draw(Shader &shader) 
     {
-        // bind appropriate textures
-        unsigned int diffuseNr  = 1;
-        unsigned int specularNr = 1;
-        unsigned int normalNr   = 1;
-        unsigned int heightNr   = 1;
-        for(unsigned int i = 0; i < textures.size(); i++)
-        {
-            glActiveTexture(GL_TEXTURE0 + i); // active proper texture unit before binding
-            // retrieve texture number (the N in diffuse_textureN)
-            string number;
-            string name = textures[i].type;
-            if(name == "texture_diffuse")
-                number = std::to_string(diffuseNr++);
-            else if(name == "texture_specular")
-                number = std::to_string(specularNr++); // transfer unsigned int to string
-            else if(name == "texture_normal")
-                number = std::to_string(normalNr++); // transfer unsigned int to string
-             else if(name == "texture_height")
-                number = std::to_string(heightNr++); // transfer unsigned int to string
-
-            // now set the sampler to the correct texture unit
-            glUniform1i(glGetUniformLocation(shader.ID, (name + number).c_str()), i);
-            // and finally bind the texture
-            glBindTexture(GL_TEXTURE_2D, textures[i].id);
-        }
+        bindTextures(shader);
         
         // draw mesh
         glBindVertexArray(VAO);
-        glDrawElements(GL_TRIANGLES, static_cast<unsigned int>(indices.size()), GL_UNSIGNED_INT, 0);
+        glDrawElementsBaseVertex(GL_TRIANGLES, range.indexCount, GL_UNSIGNED_INT, indexOffset(), range.baseVertex);
+        Trace::add(TRACE_DRAW_CALLS, 1);
         glBindVertexArray(0);
 
         // always good practice to set everything back to defaults once configured.
         glActiveTexture(GL_TEXTURE0);
     }
 
+    // render count instances of the mesh, the transforms come from the buffer set with setInstanceBuffer
+    void DrawInstanced(Shader &shader, unsigned int count)
+    {
+        bindTextures(shader);
+
+        glBindVertexArray(VAO);
+        glDrawElementsInstancedBaseVertex(GL_TRIANGLES, range.indexCount, GL_UNSIGNED_INT, indexOffset(), count, range.baseVertex);
+        Trace::add(TRACE_DRAW_CALLS, 1);
+        glBindVertexArray(0);
+
+        glActiveTexture(GL_TEXTURE0);
+    }
+
+    // binds the textures without drawing, for meshes drawn together in an ArenaBatch
+    void bindMaterial(Shader &shader)
+    {
+        bindTextures(shader);
+    }
+
+    // attach a buffer of per-instance glm::mat4 model matrices at attribute locations 7-10.
+    // The VAO is shared by all meshes, so this applies to every mesh.
+    void setInstanceBuffer(unsigned int buffer)
+    {
+        glBindVertexArray(VAO);
+        glBindBuffer(GL_ARRAY_BUFFER, buffer);
+        for (unsigned int i = 0; i < 4; i++)
+        {
+            glEnableVertexAttribArray(7 + i);
+            glVertexAttribPointer(7 + i, 4, GL_FLOAT, GL_FALSE, sizeof(glm::mat4), (void*)(i * sizeof(glm::vec4)));
+            glVertexAttribDivisor(7 + i, 1);
+        }
+        glBindVertexArray(0);
+    }
+
 private:
-    // render data 
-    unsigned int VBO, EBO;
+    const void *indexOffset() const
+    {
+        return (const void *)(range.firstIndex * sizeof(unsigned int));
+    }
+
+    // texture unit of every entry of textures, -1 for textures without a unit
+    vector<int> textureUnits;
+
+    // draw time only binds, the sampler uniforms are set once per program
+    void bindTextures(Shader &shader)
+    {
+        if (textures.empty())
+            return;
+        if (!shader.samplersConfigured)
+            configureSamplers(shader);
+        for(unsigned int i = 0; i < textures.size(); i++)
+        {
+            if (textureUnits[i] < 0)
+                continue;
+            glActiveTexture(GL_TEXTURE0 + textureUnits[i]); // active proper texture unit before binding
+            glBindTexture(GL_TEXTURE_2D, textures[i].id);
+        }
+    }
+
+    // assigns the fixed units, the N in texture_diffuseN counts the textures of a type in order
+    void resolveTextureUnits()
+    {
+        unsigned int numbers[MESH_TEXTURE_TYPES] = {0};
+        textureUnits.assign(textures.size(), -1);
+        for(unsigned int i = 0; i < textures.size(); i++)
+            for(unsigned int type = 0; type < MESH_TEXTURE_TYPES; type++)
+                if(textures[i].type == meshTextureTypes[type])
+                {
+                    if(numbers[type] < MESH_TEXTURES_PER_TYPE)
+                        textureUnits[i] = MESH_TEXTURE_UNIT_BASE + type * MESH_TEXTURES_PER_TYPE + numbers[type]++;
+                    break;
+                }
+    }
+
+    // points every material sampler the program has at its fixed unit, once per program
+    static void configureSamplers(Shader &shader)
+    {
+        GLint previous = 0;
+        glGetIntegerv(GL_CURRENT_PROGRAM, &previous);
+        glUseProgram(shader.ID);
+        for(unsigned int type = 0; type < MESH_TEXTURE_TYPES; type++)
+            for(unsigned int n = 0; n < MESH_TEXTURES_PER_TYPE; n++)
+            {
+                string name = meshTextureTypes[type] + std::to_string(n + 1);
+                GLint location = glGetUniformLocation(shader.ID, name.c_str());
+                if(location >= 0)
+                    glUniform1i(location, MESH_TEXTURE_UNIT_BASE + type * MESH_TEXTURES_PER_TYPE + n);
+            }
+        glUseProgram(previous);
+        shader.samplersConfigured = true;
+    }
 
-    // initializes all the buffer objects/arrays
+    // copies the mesh into the geometry arena
     void setupMesh()
     {
-        // create buffers/arrays
-        glGenVertexArrays(1, &VAO);
-        glGenBuffers(1, &VBO);
-        glGenBuffers(1, &EBO);
+        GeometryArena<Vertex> &arena = GeometryArena<Vertex>::instance();
+        arena.setupAttributes = &Mesh::setupVertexAttributes;
+        range = arena.allocate(vertices, indices);
+        VAO = arena.vao();
+    }
 
-        glBindVertexArray(VAO);
-        // load data into vertex buffers
-        glBindBuffer(GL_ARRAY_BUFFER, VBO);
+public:
+    // attribute layout of Vertex for the arena VAO (and other Vertex buffers, see
+    // translucency_cache.h), with the vertex buffer bound
+    static void setupVertexAttributes()
+    {
         // A great thing about structs is that their memory layout is sequential for all its items.
         // The effect is that we can simply pass a pointer to the struct and it translates perfectly to a glm::vec3/2 array which
         // again translates to 3/2 floats which translates to a byte array.
-        glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), &vertices[0], GL_STATIC_DRAW);  
-
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), &indices[0], GL_STATIC_DRAW);
-
         // set the vertex attribute pointers
         // vertex Positions
         glEnableVertexAttribArray(0);	
@@ -140,7 +217,6 @@ private:
 		// weights
 		glEnableVertexAttribArray(6);
 		glVertexAttribPointer(6, 4, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, m_Weights));
-        glBindVertexArray(0);
     }
 };
 #endif
\ No newline at end of file
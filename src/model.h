@@ -12,17 +12,52 @@
 
 #include "mesh.h"
 #include "shader.h"
+#include "texture_cache.h"
+#include "trace.h"
 
 #include <string>
 #include <fstream>
 #include <sstream>
 #include <iostream>
 #include <map>
+#include <unordered_map>
 #include <vector>
 using namespace std;
 
 unsigned int TextureFromFile(const char *path, const string &directory, bool gamma = false);
 
+// a decoded image, the pixels are owned by stb_image (stbi_image_free)
+struct ImageData {
+    string path;        // as referenced by the material, relative to the model directory
+    string type;        // sampler name prefix of the first mesh using it
+    string key;         // TextureCache key, the pixels are not decoded if the cache already had it
+    int width;
+    int height;
+    int components;
+    unsigned char *pixels;
+};
+
+// the CPU side of one mesh, texture ids are resolved by path when the mesh is created
+struct MeshData {
+    vector<Vertex>       vertices;
+    vector<unsigned int> indices;
+    vector<Texture>      textures;
+};
+
+// everything read from a model file, built without GL calls so it can be made on any thread
+struct ModelData {
+    string directory;
+    bool gamma;
+    vector<ImageData> images;
+    vector<MeshData>  meshes;
+    // index into images by material path
+    unordered_map<string, unsigned int> imageIndex;
+};
+
+bool decodeImage(const string &filename, ImageData &image);
+void uploadImage(unsigned int texture, const ImageData &image, const void *pixels);
+size_t imageBytes(const ImageData &image);
+
 class Model 
 {
 public:
@@ -31,24 +66,22 @@ public:
     vector<Mesh>    meshes;
     string directory;
     bool gammaCorrection;
+    // false while an AssetLoader is still streaming the model in
+    bool loaded;
+
+    // empty model, to be filled by AssetLoader::load
+    Model() : gammaCorrection(false), loaded(false), batchedMeshes(0), batchable(false) {}
 
     // constructor, expects a filepath to a 3D model.
-    Model(string const &path, bool gamma = false) : gammaCorrection(gamma)
+    Model(string const &path, bool gamma = false) : gammaCorrection(gamma), loaded(false), batchedMeshes(0), batchable(false)
     {
         loadModel(path);
     }
 
-    // draws the model, and thus all its meshes
-    void Draw(Shader &shader)
-    {
-        for(unsigned int i = 0; i < meshes.size(); i++)
-            meshes[i].Draw(shader);
-    }
-    
-private:
-    // loads a model with supported ASSIMP extensions from file and stores the resulting meshes in the meshes vector.
-    void loadModel(string const &path)
+    // reads and converts a model file and decodes its textures, touches no GL state
+    static bool parse(string const &path, ModelData &data, bool gamma = false)
     {
+        TraceScope trace("parse model");
         // read file via ASSIMP
         Assimp::Importer importer;
         const aiScene* scene = importer.ReadFile(path, aiProcess_Triangulate | aiProcess_GenSmoothNormals | aiProcess_FlipUVs | aiProcess_CalcTangentSpace);
@@ -56,17 +89,145 @@ private:
         if(!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode) // if is Not Zero
         {
             cout << "ERROR::ASSIMP:: " << importer.GetErrorString() << endl;
-            return;
+            return false;
         }
         // retrieve the directory path of the filepath
-        directory = path.substr(0, path.find_last_of('/'));
+        data.directory = path.substr(0, path.find_last_of('/'));
+        data.gamma = gamma;
 
         // process ASSIMP's root node recursively
-        processNode(scene->mRootNode, scene);
+        processNode(scene->mRootNode, scene, data);
+        return true;
+    }
+
+    // hands back the model's references to its textures, the cache deletes them once nobody
+    // else uses them and the cache is over budget
+    void releaseTextures()
+    {
+        for(unsigned int i = 0; i < textures_loaded.size(); i++)
+            TextureCache::instance().release(textures_loaded[i].id);
+        textures_loaded.clear();
+    }
+
+    // takes over a texture reference for image
+    void addTexture(const ImageData &image, unsigned int id)
+    {
+        Texture texture;
+        texture.id = id;
+        texture.type = image.type;
+        texture.path = image.path;
+        textures_loaded.push_back(texture);
+    }
+
+    // creates the GL buffers of a mesh, its textures must have been added before
+    void addMesh(const MeshData &data)
+    {
+        vector<Texture> textures = data.textures;
+        for(unsigned int i = 0; i < textures.size(); i++)
+            for(unsigned int j = 0; j < textures_loaded.size(); j++)
+                if(textures_loaded[j].path == textures[i].path)
+                    textures[i].id = textures_loaded[j].id;
+        meshes.push_back(Mesh(data.vertices, data.indices, textures));
+    }
+
+    // draws the model, and thus all its meshes. Meshes sharing their textures go out in a
+    // single multi-draw call.
+    void Draw(Shader &shader)
+    {
+        if (meshes.empty())
+            return;
+        if (batchedMeshes != meshes.size())
+        {
+            batch.clear();
+            addToBatch(batch);
+            batchedMeshes = meshes.size();
+            batchable = sharesMaterial();
+        }
+        if (!batchable)
+        {
+            for(unsigned int i = 0; i < meshes.size(); i++)
+                meshes[i].Draw(shader);
+            return;
+        }
+        meshes[0].bindMaterial(shader);
+        batch.draw(meshes[0].VAO);
+        glActiveTexture(GL_TEXTURE0);
+    }
+
+    // adds every mesh to batch, to draw several models in one call (all meshes must share textures)
+    void addToBatch(ArenaBatch &batch) const
+    {
+        for(unsigned int i = 0; i < meshes.size(); i++)
+            batch.add(meshes[i].range);
+    }
+
+    // whether all meshes use the same textures, so they can be drawn in one call
+    bool sharesMaterial() const
+    {
+        for(unsigned int i = 1; i < meshes.size(); i++)
+        {
+            if (meshes[i].textures.size() != meshes[0].textures.size())
+                return false;
+            for(unsigned int j = 0; j < meshes[i].textures.size(); j++)
+                if (meshes[i].textures[j].id != meshes[0].textures[j].id || meshes[i].textures[j].type != meshes[0].textures[j].type)
+                    return false;
+        }
+        return true;
+    }
+
+    // draws count instances of every mesh, see setInstanceBuffer
+    void DrawInstanced(Shader &shader, unsigned int count)
+    {
+        for(unsigned int i = 0; i < meshes.size(); i++)
+            meshes[i].DrawInstanced(shader, count);
+    }
+
+    // use buffer (count glm::mat4 model matrices) as the per-instance transforms of every mesh
+    void setInstanceBuffer(unsigned int buffer)
+    {
+        for(unsigned int i = 0; i < meshes.size(); i++)
+            meshes[i].setInstanceBuffer(buffer);
+    }
+    
+private:
+    // the meshes as one multi-draw, rebuilt when meshes were added
+    ArenaBatch batch;
+    size_t batchedMeshes;
+    bool batchable;
+
+    // loads a model with supported ASSIMP extensions from file and stores the resulting meshes in the meshes vector.
+    void loadModel(string const &path)
+    {
+        TraceScope trace("load model");
+        ModelData data;
+        if (parse(path, data, gammaCorrection))
+        {
+            directory = data.directory;
+            for(unsigned int i = 0; i < data.images.size(); i++)
+            {
+                ImageData &image = data.images[i];
+                unsigned int textureID = TextureCache::instance().acquire(image.key);
+                if (textureID == 0)
+                {
+                    // not decoded by parse if it was cached then, but evicted since
+                    if (!image.pixels)
+                        decodeImage(directory + '/' + image.path, image);
+                    glGenTextures(1, &textureID);
+                    if (image.pixels)
+                        uploadImage(textureID, image, image.pixels);
+                    TextureCache::instance().insert(image.key, textureID, imageBytes(image));
+                }
+                stbi_image_free(image.pixels);
+                addTexture(image, textureID);
+            }
+            for(unsigned int i = 0; i < data.meshes.size(); i++)
+                addMesh(data.meshes[i]);
+        }
+        loaded = true;
     }
 
     // processes a node in a recursive fashion. Processes each individual mesh located at the node and repeats this process on its children nodes (if any).
-    void processNode(aiNode *node, const aiScene *scene)
+    static void processNode(aiNode *node, const aiScene *scene, ModelData &data)
     {
         // process each mesh located at the current node
         for(unsigned int i = 0; i < node->mNumMeshes; i++)
@@ -74,22 +235,23 @@ private:
             // the node object only contains indices to index the actual objects in the scene. 
             // the scene contains all the data, node is just to keep stuff organized (like relations between nodes).
             aiMesh* mesh = scene->mMeshes[node->mMeshes[i]];
-            meshes.push_back(processMesh(mesh, scene));
+            data.meshes.push_back(MeshData());
+            processMesh(mesh, scene, data, data.meshes.back());
         }
         // after we've processed all of the meshes (if any) we then recursively process each of the children nodes
         for(unsigned int i = 0; i < node->mNumChildren; i++)
         {
-            processNode(node->mChildren[i], scene);
+            processNode(node->mChildren[i], scene, data);
         }
 
     }
 
-    Mesh processMesh(aiMesh *mesh, const aiScene *scene)
+    static void processMesh(aiMesh *mesh, const aiScene *scene, ModelData &data, MeshData &meshData)
     {
         // data to fill
-        vector<Vertex> vertices;
-        vector<unsigned int> indices;
-        vector<Texture> textures;
+        vector<Vertex> &vertices = meshData.vertices;
+        vector<unsigned int> &indices = meshData.indices;
+        vector<Texture> &textures = meshData.textures;
 
         // walk through each of the mesh's vertices
         for(unsigned int i = 0; i < mesh->mNumVertices; i++)
@@ -152,25 +314,22 @@ private:
         // normal: texture_normalN
 
         // 1. diffuse maps
-        vector<Texture> diffuseMaps = loadMaterialTextures(material, aiTextureType_DIFFUSE, "texture_diffuse");
+        vector<Texture> diffuseMaps = loadMaterialTextures(material, aiTextureType_DIFFUSE, "texture_diffuse", data);
         textures.insert(textures.end(), diffuseMaps.begin(), diffuseMaps.end());
         // 2. specular maps
-        vector<Texture> specularMaps = loadMaterialTextures(material, aiTextureType_SPECULAR, "texture_specular");
+        vector<Texture> specularMaps = loadMaterialTextures(material, aiTextureType_SPECULAR, "texture_specular", data);
         textures.insert(textures.end(), specularMaps.begin(), specularMaps.end());
         // 3. normal maps
-        std::vector<Texture> normalMaps = loadMaterialTextures(material, aiTextureType_HEIGHT, "texture_normal");
+        std::vector<Texture> normalMaps = loadMaterialTextures(material, aiTextureType_HEIGHT, "texture_normal", data);
         textures.insert(textures.end(), normalMaps.begin(), normalMaps.end());
         // 4. height maps
-        std::vector<Texture> heightMaps = loadMaterialTextures(material, aiTextureType_AMBIENT, "texture_height");
+        std::vector<Texture> heightMaps = loadMaterialTextures(material, aiTextureType_AMBIENT, "texture_height", data);
         textures.insert(textures.end(), heightMaps.begin(), heightMaps.end());
-        
-        // return a mesh object created from the extracted mesh data
-        return Mesh(vertices, indices, textures);
     }
 
-    // checks all material textures of a given type and loads the textures if they're not loaded yet.
-    // the required info is returned as a Texture struct.
-    vector<Texture> loadMaterialTextures(aiMaterial *mat, aiTextureType type, string typeName)
+    // checks all material textures of a given type and decodes the images if they're not decoded yet.
+    // the required info is returned as a Texture struct, its id is filled in by addMesh.
+    static vector<Texture> loadMaterialTextures(aiMaterial *mat, aiTextureType type, string typeName, ModelData &data)
     {
         vector<Texture> textures;
         for(unsigned int i = 0; i < mat->GetTextureCount(type); i++)
@@ -178,68 +337,96 @@ private:
             aiString str;
             mat->GetTexture(type, i, &str);
             // check if texture was loaded before and if so, continue to next iteration: skip loading a new texture
-            bool skip = false;
-            for(unsigned int j = 0; j < textures_loaded.size(); j++)
+            Texture texture;
+            texture.id = 0;
+            texture.type = typeName;
+            texture.path = str.C_Str();
+            unordered_map<string, unsigned int>::iterator loaded = data.imageIndex.find(texture.path);
+            if(loaded != data.imageIndex.end())
             {
-                if(std::strcmp(textures_loaded[j].path.data(), str.C_Str()) == 0)
-                {
-                    textures.push_back(textures_loaded[j]);
-                    skip = true; // a texture with the same filepath has already been loaded, continue to next one. (optimization)
-                    break;
-                }
+                // a texture with the same filepath has already been loaded, continue to next one. (optimization)
+                texture.type = data.images[loaded->second].type;
             }
-            if(!skip)
-            {   // if texture hasn't been loaded already, load it
-                Texture texture;
-                texture.id = TextureFromFile(str.C_Str(), this->directory);
-                texture.type = typeName;
-                texture.path = str.C_Str();
-                textures.push_back(texture);
-                textures_loaded.push_back(texture);  // store it as texture loaded for entire model, to ensure we won't unnecessary load duplicate textures.
+            else
+            {   // if texture hasn't been loaded already, load it (unless another model already did)
+                ImageData image;
+                image.path = texture.path;
+                image.type = typeName;
+                image.key = TextureCache::key(data.directory + '/' + texture.path, data.gamma);
+                image.pixels = NULL;
+                if (!TextureCache::instance().contains(image.key))
+                    decodeImage(data.directory + '/' + texture.path, image);
+                data.imageIndex[texture.path] = data.images.size();
+                data.images.push_back(image);  // store it as texture loaded for entire model, to ensure we won't unnecessary load duplicate textures.
             }
+            textures.push_back(texture);
         }
         return textures;
     }
 };
 
 
+bool decodeImage(const string &filename, ImageData &image)
+{
+    image.pixels = stbi_load(filename.c_str(), &image.width, &image.height, &image.components, 0);
+    if (!image.pixels)
+    {
+        std::cout << "Texture failed to load at path: " << filename << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// pixels is a client pointer, or an offset when a pixel unpack buffer is bound
+void uploadImage(unsigned int texture, const ImageData &image, const void *pixels)
+{
+    GLenum format;
+    if (image.components == 1)
+        format = GL_RED;
+    else if (image.components == 3)
+        format = GL_RGB;
+    else if (image.components == 4)
+        format = GL_RGBA;
+
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, format, image.width, image.height, 0, format, GL_UNSIGNED_BYTE, pixels);
+    glGenerateMipmap(GL_TEXTURE_2D);
+
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+}
+
+// size of the texture including its mip chain
+size_t imageBytes(const ImageData &image)
+{
+    if (!image.pixels)
+        return 0;
+    return (size_t)image.width * image.height * image.components * 4 / 3;
+}
+
+// the texture is shared through the TextureCache, hand it back with TextureCache::release
 unsigned int TextureFromFile(const char *path, const string &directory, bool gamma)
 {
     string filename = string(path);
     filename = directory + '/' + filename;
 
-    unsigned int textureID;
+    string key = TextureCache::key(filename, gamma);
+    unsigned int textureID = TextureCache::instance().acquire(key);
+    if (textureID != 0)
+        return textureID;
     glGenTextures(1, &textureID);
 
-    int width, height, nrComponents;
-    unsigned char *data = stbi_load(filename.c_str(), &width, &height, &nrComponents, 0);
-    if (data)
-    {
-        GLenum format;
-        if (nrComponents == 1)
-            format = GL_RED;
-        else if (nrComponents == 3)
-            format = GL_RGB;
-        else if (nrComponents == 4)
-            format = GL_RGBA;
-
-        glBindTexture(GL_TEXTURE_2D, textureID);
-        glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
-        glGenerateMipmap(GL_TEXTURE_2D);
-
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-        stbi_image_free(data);
-    }
-    else
+    ImageData image;
+    image.path = path;
+    if (decodeImage(filename, image))
     {
-        std::cout << "Texture failed to load at path: " << path << std::endl;
-        stbi_image_free(data);
+        uploadImage(textureID, image, image.pixels);
+        stbi_image_free(image.pixels);
     }
+    TextureCache::instance().insert(key, textureID, imageBytes(image));
 
     return textureID;
 }
-#endif
\ No newline at end of file
+#endif
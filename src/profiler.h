@@ -0,0 +1,291 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <glad/glad.h>
+
+#include "trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// number of frames a timer query stays in flight before its result is read back.
+// Results are collected when a slot is about to be reused, so reading never stalls.
+#define PROFILER_FRAMES_IN_FLIGHT 2
+// number of samples kept per pass for the rolling averages and percentiles
+#define PROFILER_HISTORY 240
+
+struct PassStats {
+    float avg;
+    float p50;
+    float p95;
+    float p99;
+    unsigned int count;
+};
+
+// fixed size ring of timings in milliseconds
+class TimingHistory
+{
+public:
+    TimingHistory() : next(0) {}
+
+    void push(float ms)
+    {
+        if (samples.size() < PROFILER_HISTORY)
+            samples.push_back(ms);
+        else
+            samples[next] = ms;
+        next = (next + 1) % PROFILER_HISTORY;
+    }
+
+    PassStats stats() const
+    {
+        PassStats s = {0.0f, 0.0f, 0.0f, 0.0f, (unsigned int)samples.size()};
+        if (samples.empty())
+            return s;
+        std::vector<float> sorted(samples);
+        std::sort(sorted.begin(), sorted.end());
+        float sum = 0.0f;
+        for (unsigned int i = 0; i < sorted.size(); i++)
+            sum += sorted[i];
+        s.avg = sum / sorted.size();
+        s.p50 = percentile(sorted, 0.50f);
+        s.p95 = percentile(sorted, 0.95f);
+        s.p99 = percentile(sorted, 0.99f);
+        return s;
+    }
+
+private:
+    std::vector<float> samples;
+    unsigned int next;
+
+    static float percentile(const std::vector<float> &sorted, float p)
+    {
+        unsigned int index = (unsigned int)(p * (sorted.size() - 1) + 0.5f);
+        return sorted[index];
+    }
+};
+
+// Per-pass GPU and CPU timer. Every pass gets GL_TIMESTAMP query pairs (which, unlike
+// GL_TIME_ELAPSED, may nest) for each frame in flight. A pass can be entered several
+// times per frame (e.g. once per light), the intervals are summed.
+class PassProfiler
+{
+public:
+    bool showOverlay;
+
+    PassProfiler() : showOverlay(true), frame(0) {}
+
+    // call once at the start of every frame, collects the results of the slot about to be reused
+    void beginFrame()
+    {
+        frame++;
+        unsigned int slot = frame % PROFILER_FRAMES_IN_FLIGHT;
+        for (unsigned int i = 0; i < passes.size(); i++)
+        {
+            Pass &pass = passes[i];
+            collect(pass, slot);
+            pass.used[slot] = 0;
+            if (pass.cpuFrameMs > 0.0f)
+                pass.cpu.push(pass.cpuFrameMs);
+            pass.cpuFrameMs = 0.0f;
+        }
+    }
+
+    void begin(const char *name)
+    {
+        Pass &pass = find(name);
+        unsigned int slot = frame % PROFILER_FRAMES_IN_FLIGHT;
+        std::vector<GLuint> &queries = pass.queries[slot];
+        if (pass.used[slot] * 2 + 2 > queries.size())
+        {
+            queries.resize(queries.size() + 2);
+            glGenQueries(2, &queries[queries.size() - 2]);
+        }
+        glQueryCounter(queries[pass.used[slot] * 2], GL_TIMESTAMP);
+        pass.cpuStart = std::chrono::high_resolution_clock::now();
+        pass.traceStart = Trace::enabled() ? Trace::now() : 0;
+    }
+
+    void end(const char *name)
+    {
+        Pass &pass = find(name);
+        unsigned int slot = frame % PROFILER_FRAMES_IN_FLIGHT;
+        glQueryCounter(pass.queries[slot][pass.used[slot] * 2 + 1], GL_TIMESTAMP);
+        pass.used[slot]++;
+        std::chrono::duration<float, std::milli> elapsed = std::chrono::high_resolution_clock::now() - pass.cpuStart;
+        pass.cpuFrameMs += elapsed.count();
+        if (pass.traceStart != 0)
+            Trace::complete(pass.label, pass.traceStart, Trace::now());
+    }
+
+    PassStats gpuStats(const char *name) { return find(name).gpu.stats(); }
+    PassStats cpuStats(const char *name) { return find(name).cpu.stats(); }
+
+    // short per-pass breakdown for the window title
+    std::string summary() const
+    {
+        std::string text;
+        char buffer[64];
+        for (unsigned int i = 0; i < passes.size(); i++)
+        {
+            snprintf(buffer, sizeof(buffer), "%s%s %.2f", i == 0 ? "" : " | ", passes[i].name.c_str(), passes[i].gpu.stats().avg);
+            text += buffer;
+        }
+        return text + " ms";
+    }
+
+    // draws the GPU (top) and CPU (bottom) breakdown as stacked bars with scissored clears,
+    // so no extra shader or text rendering is needed. Full width corresponds to budgetMs.
+    void drawOverlay(int width, float budgetMs = 33.3f)
+    {
+        const int margin = 10;
+        const int barHeight = 12;
+        float pxPerMs = (width - 2 * margin) / budgetMs;
+
+        GLfloat clearColor[4];
+        glGetFloatv(GL_COLOR_CLEAR_VALUE, clearColor);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glEnable(GL_SCISSOR_TEST);
+
+        // backdrop and 60 Hz marker
+        fillRect(margin - 2, margin - 2, width - 2 * margin + 4, 2 * barHeight + 6, 0.1f, 0.1f, 0.1f);
+        fillRect(margin + (int)(16.7f * pxPerMs), margin - 2, 1, 2 * barHeight + 6, 1.0f, 1.0f, 1.0f);
+
+        int gpuX = margin;
+        int cpuX = margin;
+        for (unsigned int i = 0; i < passes.size(); i++)
+        {
+            const float *color = palette(i);
+            int gpuWidth = (int)(passes[i].gpu.stats().avg * pxPerMs);
+            int cpuWidth = (int)(passes[i].cpu.stats().avg * pxPerMs);
+            fillRect(gpuX, margin + barHeight + 2, gpuWidth, barHeight, color[0], color[1], color[2]);
+            fillRect(cpuX, margin, cpuWidth, barHeight, color[0], color[1], color[2]);
+            gpuX += gpuWidth;
+            cpuX += cpuWidth;
+        }
+
+        glDisable(GL_SCISSOR_TEST);
+        glClearColor(clearColor[0], clearColor[1], clearColor[2], clearColor[3]);
+    }
+
+    // prints the rolling statistics of all passes, used on exit
+    void print(std::ostream &out) const
+    {
+        char line[160];
+        snprintf(line, sizeof(line), "%-18s %8s %8s %8s %8s | %8s %8s %6s\n", "pass (ms)", "gpu avg", "gpu p50", "gpu p95", "gpu p99", "cpu avg", "cpu p95", "n");
+        out << line;
+        for (unsigned int i = 0; i < passes.size(); i++)
+        {
+            PassStats gpu = passes[i].gpu.stats();
+            PassStats cpu = passes[i].cpu.stats();
+            snprintf(line, sizeof(line), "%-18s %8.3f %8.3f %8.3f %8.3f | %8.3f %8.3f %6u\n", passes[i].name.c_str(), gpu.avg, gpu.p50, gpu.p95, gpu.p99, cpu.avg, cpu.p95, gpu.count);
+            out << line;
+        }
+    }
+
+    // delete all query objects, must be called while the context is still alive
+    void cleanup()
+    {
+        for (unsigned int i = 0; i < passes.size(); i++)
+            for (unsigned int slot = 0; slot < PROFILER_FRAMES_IN_FLIGHT; slot++)
+                if (!passes[i].queries[slot].empty())
+                    glDeleteQueries((GLsizei)passes[i].queries[slot].size(), &passes[i].queries[slot][0]);
+        passes.clear();
+    }
+
+private:
+    struct Pass {
+        std::string name;
+        // the name as passed to begin(), kept for the trace which needs static storage
+        const char *label;
+        std::vector<GLuint> queries[PROFILER_FRAMES_IN_FLIGHT];
+        unsigned int used[PROFILER_FRAMES_IN_FLIGHT];
+        std::chrono::high_resolution_clock::time_point cpuStart;
+        int64_t traceStart;
+        float cpuFrameMs;
+        TimingHistory gpu;
+        TimingHistory cpu;
+    };
+
+    std::vector<Pass> passes;
+    unsigned long frame;
+
+    Pass &find(const char *name)
+    {
+        for (unsigned int i = 0; i < passes.size(); i++)
+            if (passes[i].name == name)
+                return passes[i];
+        Pass pass;
+        pass.name = name;
+        pass.label = name;
+        pass.traceStart = 0;
+        for (unsigned int slot = 0; slot < PROFILER_FRAMES_IN_FLIGHT; slot++)
+            pass.used[slot] = 0;
+        pass.cpuFrameMs = 0.0f;
+        passes.push_back(pass);
+        return passes.back();
+    }
+
+    // sums the intervals recorded in a slot, results that are not ready yet are dropped
+    // instead of waiting for them
+    void collect(Pass &pass, unsigned int slot)
+    {
+        if (pass.used[slot] == 0)
+            return;
+        GLint available = 0;
+        glGetQueryObjectiv(pass.queries[slot][pass.used[slot] * 2 - 1], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available)
+            return;
+        GLuint64 total = 0;
+        for (unsigned int i = 0; i < pass.used[slot]; i++)
+        {
+            GLuint64 start, stop;
+            glGetQueryObjectui64v(pass.queries[slot][i * 2], GL_QUERY_RESULT, &start);
+            glGetQueryObjectui64v(pass.queries[slot][i * 2 + 1], GL_QUERY_RESULT, &stop);
+            total += stop - start;
+            Trace::gpuComplete(pass.label, start, stop);
+        }
+        pass.gpu.push(total / 1.0e6f);
+    }
+
+    static void fillRect(int x, int y, int w, int h, float r, float g, float b)
+    {
+        if (w <= 0 || h <= 0)
+            return;
+        glScissor(x, y, w, h);
+        glClearColor(r, g, b, 1.0f);
+        glClear(GL_COLOR_BUFFER_BIT);
+    }
+
+    static const float *palette(unsigned int i)
+    {
+        static const float colors[8][3] = {
+            {0.90f, 0.30f, 0.25f}, {0.25f, 0.65f, 0.90f}, {0.95f, 0.75f, 0.20f}, {0.40f, 0.80f, 0.35f},
+            {0.70f, 0.45f, 0.85f}, {0.95f, 0.55f, 0.15f}, {0.30f, 0.85f, 0.80f}, {0.85f, 0.85f, 0.85f},
+        };
+        return colors[i % 8];
+    }
+};
+
+// times the enclosing scope as the named pass
+class ProfileScope
+{
+public:
+    ProfileScope(PassProfiler &profiler, const char *name) : profiler(profiler), name(name)
+    {
+        profiler.begin(name);
+    }
+    ~ProfileScope()
+    {
+        profiler.end(name);
+    }
+
+private:
+    PassProfiler &profiler;
+    const char *name;
+};
+#endif
@@ -0,0 +1,80 @@
+#ifndef SH_LIGHTING_H
+#define SH_LIGHTING_H
+
+#include <glm/glm.hpp>
+
+#include <cmath>
+
+// order 2 spherical harmonics, bands 0 to 2
+#define SH_COEFFICIENTS 9
+
+// RGB coefficients of a function on the sphere
+struct SHCoefficients {
+    glm::vec3 c[SH_COEFFICIENTS];
+
+    SHCoefficients()
+    {
+        for (int i = 0; i < SH_COEFFICIENTS; i++)
+            c[i] = glm::vec3(0.0f);
+    }
+};
+
+// real SH basis at the unit direction d, the same as shBasis in shaders/sh_basis.glsl
+void shBasis(const glm::vec3 &d, float basis[SH_COEFFICIENTS])
+{
+    basis[0] = 0.282095f;
+    basis[1] = 0.488603f * d.y;
+    basis[2] = 0.488603f * d.z;
+    basis[3] = 0.488603f * d.x;
+    basis[4] = 1.092548f * d.x * d.y;
+    basis[5] = 1.092548f * d.y * d.z;
+    basis[6] = 0.315392f * (3.0f * d.z * d.z - 1.0f);
+    basis[7] = 1.092548f * d.x * d.z;
+    basis[8] = 0.546274f * (d.x * d.x - d.y * d.y);
+}
+
+// direction of a lat-long (equirectangular) environment map at uv, v = 0 is straight up (+y)
+// and u = 0.5 looks down -z
+glm::vec3 latLongDirection(float u, float v)
+{
+    float phi = 2.0f * 3.14159265f * (u - 0.5f);
+    float theta = 3.14159265f * v;
+    return glm::vec3(std::sin(theta) * std::sin(phi), std::cos(theta), -std::sin(theta) * std::cos(phi));
+}
+
+// Projects a lat-long radiance map (channels floats per texel, rows from the top) onto
+// SH, every texel weighted by its solid angle.
+SHCoefficients projectLatLong(const float *pixels, int width, int height, int channels)
+{
+    SHCoefficients radiance;
+    if (pixels == nullptr || width <= 0 || height <= 0 || channels < 3)
+        return radiance;
+    float basis[SH_COEFFICIENTS];
+    float texelArea = (2.0f * 3.14159265f / width) * (3.14159265f / height);
+    for (int y = 0; y < height; y++)
+    {
+        float v = (y + 0.5f) / height;
+        float solidAngle = texelArea * std::sin(3.14159265f * v);
+        for (int x = 0; x < width; x++)
+        {
+            const float *texel = pixels + ((size_t)y * width + x) * channels;
+            glm::vec3 color(texel[0], texel[1], texel[2]);
+            shBasis(latLongDirection((x + 0.5f) / width, v), basis);
+            for (int i = 0; i < SH_COEFFICIENTS; i++)
+                radiance.c[i] += color * (basis[i] * solidAngle);
+        }
+    }
+    return radiance;
+}
+
+// Convolves radiance with the clamped cosine (Ramamoorthi and Hanrahan 2001), so the
+// coefficients evaluated at a normal give the irradiance there.
+SHCoefficients irradianceSH(const SHCoefficients &radiance)
+{
+    const float band[3] = {3.14159265f, 2.0f * 3.14159265f / 3.0f, 3.14159265f / 4.0f};
+    SHCoefficients irradiance;
+    for (int i = 0; i < SH_COEFFICIENTS; i++)
+        irradiance.c[i] = radiance.c[i] * band[i == 0 ? 0 : (i < 4 ? 1 : 2)];
+    return irradiance;
+}
+#endif
@@ -4,97 +4,67 @@
 #include <glad/glad.h>
 #include <glm/glm.hpp>
 
+#include "filesystem.h"
+#include "trace.h"
+
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <map>
 #include <string>
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <vector>
+
+// preprocessor definitions injected into every stage, NAME -> VALUE
+typedef std::map<std::string, std::string> ShaderDefines;
+
+// binding points of the uniform blocks shared by the shaders, see frame_data.h
+#define CAMERA_BLOCK_BINDING 0
+#define LIGHT_BLOCK_BINDING 1
+#define CASCADE_BLOCK_BINDING 2
 
 class Shader
 {
 public:
     unsigned int ID;
+    // the files and defines the program was built from, kept so it can be rebuilt (see ShaderReloader)
+    std::string vertexPath;
+    std::string fragmentPath;
+    std::string geometryPath;
+    ShaderDefines defines;
+    // the files pulled in by #include "file" lines, watched along with the stages
+    std::vector<std::string> includePaths;
+    // set by Mesh once the material samplers point at their fixed units, cleared when ID changes
+    bool samplersConfigured;
     // constructor generates the shader on the fly
     // ------------------------------------------------------------------------
-    Shader(const char* vertexPath, const char* fragmentPath, const char* geometryPath = nullptr)
+    Shader(const char* vertexPath, const char* fragmentPath, const char* geometryPath = nullptr, const ShaderDefines &defines = ShaderDefines())
+        : vertexPath(vertexPath), fragmentPath(fragmentPath), geometryPath(geometryPath != nullptr ? geometryPath : ""), defines(defines), samplersConfigured(false)
     {
+        TraceScope trace("compile shader");
         // 1. retrieve the vertex/fragment source code from filePath
         std::string vertexCode;
         std::string fragmentCode;
         std::string geometryCode;
-        std::ifstream vShaderFile;
-        std::ifstream fShaderFile;
-        std::ifstream gShaderFile;
-        // ensure ifstream objects can throw exceptions:
-        vShaderFile.exceptions (std::ifstream::failbit | std::ifstream::badbit);
-        fShaderFile.exceptions (std::ifstream::failbit | std::ifstream::badbit);
-        gShaderFile.exceptions (std::ifstream::failbit | std::ifstream::badbit);
-        try 
+        readSources(this->vertexPath, this->fragmentPath, this->geometryPath, defines, vertexCode, fragmentCode, geometryCode, &includePaths);
+        // 2. reuse the program if the same sources were linked before, in this process or
+        // (through the program binary cache) in an earlier run on the same driver
+        uint64_t key = programKey(vertexCode, fragmentCode, geometryCode);
+        if (!loadCachedProgram(key))
         {
-            // open files
-            vShaderFile.open(vertexPath);
-            fShaderFile.open(fragmentPath);
-            std::stringstream vShaderStream, fShaderStream;
-            // read file's buffer contents into streams
-            vShaderStream << vShaderFile.rdbuf();
-            fShaderStream << fShaderFile.rdbuf();		
-            // close file handlers
-            vShaderFile.close();
-            fShaderFile.close();
-            // convert stream into string
-            vertexCode = vShaderStream.str();
-            fragmentCode = fShaderStream.str();			
-            // if geometry shader path is present, also load a geometry shader
-            if(geometryPath != nullptr)
+            // 3. compile and link
+            ID = createProgram(vertexCode, fragmentCode, geometryCode);
+            if (finishProgram(ID))
             {
-                gShaderFile.open(geometryPath);
-                std::stringstream gShaderStream;
-                gShaderStream << gShaderFile.rdbuf();
-                gShaderFile.close();
-                geometryCode = gShaderStream.str();
+                linkedPrograms()[key] = ID;
+                storeProgramBinary(key, ID);
             }
         }
-        catch (std::ifstream::failure& e)
-        {
-            std::cout << "ERROR::SHADER::FILE_NOT_SUCCESSFULLY_READ: " << e.what() << std::endl;
-        }
-        const char* vShaderCode = vertexCode.c_str();
-        const char * fShaderCode = fragmentCode.c_str();
-        // 2. compile shaders
-        unsigned int vertex, fragment;
-        // vertex shader
-        vertex = glCreateShader(GL_VERTEX_SHADER);
-        glShaderSource(vertex, 1, &vShaderCode, NULL);
-        glCompileShader(vertex);
-        checkCompileErrors(vertex, "VERTEX");
-        // fragment Shader
-        fragment = glCreateShader(GL_FRAGMENT_SHADER);
-        glShaderSource(fragment, 1, &fShaderCode, NULL);
-        glCompileShader(fragment);
-        checkCompileErrors(fragment, "FRAGMENT");
-        // if geometry shader is given, compile geometry shader
-        unsigned int geometry = 0;
-        if(geometryPath != nullptr)
-        {
-            const char * gShaderCode = geometryCode.c_str();
-            geometry = glCreateShader(GL_GEOMETRY_SHADER);
-            glShaderSource(geometry, 1, &gShaderCode, NULL);
-            glCompileShader(geometry);
-            checkCompileErrors(geometry, "GEOMETRY");
-        }
-        // shader Program
-        ID = glCreateProgram();
-        glAttachShader(ID, vertex);
-        glAttachShader(ID, fragment);
-        if(geometryPath != nullptr)
-            glAttachShader(ID, geometry);
-        glLinkProgram(ID);
-        checkCompileErrors(ID, "PROGRAM");
-        // delete the shaders as they're linked into our program now and no longer necessary
-        glDeleteShader(vertex);
-        glDeleteShader(fragment);
-        if(geometryPath != nullptr)
-            glDeleteShader(geometry);
-
+        bindUniformBlocks(ID);
     }
     // activate the shader
     // ------------------------------------------------------------------------
@@ -162,9 +132,341 @@ public:
     }
 
 private:
+    friend class ShaderReloader;
+
+    // reads the files of all stages, resolves their includes and injects the defines, returns
+    // false if a file could not be read; the included files are appended to includes if given
+    static bool readSources(const std::string &vertexPath, const std::string &fragmentPath, const std::string &geometryPath, const ShaderDefines &defines,
+                            std::string &vertexCode, std::string &fragmentCode, std::string &geometryCode,
+                            std::vector<std::string> *includes = nullptr)
+    {
+        std::ifstream vShaderFile;
+        std::ifstream fShaderFile;
+        std::ifstream gShaderFile;
+        // ensure ifstream objects can throw exceptions:
+        vShaderFile.exceptions (std::ifstream::failbit | std::ifstream::badbit);
+        fShaderFile.exceptions (std::ifstream::failbit | std::ifstream::badbit);
+        gShaderFile.exceptions (std::ifstream::failbit | std::ifstream::badbit);
+        try 
+        {
+            // open files
+            vShaderFile.open(vertexPath.c_str());
+            fShaderFile.open(fragmentPath.c_str());
+            std::stringstream vShaderStream, fShaderStream;
+            // read file's buffer contents into streams
+            vShaderStream << vShaderFile.rdbuf();
+            fShaderStream << fShaderFile.rdbuf();		
+            // close file handlers
+            vShaderFile.close();
+            fShaderFile.close();
+            // convert stream into string
+            vertexCode = vShaderStream.str();
+            fragmentCode = fShaderStream.str();			
+            // if geometry shader path is present, also load a geometry shader
+            if(!geometryPath.empty())
+            {
+                gShaderFile.open(geometryPath.c_str());
+                std::stringstream gShaderStream;
+                gShaderStream << gShaderFile.rdbuf();
+                gShaderFile.close();
+                geometryCode = gShaderStream.str();
+            }
+        }
+        catch (std::ifstream::failure& e)
+        {
+            std::cout << "ERROR::SHADER::FILE_NOT_SUCCESSFULLY_READ: " << e.what() << std::endl;
+            return false;
+        }
+        std::vector<std::string> included;
+        if (!resolveIncludes(vertexCode, vertexPath, included) || !resolveIncludes(fragmentCode, fragmentPath, included) ||
+            !resolveIncludes(geometryCode, geometryPath, included))
+            return false;
+        if (includes)
+            includes->insert(includes->end(), included.begin(), included.end());
+        injectDefines(vertexCode, defines);
+        injectDefines(fragmentCode, defines);
+        injectDefines(geometryCode, defines);
+        return true;
+    }
+
+    // compiles and links without asking for the results, so a driver that compiles in
+    // parallel (KHR_parallel_shader_compile) is not forced to finish before we need it
+    static unsigned int createProgram(const std::string &vertexCode, const std::string &fragmentCode, const std::string &geometryCode)
+    {
+        const char* vShaderCode = vertexCode.c_str();
+        const char * fShaderCode = fragmentCode.c_str();
+        // vertex shader
+        unsigned int vertex = glCreateShader(GL_VERTEX_SHADER);
+        glShaderSource(vertex, 1, &vShaderCode, NULL);
+        glCompileShader(vertex);
+        // fragment Shader
+        unsigned int fragment = glCreateShader(GL_FRAGMENT_SHADER);
+        glShaderSource(fragment, 1, &fShaderCode, NULL);
+        glCompileShader(fragment);
+        // shader Program
+        unsigned int program = glCreateProgram();
+        glAttachShader(program, vertex);
+        glAttachShader(program, fragment);
+        // if geometry shader is given, compile geometry shader
+        if(!geometryCode.empty())
+        {
+            const char * gShaderCode = geometryCode.c_str();
+            unsigned int geometry = glCreateShader(GL_GEOMETRY_SHADER);
+            glShaderSource(geometry, 1, &gShaderCode, NULL);
+            glCompileShader(geometry);
+            glAttachShader(program, geometry);
+        }
+        glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+        glLinkProgram(program);
+        return program;
+    }
+
+    // reports compile and link errors of a program made by createProgram and deletes its
+    // shaders, returns whether it linked
+    static bool finishProgram(unsigned int program)
+    {
+        GLuint shaders[3];
+        GLsizei count = 0;
+        glGetAttachedShaders(program, 3, &count, shaders);
+        for (GLsizei i = 0; i < count; i++)
+        {
+            GLint type = 0;
+            glGetShaderiv(shaders[i], GL_SHADER_TYPE, &type);
+            checkCompileErrors(shaders[i], type == GL_VERTEX_SHADER ? "VERTEX" : type == GL_FRAGMENT_SHADER ? "FRAGMENT" : "GEOMETRY");
+        }
+        bool linked = checkCompileErrors(program, "PROGRAM");
+        // delete the shaders as they're linked into our program now and no longer necessary
+        for (GLsizei i = 0; i < count; i++)
+        {
+            glDetachShader(program, shaders[i]);
+            glDeleteShader(shaders[i]);
+        }
+        return linked;
+    }
+
+    // attaches the shared uniform blocks the program declares to their fixed binding points
+    static void bindUniformBlocks(unsigned int program)
+    {
+        const char *names[3] = {"CameraData", "LightData", "CascadeData"};
+        const GLuint bindings[3] = {CAMERA_BLOCK_BINDING, LIGHT_BLOCK_BINDING, CASCADE_BLOCK_BINDING};
+        for (int i = 0; i < 3; i++)
+        {
+            GLuint index = glGetUniformBlockIndex(program, names[i]);
+            if (index != GL_INVALID_INDEX)
+                glUniformBlockBinding(program, index, bindings[i]);
+        }
+    }
+
+    // replaces every #include "file" line (file relative to path) by the file, whose lines are
+    // numbered from 1, and a #line that goes back to path's numbering; a file is pulled into a
+    // stage once, later includes of it are dropped. Returns false if a file could not be read.
+    static bool resolveIncludes(std::string &code, const std::string &path, std::vector<std::string> &included)
+    {
+        std::vector<std::string> stage;
+        return resolveIncludes(code, path, included, stage);
+    }
+
+    static bool resolveIncludes(std::string &code, const std::string &path, std::vector<std::string> &included, std::vector<std::string> &stage)
+    {
+        size_t slash = path.find_last_of('/');
+        std::string directory = slash == std::string::npos ? "" : path.substr(0, slash + 1);
+        std::string resolved;
+        std::istringstream lines(code);
+        std::string line;
+        int number = 0;
+        while (std::getline(lines, line))
+        {
+            number++;
+            size_t start = line.find_first_not_of(" \t");
+            size_t open = line.find('"');
+            size_t close = open == std::string::npos ? open : line.find('"', open + 1);
+            if (start == std::string::npos || line.compare(start, 8, "#include") != 0 || close == std::string::npos)
+            {
+                resolved += line + "\n";
+                continue;
+            }
+            std::string file = directory + line.substr(open + 1, close - open - 1);
+            if (std::find(stage.begin(), stage.end(), file) == stage.end())
+            {
+                stage.push_back(file);
+                std::ifstream stream(file.c_str());
+                if (!stream)
+                {
+                    std::cout << "ERROR::SHADER::INCLUDE_NOT_SUCCESSFULLY_READ: " << file << " (included by " << path << ")" << std::endl;
+                    return false;
+                }
+                std::stringstream contents;
+                contents << stream.rdbuf();
+                std::string source = contents.str();
+                if (!resolveIncludes(source, file, included, stage))
+                    return false;
+                if (std::find(included.begin(), included.end(), file) == included.end())
+                    included.push_back(file);
+                resolved += "#line 1\n" + source;
+            }
+            resolved += "#line " + std::to_string(number + 1) + "\n";
+        }
+        code = resolved;
+        return true;
+    }
+
+    // inserts the defines right after the #version line (which must stay first) and resets
+    // the line numbering so compiler errors still point at the right line of the file
+    static void injectDefines(std::string &code, const ShaderDefines &defines)
+    {
+        if (defines.empty() || code.empty())
+            return;
+        std::string block;
+        for (ShaderDefines::const_iterator it = defines.begin(); it != defines.end(); ++it)
+            block += "#define " + it->first + " " + it->second + "\n";
+
+        size_t version = code.find("#version");
+        size_t insert = 0;
+        int line = 1;
+        if (version != std::string::npos)
+        {
+            size_t end = code.find('\n', version);
+            if (end == std::string::npos)
+            {
+                code += '\n';
+                end = code.size() - 1;
+            }
+            insert = end + 1;
+            for (size_t i = 0; i < insert; i++)
+                if (code[i] == '\n')
+                    line++;
+        }
+        block += "#line " + std::to_string(line) + "\n";
+        code.insert(insert, block);
+    }
+
+    // programs linked so far in this process, keyed by programKey
+    static std::map<uint64_t, unsigned int> &linkedPrograms()
+    {
+        static std::map<uint64_t, unsigned int> programs;
+        return programs;
+    }
+
+    // directory of the program binary cache, GRANULAR_SHADER_CACHE overrides it and an
+    // empty value disables the on-disk cache
+    static std::string cacheDirectory()
+    {
+        const char *env = getenv("GRANULAR_SHADER_CACHE");
+        if (env != nullptr)
+            return env;
+        return FileSystem::getPath("shader_cache");
+    }
+
+    // FNV-1a over the sources and the driver strings, a driver update gives new keys
+    static uint64_t programKey(const std::string &vertexCode, const std::string &fragmentCode, const std::string &geometryCode)
+    {
+        std::string driver;
+        const GLenum names[3] = {GL_VENDOR, GL_RENDERER, GL_VERSION};
+        for (int i = 0; i < 3; i++)
+        {
+            const GLubyte *value = glGetString(names[i]);
+            driver += value ? (const char *)value : "";
+            driver += '\n';
+        }
+        uint64_t hash = 14695981039346656037ULL;
+        const std::string *parts[4] = {&vertexCode, &fragmentCode, &geometryCode, &driver};
+        for (int i = 0; i < 4; i++)
+        {
+            for (unsigned int j = 0; j < parts[i]->size(); j++)
+            {
+                hash ^= (unsigned char)(*parts[i])[j];
+                hash *= 1099511628211ULL;
+            }
+            // separator so moving text between stages changes the key
+            hash ^= 0xff;
+            hash *= 1099511628211ULL;
+        }
+        return hash;
+    }
+
+    static std::string cachePath(uint64_t key)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "/%016llx.bin", (unsigned long long)key);
+        return cacheDirectory() + name;
+    }
+
+    // on-disk layout: magic, binary format, binary length, then the program binary
+    struct CacheHeader {
+        uint32_t magic;
+        uint32_t format;
+        uint32_t length;
+    };
+
+    bool loadCachedProgram(uint64_t key)
+    {
+        std::map<uint64_t, unsigned int>::iterator linked = linkedPrograms().find(key);
+        if (linked != linkedPrograms().end())
+        {
+            ID = linked->second;
+            return true;
+        }
+        GLint formats = 0;
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+        if (formats == 0 || cacheDirectory().empty())
+            return false;
+
+        std::ifstream file(cachePath(key).c_str(), std::ios::binary);
+        if (!file)
+            return false;
+        TraceScope trace("load program binary");
+        CacheHeader header;
+        file.read((char *)&header, sizeof(header));
+        if (!file || header.magic != 0x42505347)
+            return false;
+        std::vector<char> binary(header.length);
+        file.read(binary.data(), header.length);
+        if (!file)
+            return false;
+
+        ID = glCreateProgram();
+        glProgramBinary(ID, header.format, binary.data(), header.length);
+        GLint success = 0;
+        glGetProgramiv(ID, GL_LINK_STATUS, &success);
+        if (!success)
+        {
+            // the driver rejected the binary, fall back to compiling from source
+            glDeleteProgram(ID);
+            ID = 0;
+            return false;
+        }
+        linkedPrograms()[key] = ID;
+        return true;
+    }
+
+    static void storeProgramBinary(uint64_t key, unsigned int program)
+    {
+        GLint formats = 0;
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+        std::string directory = cacheDirectory();
+        if (formats == 0 || directory.empty())
+            return;
+
+        GLint length = 0;
+        glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+        if (length <= 0)
+            return;
+        std::vector<char> binary(length);
+        GLenum format = 0;
+        glGetProgramBinary(program, length, NULL, &format, binary.data());
+
+        mkdir(directory.c_str(), 0755);
+        std::ofstream file(cachePath(key).c_str(), std::ios::binary);
+        if (!file)
+            return;
+        CacheHeader header = {0x42505347, format, (uint32_t)length};
+        file.write((const char *)&header, sizeof(header));
+        file.write(binary.data(), length);
+    }
+
     // utility function for checking shader compilation/linking errors.
     // ------------------------------------------------------------------------
-    void checkCompileErrors(GLuint shader, std::string type)
+    static bool checkCompileErrors(GLuint shader, std::string type)
     {
         GLint success;
         GLchar infoLog[1024];
@@ -186,6 +488,7 @@ private:
                 std::cout << "ERROR::PROGRAM_LINKING_ERROR of type: " << type << "\n" << infoLog << "\n -- --------------------------------------------------- -- " << std::endl;
             }
         }
+        return success;
     }
 };
 #endif
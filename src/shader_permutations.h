@@ -0,0 +1,51 @@
+#ifndef SHADER_PERMUTATIONS_H
+#define SHADER_PERMUTATIONS_H
+
+#include "shader.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+// Compiles variants of one vertex/fragment pair with different preprocessor defines.
+// Variants are built on first use and kept, so switching back to one is free (and with
+// the program binary cache, so is the first use in later runs).
+class ShaderPermutations
+{
+public:
+    ShaderPermutations(const std::string &vertexPath, const std::string &fragmentPath, const ShaderDefines &baseDefines = ShaderDefines())
+        : vertexPath(vertexPath), fragmentPath(fragmentPath), baseDefines(baseDefines) {}
+
+    // the variant for the given defines, which override the base defines of the same name
+    Shader &get(const ShaderDefines &defines)
+    {
+        ShaderDefines merged = baseDefines;
+        for (ShaderDefines::const_iterator it = defines.begin(); it != defines.end(); ++it)
+            merged[it->first] = it->second;
+
+        std::string key;
+        for (ShaderDefines::const_iterator it = merged.begin(); it != merged.end(); ++it)
+            key += it->first + "=" + it->second + ";";
+
+        std::map<std::string, Shader>::iterator variant = variants.find(key);
+        if (variant == variants.end())
+            variant = variants.insert(std::make_pair(key, Shader(vertexPath.c_str(), fragmentPath.c_str(), nullptr, merged))).first;
+        return variant->second;
+    }
+
+    unsigned int count() const { return (unsigned int)variants.size(); }
+
+    // appends every variant compiled so far
+    void collect(std::vector<Shader *> &out)
+    {
+        for (std::map<std::string, Shader>::iterator it = variants.begin(); it != variants.end(); ++it)
+            out.push_back(&it->second);
+    }
+
+private:
+    std::string vertexPath;
+    std::string fragmentPath;
+    ShaderDefines baseDefines;
+    std::map<std::string, Shader> variants;
+};
+#endif
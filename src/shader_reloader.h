@@ -0,0 +1,381 @@
+#ifndef SHADER_RELOADER_H
+#define SHADER_RELOADER_H
+
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+
+#include "shader.h"
+#include "shader_permutations.h"
+#include "trace.h"
+
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+// from KHR_parallel_shader_compile, not part of the GL 4.1 loader
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+typedef void (*PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)(GLuint count);
+
+// Rebuilds watched shaders when their source files change, without stalling the render loop.
+// Programs are compiled on a worker thread with its own (hidden) context sharing objects with
+// the main one. A rebuilt program replaces the old one only once it linked and the GPU has
+// seen it (fence), a program that fails to compile keeps the old one in place.
+// Changes are picked up with inotify on Linux and by polling file times elsewhere.
+class ShaderReloader
+{
+public:
+    ShaderReloader(GLFWwindow *window) : context(nullptr), parallelCompile(false), quit(false), lastPoll(0.0)
+    {
+#ifdef __linux__
+        inotifyFd = inotify_init1(IN_NONBLOCK);
+#endif
+        // the worker context, created here because windows can only be created on the main thread
+        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+        context = glfwCreateWindow(1, 1, "shader compiler", NULL, window);
+        glfwWindowHint(GLFW_VISIBLE, GLFW_TRUE);
+        if (context == nullptr)
+        {
+            std::cout << "ShaderReloader: could not create a shared context, hot reload disabled" << std::endl;
+            return;
+        }
+        PFNGLMAXSHADERCOMPILERTHREADSKHRPROC maxCompilerThreads = nullptr;
+        if (glfwExtensionSupported("GL_KHR_parallel_shader_compile"))
+            maxCompilerThreads = (PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)glfwGetProcAddress("glMaxShaderCompilerThreadsKHR");
+        parallelCompile = maxCompilerThreads != nullptr;
+        worker = std::thread(&ShaderReloader::run, this, maxCompilerThreads);
+    }
+
+    ~ShaderReloader()
+    {
+        stop();
+    }
+
+    void watch(Shader &shader)
+    {
+        shaders.push_back(&shader);
+    }
+
+    // every variant of the set is watched, including the ones compiled later
+    void watch(ShaderPermutations &permutations)
+    {
+        permutationSets.push_back(&permutations);
+    }
+
+    // call once per frame on the main thread: queues rebuilds for changed files and swaps in
+    // the programs that are ready
+    void update()
+    {
+        if (context == nullptr)
+            return;
+        std::vector<Shader *> watched = watchedShaders();
+        std::set<std::string> changed = changedFiles(watched);
+        if (!changed.empty())
+        {
+            // one job per program, shaders built from the same sources share it
+            std::set<unsigned int> queued;
+            std::lock_guard<std::mutex> lock(mutex);
+            for (unsigned int i = 0; i < watched.size(); i++)
+            {
+                Shader *shader = watched[i];
+                if (!usesFile(*shader, changed) || !queued.insert(shader->ID).second)
+                    continue;
+                Job job = {shader, shader->vertexPath, shader->fragmentPath, shader->geometryPath, shader->defines};
+                jobs.push_back(job);
+            }
+            wake.notify_one();
+        }
+        swapFinished(watched);
+    }
+
+    // joins the worker, must be called before the main context goes away
+    void stop()
+    {
+        if (context == nullptr)
+            return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        wake.notify_one();
+        worker.join();
+        for (unsigned int i = 0; i < results.size(); i++)
+        {
+            glDeleteSync(results[i].fence);
+            glDeleteProgram(results[i].program);
+        }
+        results.clear();
+        glfwDestroyWindow(context);
+        context = nullptr;
+#ifdef __linux__
+        if (inotifyFd >= 0)
+            close(inotifyFd);
+        inotifyFd = -1;
+#endif
+    }
+
+private:
+    struct Job {
+        // the shader whose program is replaced, only dereferenced on the main thread
+        Shader *target;
+        std::string vertexPath;
+        std::string fragmentPath;
+        std::string geometryPath;
+        ShaderDefines defines;
+    };
+
+    struct Result {
+        Shader *target;
+        unsigned int program;
+        uint64_t key;
+        GLsync fence;
+    };
+
+    GLFWwindow *context;
+    bool parallelCompile;
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool quit;
+    std::vector<Job> jobs;
+    std::vector<Result> results;
+
+    std::vector<Shader *> shaders;
+    std::vector<ShaderPermutations *> permutationSets;
+    // last seen modification time of every watched file, in nanoseconds
+    std::map<std::string, long long> modified;
+    double lastPoll;
+#ifdef __linux__
+    int inotifyFd;
+    // watched directory of every inotify watch descriptor
+    std::map<int, std::string> directories;
+#endif
+
+    std::vector<Shader *> watchedShaders()
+    {
+        std::vector<Shader *> watched(shaders);
+        for (unsigned int i = 0; i < permutationSets.size(); i++)
+            permutationSets[i]->collect(watched);
+        return watched;
+    }
+
+    static bool usesFile(const Shader &shader, const std::set<std::string> &files)
+    {
+        if (files.count(shader.vertexPath) || files.count(shader.fragmentPath) || (!shader.geometryPath.empty() && files.count(shader.geometryPath)))
+            return true;
+        for (unsigned int i = 0; i < shader.includePaths.size(); i++)
+            if (files.count(shader.includePaths[i]))
+                return true;
+        return false;
+    }
+
+    static long long modificationTime(const std::string &path)
+    {
+        struct stat info;
+        if (stat(path.c_str(), &info) != 0)
+            return 0;
+#ifdef __APPLE__
+        return (long long)info.st_mtimespec.tv_sec * 1000000000LL + info.st_mtimespec.tv_nsec;
+#else
+        return (long long)info.st_mtim.tv_sec * 1000000000LL + info.st_mtim.tv_nsec;
+#endif
+    }
+
+    // watched files whose modification time changed. With inotify the times are only looked
+    // at after an event in one of the shader directories, otherwise they are polled twice a second.
+    std::set<std::string> changedFiles(const std::vector<Shader *> &watched)
+    {
+        std::set<std::string> files;
+        for (unsigned int i = 0; i < watched.size(); i++)
+        {
+            files.insert(watched[i]->vertexPath);
+            files.insert(watched[i]->fragmentPath);
+            if (!watched[i]->geometryPath.empty())
+                files.insert(watched[i]->geometryPath);
+            files.insert(watched[i]->includePaths.begin(), watched[i]->includePaths.end());
+        }
+
+        bool check = false;
+        for (std::set<std::string>::iterator it = files.begin(); it != files.end(); ++it)
+            if (modified.find(*it) == modified.end())
+            {
+                modified[*it] = modificationTime(*it);
+                addDirectoryWatch(*it);
+            }
+#ifdef __linux__
+        if (inotifyFd >= 0)
+        {
+            // editors often save by writing a new file and renaming it over the old one
+            char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+            while (read(inotifyFd, buffer, sizeof(buffer)) > 0)
+                check = true;
+        }
+        else
+#endif
+        {
+            double now = glfwGetTime();
+            check = now - lastPoll >= 0.5;
+            if (check)
+                lastPoll = now;
+        }
+
+        std::set<std::string> changed;
+        if (!check)
+            return changed;
+        for (std::set<std::string>::iterator it = files.begin(); it != files.end(); ++it)
+        {
+            long long time = modificationTime(*it);
+            // a file that is missing for a moment (mid-rename) is picked up once it is back
+            if (time != 0 && time != modified[*it])
+            {
+                modified[*it] = time;
+                changed.insert(*it);
+            }
+        }
+        return changed;
+    }
+
+    void addDirectoryWatch(const std::string &path)
+    {
+#ifdef __linux__
+        if (inotifyFd < 0)
+            return;
+        size_t slash = path.find_last_of('/');
+        std::string directory = slash == std::string::npos ? "." : path.substr(0, slash);
+        for (std::map<int, std::string>::iterator it = directories.begin(); it != directories.end(); ++it)
+            if (it->second == directory)
+                return;
+        int descriptor = inotify_add_watch(inotifyFd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+        if (descriptor >= 0)
+            directories[descriptor] = directory;
+#else
+        (void)path;
+#endif
+    }
+
+    // swaps in the rebuilt programs the GPU has caught up with, never waits for the others
+    void swapFinished(const std::vector<Shader *> &watched)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (unsigned int i = 0; i < results.size();)
+        {
+            Result &result = results[i];
+            GLenum status = glClientWaitSync(result.fence, 0, 0);
+            if (status == GL_TIMEOUT_EXPIRED)
+            {
+                i++;
+                continue;
+            }
+            glDeleteSync(result.fence);
+            unsigned int old = result.target->ID;
+            for (unsigned int j = 0; j < watched.size(); j++)
+                if (watched[j]->ID == old)
+                {
+                    watched[j]->ID = result.program;
+                    watched[j]->samplersConfigured = false;
+                }
+
+            std::map<uint64_t, unsigned int> &linked = Shader::linkedPrograms();
+            for (std::map<uint64_t, unsigned int>::iterator it = linked.begin(); it != linked.end();)
+            {
+                if (it->second == old)
+                    linked.erase(it++);
+                else
+                    ++it;
+            }
+            linked[result.key] = result.program;
+            glDeleteProgram(old);
+            std::cout << "Reloaded shader " << result.target->fragmentPath << std::endl;
+            results.erase(results.begin() + i);
+        }
+    }
+
+    void run(PFNGLMAXSHADERCOMPILERTHREADSKHRPROC maxCompilerThreads)
+    {
+        Trace::setThreadName("shader compiler");
+        glfwMakeContextCurrent(context);
+        if (maxCompilerThreads != nullptr)
+            maxCompilerThreads(0xFFFFFFFF);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true)
+        {
+            wake.wait(lock, [this] { return quit || !jobs.empty(); });
+            if (quit)
+                break;
+            std::vector<Job> batch;
+            batch.swap(jobs);
+            lock.unlock();
+            std::vector<Result> built = build(batch);
+            lock.lock();
+            results.insert(results.end(), built.begin(), built.end());
+        }
+        lock.unlock();
+        glfwMakeContextCurrent(NULL);
+    }
+
+    // compiles a batch on the worker, the whole batch is submitted before any status is
+    // queried so a driver with parallel compilation works on all of it at once
+    std::vector<Result> build(const std::vector<Job> &batch)
+    {
+        TraceScope trace("reload shaders");
+        std::vector<Result> built;
+        std::vector<unsigned int> programs(batch.size(), 0);
+        std::vector<uint64_t> keys(batch.size(), 0);
+        for (unsigned int i = 0; i < batch.size(); i++)
+        {
+            const Job &job = batch[i];
+            std::string vertexCode, fragmentCode, geometryCode;
+            if (!Shader::readSources(job.vertexPath, job.fragmentPath, job.geometryPath, job.defines, vertexCode, fragmentCode, geometryCode))
+                continue;
+            keys[i] = Shader::programKey(vertexCode, fragmentCode, geometryCode);
+            programs[i] = Shader::createProgram(vertexCode, fragmentCode, geometryCode);
+        }
+        for (unsigned int i = 0; i < batch.size(); i++)
+        {
+            if (programs[i] == 0)
+                continue;
+            if (parallelCompile)
+            {
+                GLint done = GL_FALSE;
+                while (!done && !quitting())
+                {
+                    glGetProgramiv(programs[i], GL_COMPLETION_STATUS_KHR, &done);
+                    if (!done)
+                        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+            }
+            if (!Shader::finishProgram(programs[i]))
+            {
+                std::cout << "Keeping the previous program for " << batch[i].fragmentPath << std::endl;
+                glDeleteProgram(programs[i]);
+                continue;
+            }
+            Shader::storeProgramBinary(keys[i], programs[i]);
+            Shader::bindUniformBlocks(programs[i]);
+            Result result = {batch[i].target, programs[i], keys[i], glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0)};
+            built.push_back(result);
+        }
+        // make the programs and fences visible to the main context
+        glFlush();
+        return built;
+    }
+
+    bool quitting()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return quit;
+    }
+};
+#endif
@@ -1,11 +1,39 @@
 #version 410 core
+// OCTAHEDRAL_NORMALS writes the normal octahedral encoded into a two channel target
+// (the compact light maps, decoded by octahedralDecode in model2.fs and model3.fs)
+#ifndef OCTAHEDRAL_NORMALS
+#define OCTAHEDRAL_NORMALS 0
+#endif
 
 // Ouput data
+#if OCTAHEDRAL_NORMALS
+out vec2 FragColor;
+#else
 out vec4 FragColor;
+#endif
 
 in vec3 Fnormal;
 
+// sign() that maps 0 to 1, so normals on the octahedron's edges do not collapse
+vec2 signNotZero(vec2 v)
+{
+    return vec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);
+}
+
+// unit normal to [-1,1]^2 by projecting onto the octahedron and folding the lower half over
+vec2 octahedralEncode(vec3 n)
+{
+    n /= abs(n.x) + abs(n.y) + abs(n.z);
+    if (n.z < 0.0)
+        n.xy = (1.0 - abs(n.yx)) * signNotZero(n.xy);
+    return n.xy;
+}
+
 void main()
 {             
+#if OCTAHEDRAL_NORMALS
+    FragColor = octahedralEncode(normalize(Fnormal));
+#else
     FragColor = vec4((normalize(Fnormal)), 1.0);
-}
\ No newline at end of file
+#endif
+}
@@ -0,0 +1,26 @@
+#version 410 core
+// grows the translucency cache by one texel: texels no triangle covered (alpha 0) take the
+// mean of their covered neighbours, so bilinear lookups at the chart borders stay inside
+// cached values (see translucency_cache.h)
+out vec4 FragColor;
+
+uniform sampler2D cache;
+
+void main()
+{
+    ivec2 texel = ivec2(gl_FragCoord.xy);
+    vec4 centre = texelFetch(cache, texel, 0);
+    if (centre.a > 0.0) {
+        FragColor = centre;
+        return;
+    }
+    ivec2 last = textureSize(cache, 0) - 1;
+    vec4 sum = vec4(0.0);
+    for (int y = -1; y <= 1; y++)
+        for (int x = -1; x <= 1; x++) {
+            vec4 neighbour = texelFetch(cache, clamp(texel + ivec2(x, y), ivec2(0), last), 0);
+            if (neighbour.a > 0.0)
+                sum += vec4(neighbour.rgb, 1.0);
+        }
+    FragColor = sum.a > 0.0 ? vec4(sum.rgb / sum.a, 1.0) : vec4(0.0);
+}
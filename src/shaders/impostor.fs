@@ -0,0 +1,63 @@
+#version 410 core
+// shades a grain impostor from its baked atlases (see grain_impostor.h)
+#ifndef MAX_LIGHTS
+#define MAX_LIGHTS 2
+#endif
+out vec4 FragColor;
+
+in vec2 AtlasCoords;
+in vec3 QuadPos;
+flat in mat3 GrainRotation;
+flat in float GrainScale;
+flat in vec3 ViewDirection;
+
+// grain-space normal, depth towards the viewer in grain radii (above 1 where empty)
+uniform sampler2D impostorGeometry;
+// translucency shader response to a unit light behind the viewer and behind the grain
+uniform sampler2D impostorFront;
+uniform sampler2D impostorBack;
+uniform float impostorRadius;
+
+// per-frame light data, streamed through a uniform buffer (see frame_data.h)
+layout(std140) uniform LightData {
+    mat4 lightSpaceMatrices[MAX_LIGHTS];
+    vec3 lightDirections[MAX_LIGHTS];
+    vec3 lightRadiances[MAX_LIGHTS];
+};
+
+// per-frame camera data, streamed through a uniform buffer (see frame_data.h)
+layout(std140) uniform CameraData {
+    mat4 projection;
+    mat4 view;
+    vec3 eyePos;
+    float nearPlane;
+    vec2 resolution;
+    float farPlane;
+};
+
+void main()
+{
+    vec4 geometry = texture(impostorGeometry, AtlasCoords);
+    if (geometry.a > 1.5)
+        discard;
+
+    // depth of the grain surface instead of the quad, so impostors intersect like geometry
+    vec3 surface = QuadPos + GrainRotation * ViewDirection * geometry.a * impostorRadius * GrainScale;
+    vec4 clip = projection * view * vec4(surface, 1.0);
+    gl_FragDepth = clip.z / clip.w * 0.5 + 0.5;
+
+    vec3 normal = normalize(geometry.xyz);
+    vec3 front = texture(impostorFront, AtlasCoords).rgb;
+    vec3 back = texture(impostorBack, AtlasCoords).rgb;
+    // the front response was lit along the view, relight it by the light's incidence
+    float cos_view = max(dot(normal, ViewDirection), 0.1);
+
+    vec3 resultFcolor = vec3(0.0);
+    for (int i = 0; i < MAX_LIGHTS; i++) {
+        vec3 lightDir = transpose(GrainRotation) * normalize(lightDirections[i]);
+        float facing = min(max(dot(normal, lightDir), 0.0) / cos_view, 4.0);
+        float behind = max(-dot(lightDir, ViewDirection), 0.0);
+        resultFcolor += lightRadiances[i] * (facing * front + behind * back);
+    }
+    FragColor = vec4(resultFcolor, 1.0);
+}
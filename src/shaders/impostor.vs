@@ -0,0 +1,70 @@
+#version 410 core
+// one quad per far grain, facing the impostor view nearest to the direction the grain is
+// seen from (see grain_impostor.h)
+layout (location = 0) in vec2 aCorner;
+// per-instance model matrix (grains are rigid and uniformly scaled)
+layout (location = 7) in mat4 aInstanceModel;
+
+// atlas position of the quad corner
+out vec2 AtlasCoords;
+out vec3 QuadPos;
+// grain space to world without the scale
+flat out mat3 GrainRotation;
+flat out float GrainScale;
+// towards the viewer of the tile, grain space
+flat out vec3 ViewDirection;
+
+uniform int impostorViews;
+uniform float impostorRadius;
+
+// per-frame camera data, streamed through a uniform buffer (see frame_data.h)
+layout(std140) uniform CameraData {
+    mat4 projection;
+    mat4 view;
+    vec3 eyePos;
+    float nearPlane;
+    vec2 resolution;
+    float farPlane;
+};
+
+// sign() that maps 0 to 1, see octahedralEncode in FBOfragmentShader2.fs
+vec2 signNotZero(vec2 v)
+{
+    return vec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);
+}
+
+vec2 octahedralEncode(vec3 n)
+{
+    n /= abs(n.x) + abs(n.y) + abs(n.z);
+    if (n.z < 0.0)
+        n.xy = (1.0 - abs(n.yx)) * signNotZero(n.xy);
+    return n.xy;
+}
+
+vec3 octahedralDecode(vec2 e)
+{
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    if (n.z < 0.0)
+        n.xy = (1.0 - abs(n.yx)) * signNotZero(n.xy);
+    return normalize(n);
+}
+
+void main()
+{
+    vec3 center = aInstanceModel[3].xyz;
+    GrainScale = length(aInstanceModel[0].xyz);
+    GrainRotation = mat3(aInstanceModel) / GrainScale;
+
+    vec3 toEye = transpose(GrainRotation) * normalize(eyePos - center);
+    ivec2 tile = clamp(ivec2((octahedralEncode(toEye) * 0.5 + 0.5) * float(impostorViews)), ivec2(0), ivec2(impostorViews - 1));
+    ViewDirection = octahedralDecode((vec2(tile) + 0.5) / float(impostorViews) * 2.0 - 1.0);
+
+    // the basis glm::lookAt gave the view when baking, see GrainImpostor::viewUp
+    vec3 up = abs(ViewDirection.y) > 0.99 ? vec3(0.0, 0.0, 1.0) : vec3(0.0, 1.0, 0.0);
+    vec3 right = normalize(cross(up, ViewDirection));
+    up = cross(ViewDirection, right);
+
+    AtlasCoords = (vec2(tile) + aCorner * 0.5 + 0.5) / float(impostorViews);
+    QuadPos = center + GrainRotation * (right * aCorner.x + up * aCorner.y) * impostorRadius * GrainScale;
+    gl_Position = projection * view * vec4(QuadPos, 1.0);
+}
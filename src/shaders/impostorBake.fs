@@ -0,0 +1,17 @@
+#version 410 core
+// geometry atlas of the grain impostors (see grain_impostor.h): grain-space normal, and the
+// depth towards the viewer in grain radii
+
+out vec4 FragColor;
+
+in vec3 Fnormal;
+in vec3 FragPos;
+
+// towards the viewer
+uniform vec3 viewDirection;
+uniform float radius;
+
+void main()
+{
+    FragColor = vec4(normalize(Fnormal), dot(FragPos, viewDirection) / radius);
+}
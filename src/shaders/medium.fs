@@ -0,0 +1,124 @@
+#version 410 core
+// homogenised far-field medium of a grain aggregate (see grain_medium.h), ray-marched from
+// the eye to the grain geometry or out of the grid
+#ifndef MAX_LIGHTS
+#define MAX_LIGHTS 2
+#endif
+// steps along the view ray and towards each light
+#ifndef MEDIUM_STEPS
+#define MEDIUM_STEPS 48
+#endif
+#ifndef MEDIUM_LIGHT_STEPS
+#define MEDIUM_LIGHT_STEPS 6
+#endif
+// rgb in-scattered radiance, a transmittance of what is behind
+out vec4 FragColor;
+
+// rgb grain albedo, a packing fraction
+uniform sampler3D mediumVolume;
+// depth of the grains drawn as geometry
+uniform sampler2D sceneDepth;
+uniform vec3 boundsMin;
+uniform vec3 boundsMax;
+uniform float grainRadius;
+// the medium fades in between lodRange.x and lodRange.y from the eye
+uniform vec2 lodRange;
+uniform mat4 inverseViewProjection;
+
+// per-frame light data, streamed through a uniform buffer (see frame_data.h)
+layout(std140) uniform LightData {
+    mat4 lightSpaceMatrices[MAX_LIGHTS];
+    vec3 lightDirections[MAX_LIGHTS];
+    vec3 lightRadiances[MAX_LIGHTS];
+};
+
+// per-frame camera data, streamed through a uniform buffer (see frame_data.h)
+layout(std140) uniform CameraData {
+    mat4 projection;
+    mat4 view;
+    vec3 eyePos;
+    float nearPlane;
+    vec2 resolution;
+    float farPlane;
+};
+
+const float PI = 3.14159265359;
+
+// entry and exit distances of the ray through the grid, entry > exit if it misses
+vec2 intersectBounds(vec3 origin, vec3 direction)
+{
+    vec3 inverse = 1.0 / direction;
+    vec3 t0 = (boundsMin - origin) * inverse;
+    vec3 t1 = (boundsMax - origin) * inverse;
+    vec3 near = min(t0, t1);
+    vec3 far = max(t0, t1);
+    return vec2(max(max(near.x, near.y), near.z), min(min(far.x, far.y), far.z));
+}
+
+vec4 sampleMedium(vec3 position)
+{
+    return texture(mediumVolume, (position - boundsMin) / (boundsMax - boundsMin));
+}
+
+// extinction of grains of grainRadius at packing fraction f: number density times cross section
+float extinction(float packing)
+{
+    return 0.75 * packing / grainRadius;
+}
+
+void main()
+{
+    vec2 ndc = gl_FragCoord.xy / resolution * 2.0 - 1.0;
+    vec4 farPoint = inverseViewProjection * vec4(ndc, 1.0, 1.0);
+    vec3 direction = normalize(farPoint.xyz / farPoint.w - eyePos);
+
+    vec2 span = intersectBounds(eyePos, direction);
+    span.x = max(span.x, 0.0);
+    // stop at the grains drawn as geometry
+    float depth = texelFetch(sceneDepth, ivec2(gl_FragCoord.xy), 0).r;
+    if (depth < 1.0)
+    {
+        vec4 scenePoint = inverseViewProjection * vec4(ndc, depth * 2.0 - 1.0, 1.0);
+        span.y = min(span.y, length(scenePoint.xyz / scenePoint.w - eyePos));
+    }
+    // nothing of the medium is in front of lodRange.x
+    span.x = max(span.x, lodRange.x);
+    if (span.x >= span.y)
+    {
+        FragColor = vec4(0.0, 0.0, 0.0, 1.0);
+        return;
+    }
+
+    float dt = (span.y - span.x) / float(MEDIUM_STEPS);
+    float transmittance = 1.0;
+    vec3 inscattered = vec3(0.0);
+    for (int s = 0; s < MEDIUM_STEPS; s++)
+    {
+        float t = span.x + (float(s) + 0.5) * dt;
+        vec3 position = eyePos + direction * t;
+        vec4 medium = sampleMedium(position);
+        float sigma_t = extinction(medium.a) * smoothstep(lodRange.x, lodRange.y, t);
+        if (sigma_t <= 0.0)
+            continue;
+
+        vec3 light = vec3(0.0);
+        for (int i = 0; i < MAX_LIGHTS; i++)
+        {
+            // near grains shadow the medium as well, so the shadow march uses the full density
+            vec3 toLight = normalize(lightDirections[i]);
+            vec2 lightSpan = intersectBounds(position, toLight);
+            float ds = max(lightSpan.y, 0.0) / float(MEDIUM_LIGHT_STEPS);
+            float opticalDepth = 0.0;
+            for (int k = 0; k < MEDIUM_LIGHT_STEPS; k++)
+                opticalDepth += extinction(sampleMedium(position + toLight * (float(k) + 0.5) * ds).a) * ds;
+            light += lightRadiances[i] * exp(-opticalDepth);
+        }
+        // isotropic phase function
+        float stepTransmittance = exp(-sigma_t * dt);
+        inscattered += transmittance * medium.rgb * light / (4.0 * PI) * (1.0 - stepTransmittance);
+        transmittance *= stepTransmittance;
+        if (transmittance < 0.01)
+            break;
+    }
+    FragColor = vec4(inscattered, transmittance);
+}
@@ -1,5 +1,12 @@
 #version 410 core
+// compile-time options, the application injects its own values after the #version line
+// (see ShaderPermutations), the defaults below apply when the shader is built without them
+#ifndef MAX_LIGHTS
 #define MAX_LIGHTS 2
+#endif
+#ifndef ENABLE_SINGLE_SCATTERING
+#define ENABLE_SINGLE_SCATTERING 1
+#endif
 out vec4 FragColor;
 
 in vec2 TexCoords;
@@ -9,15 +16,26 @@ in vec3 FragPos;
 // uniform sampler2D depthMap;
 uniform sampler2D normalMap;
 uniform sampler2D vertexMap;
-uniform mat4 lightSpaceMatrices[MAX_LIGHTS];
+// per-frame light data, streamed through a uniform buffer (see frame_data.h)
+layout(std140) uniform LightData {
+    mat4 lightSpaceMatrices[MAX_LIGHTS];
+    vec3 lightDirections[MAX_LIGHTS];
+    vec3 lightRadiances[MAX_LIGHTS];
+};
 
 // lights
-uniform int numLights;
-uniform vec3 lightDirections[MAX_LIGHTS];
-uniform vec3 lightRadiances[MAX_LIGHTS];
-
-// camera position
-uniform vec3 eyePos;
+// the light count is baked in so the light loop can be unrolled
+const int numLights = MAX_LIGHTS;
+
+// per-frame camera data, streamed through a uniform buffer (see frame_data.h)
+layout(std140) uniform CameraData {
+    mat4 projection;
+    mat4 view;
+    vec3 eyePos;
+    float nearPlane;
+    vec2 resolution;
+    float farPlane;
+};
 
 //PI constant
 const float PI = 3.14159265359;
@@ -29,10 +47,6 @@ uniform float g = 0.0;
 uniform float n_material = 1.0;
 uniform float roughness = 0.00;
 
-// plane near and far
-uniform float nearPlane;
-uniform float farPlane;
-
 
 uniform vec3 reflectance = vec3(0.5);
 
@@ -301,7 +315,11 @@ void main()
             // full Fresnel term
             float Fresnel = Ft_1 * Ft_2;
 
+#if ENABLE_SINGLE_SCATTERING
         vec3 single_scattering = SingleScattering(material.albedo, Fresnel, Fnormal, wi, wo) * max(cos_incident,0.0);
+#else
+        vec3 single_scattering = vec3(0.0);
+#endif
 
         // Full BSSRDF approximation with BRDF
         vec3 BSSRDF = (single_scattering + Fresnel*DiffuseReflectance/PI);
@@ -1,26 +1,102 @@
 #version 410 core
+// compile-time options, the application injects its own values after the #version line
+// (see ShaderPermutations), the defaults below apply when the shader is built without them
+#ifndef MAX_LIGHTS
 #define MAX_LIGHTS 2
+#endif
+#ifndef ENABLE_SINGLE_SCATTERING
+#define ENABLE_SINGLE_SCATTERING 1
+#endif
+#ifndef ENABLE_DIPOLE
+#define ENABLE_DIPOLE 1
+#endif
+// COMPACT_LIGHT_MAPS reads octahedral normals (RG16_SNORM) and rebuilds the light-facing
+// positions from the light's depth map instead of reading an RGB32F position map
+#ifndef COMPACT_LIGHT_MAPS
+#define COMPACT_LIGHT_MAPS 0
+#endif
+// THICKNESS_MAP reads the thickness towards each light and the cosine where it enters from
+// the grain's baked thickness map instead of the light maps
+#ifndef THICKNESS_MAP
+#define THICKNESS_MAP 0
+#endif
 out vec4 FragColor;
 
 in vec2 TexCoords;
 in vec3 Fnormal;
 in vec3 FragPos;
+#if THICKNESS_MAP
+in vec2 ThicknessSH[9];
+flat in mat3 ToGrain;
+#include "sh_basis.glsl"
+
+// distance from the fragment towards the world direction w to where it leaves the grain, in
+// model units, and the cosine between w and the surface normal there (see grain_thickness.h)
+vec2 thicknessTowards(vec3 w)
+{
+    float basis[9];
+    shBasis(normalize(ToGrain * w), basis);
+    vec2 thickness = vec2(0.0);
+    for (int k = 0; k < 9; k++)
+        thickness += ThicknessSH[k] * basis[k];
+    return thickness;
+}
+#endif
 
 
 
 // texture sampler array for number of lights
 uniform sampler2D normalTextures[MAX_LIGHTS]; 
+#if COMPACT_LIGHT_MAPS
+uniform sampler2D depthTextures[MAX_LIGHTS];
+#else
 uniform sampler2D vertexTextures[MAX_LIGHTS]; 
+#endif
 
-uniform mat4 lightSpaceMatrices[MAX_LIGHTS];
+// per-frame light data, streamed through a uniform buffer (see frame_data.h)
+layout(std140) uniform LightData {
+    mat4 lightSpaceMatrices[MAX_LIGHTS];
+    vec3 lightDirections[MAX_LIGHTS];
+    vec3 lightRadiances[MAX_LIGHTS];
+};
 
 // lights
-uniform int numLights;
-uniform vec3 lightDirections[MAX_LIGHTS];
-uniform vec3 lightRadiances[MAX_LIGHTS];
+// the light count is baked in so the light loop can be unrolled
+const int numLights = MAX_LIGHTS;
+
+// per-frame camera data, streamed through a uniform buffer (see frame_data.h)
+layout(std140) uniform CameraData {
+    mat4 projection;
+    mat4 view;
+    vec3 eyePos;
+    float nearPlane;
+    vec2 resolution;
+    float farPlane;
+};
+
+#if COMPACT_LIGHT_MAPS
+// sign() that maps 0 to 1, see octahedralEncode in FBOfragmentShader2.fs
+vec2 signNotZero(vec2 v)
+{
+    return vec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);
+}
 
-// camera position
-uniform vec3 eyePos;
+vec3 octahedralDecode(vec2 e)
+{
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    if (n.z < 0.0)
+        n.xy = (1.0 - abs(n.yx)) * signNotZero(n.xy);
+    return normalize(n);
+}
+
+// world position of the light-map texel at uv with the given depth,
+// lightToWorld is the inverse of the light's lightSpaceMatrix
+vec3 lightMapPosition(mat4 lightToWorld, vec2 uv, float depth)
+{
+    vec4 position = lightToWorld * vec4(uv * 2.0 - 1.0, depth * 2.0 - 1.0, 1.0);
+    return position.xyz / position.w;
+}
+#endif
 
 //PI constant
 const float PI = 3.14159265359;
@@ -33,13 +109,6 @@ uniform float n_material = 1.0;
 uniform float roughness = 0.00;
 uniform float thickness_scale = 3.0;
 
-// plane near and far
-uniform float nearPlane;
-uniform float farPlane;
-
-// Screen resolution
-uniform vec2 resolution;
-
 
 uniform vec3 reflectance = vec3(0.5);
 
@@ -253,7 +322,7 @@ void main()
     // Vec3 for the final color
     vec3 resultFcolor = vec3(0.0);
  
-    for (int i = 0; i < (numLights-1); i++) {
+    for (int i = 0; i < numLights; i++) {
 
         // calculating thickness of the material
             vec4 fragPosLightSpace = lightSpaceMatrices[i] * vec4(FragPos, 1.0);
@@ -302,11 +371,24 @@ void main()
 
 
         vec2 pixel = vec2 (1.0 / resolution.x, 1.0 / resolution.y);
+#if THICKNESS_MAP
+        vec2 entry = thicknessTowards(wi);
+        float thickness = max(entry.x, 0.0) * thickness_scale;
+        float cos_incident = clamp(entry.y, 0.0, 1.0);
+#else
+#if COMPACT_LIGHT_MAPS
+        vec3 frontPos = lightMapPosition(inverse(lightSpaceMatrices[i]), projCoords.xy, texture(depthTextures[i], projCoords.xy).r);
+
+        vec3 incidentNormal = octahedralDecode(texture(normalTextures[i], projCoords.xy).xy);
+#else
         vec3 frontPos = texture(vertexTextures[i], projCoords.xy).xyz;
 
         vec3 incidentNormal = texture(normalTextures[i], projCoords.xy).xyz;
+#endif
 
         float thickness = length((FragPos - frontPos)*thickness_scale);
+        float cos_incident = dot(incidentNormal, wi);
+#endif
         // thickness = 2.4*thickness_scale + thickness/2.0;
         float r = 2.4 * thickness_scale;
         //distance to centroid of a hemisphere of the incident area
@@ -315,7 +397,6 @@ void main()
             thickness = thickness/2.0 + 3.0*r/8.0;
         }
     
-            float cos_incident = dot(incidentNormal, wi);
 
             // find Fresnel term for in-scattering n1 to n2
             float sin_incident = sqrt(1.0 - cos_incident * cos_incident);
@@ -336,16 +417,20 @@ void main()
             float Fresnel = Ft_1 * Ft_2;
 
             // ORIGINAL
+#if ENABLE_DIPOLE
             if (dot (Fnormal, wi) <= 0.0)
             {
-                Lo += 1.0/PI * BSSRDF_distance(thickness, material.albedo_prime, material.sigma_a, material.sigma_t_prime, g, A(material.n)) * Fresnel * dot(incidentNormal, wi);
+                Lo += 1.0/PI * BSSRDF_distance(thickness, material.albedo_prime, material.sigma_a, material.sigma_t_prime, g, A(material.n)) * Fresnel * cos_incident;
             }
+#endif
 
         vec3 single_scattering = vec3(0.0);
         vec3 model_1 = vec3(0.0);
         if (dot(Fnormal, wi) >= 0.0)
         {
+#if ENABLE_SINGLE_SCATTERING
             single_scattering = SingleScattering(material.albedo, Fresnel, Fnormal, wi, wo) * max(dot(Fnormal, wi), 0.0);
+#endif
             model_1 = (Fresnel*DiffuseReflectance/PI+ single_scattering) * max(dot(Fnormal, wi), 0.02) ;
         }
         
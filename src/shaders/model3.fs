@@ -1,26 +1,275 @@
 #version 410 core
+// compile-time options, the application injects its own values after the #version line
+// (see ShaderPermutations), the defaults below apply when the shader is built without them
+#ifndef MAX_LIGHTS
 #define MAX_LIGHTS 2
+#endif
+// distance in texels between gathered light-map samples
+#ifndef SAMPLE_STEP
+#define SAMPLE_STEP 35
+#endif
+#ifndef ENABLE_SINGLE_SCATTERING
+#define ENABLE_SINGLE_SCATTERING 1
+#endif
+#ifndef ENABLE_DIPOLE
+#define ENABLE_DIPOLE 1
+#endif
+// COMPACT_LIGHT_MAPS reads octahedral normals (RG16_SNORM) and rebuilds the light-facing
+// positions from the light's depth map instead of reading an RGB32F position map
+#ifndef COMPACT_LIGHT_MAPS
+#define COMPACT_LIGHT_MAPS 0
+#endif
+// LIGHT_CASCADES > 1 gathers from the light map of the fragment's cascade (see
+// light_cascades.h), cascades always use the compact layout
+#ifndef LIGHT_CASCADES
+#define LIGHT_CASCADES 1
+#endif
+// LIGHT_LIST reads any number of lights from a buffer texture and only loops over the
+// lights binned into the fragment's screen tile (see light_list.h), it replaces the
+// MAX_LIGHTS arrays and cascades and uses the compact layout
+#ifndef LIGHT_LIST
+#define LIGHT_LIST 0
+#endif
+// vec4s per light in the light list, set from LIGHT_TEXELS of light_list.h
+#ifndef LIGHT_TEXELS
+#define LIGHT_TEXELS 6
+#endif
+#if LIGHT_LIST
+#undef LIGHT_CASCADES
+#define LIGHT_CASCADES 1
+#endif
+#if LIGHT_CASCADES > 1 || LIGHT_LIST
+#undef COMPACT_LIGHT_MAPS
+#define COMPACT_LIGHT_MAPS 1
+#endif
+#ifndef ENABLE_SPECULAR
+#define ENABLE_SPECULAR 1
+#endif
+// ENVIRONMENT_SH adds the diffuse reflection and dipole transmission of an environment map
+// projected onto order 2 spherical harmonics (see sh_lighting.h), constant cost per fragment
+#ifndef ENVIRONMENT_SH
+#define ENVIRONMENT_SH 0
+#endif
+// PRT_TRANSFER replaces the light-map gather with the grain's precomputed transfer, evaluated
+// per vertex by the vertex shader for the LightData lights (see grain_transfer.h)
+#ifndef PRT_TRANSFER
+#define PRT_TRANSFER 0
+#endif
+// THICKNESS_MAP replaces the light-map gather with one dipole and single-scattering sample at
+// the point the grain's baked thickness map gives towards each light (see grain_thickness.h)
+#ifndef THICKNESS_MAP
+#define THICKNESS_MAP 0
+#endif
+// POINT_CLOUD replaces the light-map gather with a walk over the hierarchical irradiance point
+// cloud of the scene, which holds the lights' irradiance already (see irradiance_cloud.h)
+#ifndef POINT_CLOUD
+#define POINT_CLOUD 0
+#endif
+// SUBSURFACE_LOW_RES draws only the subsurface term of the lights, and the geometry it was
+// gathered for, into a buffer of half the view's width and height; SUBSURFACE_UPSAMPLE skips
+// the gather in the full-size view pass and takes the term from that buffer with a
+// joint-bilateral filter (see half_res_translucency.h); light-map gather only
+#ifndef SUBSURFACE_LOW_RES
+#define SUBSURFACE_LOW_RES 0
+#endif
+#ifndef SUBSURFACE_UPSAMPLE
+#define SUBSURFACE_UPSAMPLE 0
+#endif
+#if SUBSURFACE_LOW_RES || SUBSURFACE_UPSAMPLE
+#undef PRT_TRANSFER
+#define PRT_TRANSFER 0
+#undef THICKNESS_MAP
+#define THICKNESS_MAP 0
+#undef POINT_CLOUD
+#define POINT_CLOUD 0
+#undef TRANSLUCENCY_CACHE
+#define TRANSLUCENCY_CACHE 0
+#undef TRANSLUCENCY_CACHE_BAKE
+#define TRANSLUCENCY_CACHE_BAKE 0
+#endif
+#if SUBSURFACE_LOW_RES
+#undef ENABLE_SPECULAR
+#define ENABLE_SPECULAR 0
+#undef ENVIRONMENT_SH
+#define ENVIRONMENT_SH 0
+#endif
+// TRANSLUCENCY_CACHE_BAKE renders the view-independent subsurface term of the lights into the
+// translucency cache atlas, TRANSLUCENCY_CACHE reads it back in place of the gather and only
+// adds the exit Fresnel term and the specular (see translucency_cache.h)
+#ifndef TRANSLUCENCY_CACHE
+#define TRANSLUCENCY_CACHE 0
+#endif
+#ifndef TRANSLUCENCY_CACHE_BAKE
+#define TRANSLUCENCY_CACHE_BAKE 0
+#endif
+#if TRANSLUCENCY_CACHE || TRANSLUCENCY_CACHE_BAKE
+// the atlas mesh has its own vertex order, the per-vertex modes cannot be used with it
+#undef PRT_TRANSFER
+#define PRT_TRANSFER 0
+#undef THICKNESS_MAP
+#define THICKNESS_MAP 0
+#undef POINT_CLOUD
+#define POINT_CLOUD 0
+#endif
+#if TRANSLUCENCY_CACHE_BAKE
+#undef ENABLE_SPECULAR
+#define ENABLE_SPECULAR 0
+#undef ENVIRONMENT_SH
+#define ENVIRONMENT_SH 0
+#endif
+#if TRANSLUCENCY_CACHE_BAKE && (LIGHT_LIST || LIGHT_CASCADES > 1)
+// the bake's gl_FragCoord is in the atlas and it has no camera distance, so it finds neither
+// the light list's screen tile nor a cascade (main.cpp and the bench refuse the combination)
+#error TRANSLUCENCY_CACHE_BAKE reads the per-light maps, not the light list or cascades
+#endif
+// the light-map gather runs unless another mode supplies the subsurface term of the lights
+#if (ENABLE_DIPOLE || ENABLE_SINGLE_SCATTERING) && !PRT_TRANSFER && !POINT_CLOUD && !TRANSLUCENCY_CACHE && !SUBSURFACE_UPSAMPLE
+#define SUBSURFACE_GATHER 1
+#else
+#define SUBSURFACE_GATHER 0
+#endif
+// TEMPORAL_REUSE takes the subsurface term of fragments whose reprojection into the previous
+// frame finds the same surface from that frame instead of gathering it again, apart from a
+// rotating share refreshed every frame (see temporal_translucency.h); light-map gather only
+#ifndef TEMPORAL_REUSE
+#define TEMPORAL_REUSE 0
+#endif
+#if !SUBSURFACE_GATHER || THICKNESS_MAP || TRANSLUCENCY_CACHE_BAKE || SUBSURFACE_LOW_RES
+#undef TEMPORAL_REUSE
+#define TEMPORAL_REUSE 0
+#endif
+// LOD_FADE dithers the grains out between lodRange.x and lodRange.y from the eye, where the
+// homogenised medium of grain_medium.h takes over
+#ifndef LOD_FADE
+#define LOD_FADE 0
+#endif
+// GATHER_GRID samples the light map on a regular grid, GATHER_JITTERED offsets the grid
+// randomly per fragment (same cost, trades the grid pattern for noise at large steps),
+// GATHER_ADAPTIVE samples a grid of twice the step and refines it where it varies
+#define GATHER_GRID 0
+#define GATHER_JITTERED 1
+#define GATHER_ADAPTIVE 2
+#ifndef GATHER_MODE
+#define GATHER_MODE GATHER_GRID
+#endif
+// rows of coarse samples GATHER_ADAPTIVE keeps per column, larger light maps widen the step
+#ifndef GATHER_MAX_ROWS
+#define GATHER_MAX_ROWS 32
+#endif
 out vec4 FragColor;
+#if TEMPORAL_REUSE
+// this frame's subsurface term (alpha 1 where written) and geometry (normal, view depth),
+// the history of the next frame
+layout(location = 1) out vec4 Translucency;
+layout(location = 2) out vec4 Geometry;
+#endif
+#if SUBSURFACE_LOW_RES
+// normal and view depth of the gathered fragment, FragColor holds the subsurface term
+layout(location = 1) out vec4 Geometry;
+#endif
 
 in vec2 TexCoords;
 in vec3 Fnormal;
 in vec3 FragPos;
+#if PRT_TRANSFER
+in vec3 Transferred;
+#endif
+// the thickness map and the environment both evaluate SH, included outside their #ifs as
+// the include is resolved before the preprocessor runs
+#include "sh_basis.glsl"
+#if THICKNESS_MAP
+in vec2 ThicknessSH[9];
+flat in mat3 ToGrain;
+
+// distance from the fragment towards the world direction w to where it leaves the grain, in
+// model units, and the cosine between w and the surface normal there (see grain_thickness.h)
+vec2 thicknessTowards(vec3 w)
+{
+    float basis[9];
+    shBasis(normalize(ToGrain * w), basis);
+    vec2 thickness = vec2(0.0);
+    for (int k = 0; k < 9; k++)
+        thickness += ThicknessSH[k] * basis[k];
+    return thickness;
+}
+#endif
 
 
 
 // texture sampler array for number of lights
 uniform sampler2D normalTextures[MAX_LIGHTS]; 
+#if COMPACT_LIGHT_MAPS
+uniform sampler2D depthTextures[MAX_LIGHTS];
+#else
 uniform sampler2D vertexTextures[MAX_LIGHTS]; 
+#endif
+
+// per-frame light data, streamed through a uniform buffer (see frame_data.h)
+layout(std140) uniform LightData {
+    mat4 lightSpaceMatrices[MAX_LIGHTS];
+    vec3 lightDirections[MAX_LIGHTS];
+    vec3 lightRadiances[MAX_LIGHTS];
+};
 
-uniform mat4 lightSpaceMatrices[MAX_LIGHTS];
+#if LIGHT_CASCADES > 1 || LIGHT_LIST
+// compact light maps of the cascades or the light list (see light_map_array.h)
+uniform sampler2DArray lightNormalMaps;
+uniform sampler2DArray lightDepthMaps;
+#endif
+
+#if LIGHT_LIST
+// LIGHT_TEXELS vec4s per light: lightSpaceMatrix columns, direction and map layer, radiance
+uniform samplerBuffer lightList;
+// tile size and tiles per row, an (offset, count) pair per tile, then the light indices
+uniform isamplerBuffer lightTiles;
+#endif
+
+#if LIGHT_CASCADES > 1
+// layer light * LIGHT_CASCADES + cascade
+layout(std140) uniform CascadeData {
+    mat4 cascadeMatrices[MAX_LIGHTS * LIGHT_CASCADES];
+    // x is the view distance where the cascade ends
+    vec4 cascadeSplits[LIGHT_CASCADES];
+};
+#endif
 
 // lights
-uniform int numLights;
-uniform vec3 lightDirections[MAX_LIGHTS];
-uniform vec3 lightRadiances[MAX_LIGHTS];
+// the light count is baked in so the light loop can be unrolled
+const int numLights = MAX_LIGHTS;
+
+// per-frame camera data, streamed through a uniform buffer (see frame_data.h)
+layout(std140) uniform CameraData {
+    mat4 projection;
+    mat4 view;
+    vec3 eyePos;
+    float nearPlane;
+    vec2 resolution;
+    float farPlane;
+};
+
+#if COMPACT_LIGHT_MAPS
+// sign() that maps 0 to 1, see octahedralEncode in FBOfragmentShader2.fs
+vec2 signNotZero(vec2 v)
+{
+    return vec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);
+}
+
+vec3 octahedralDecode(vec2 e)
+{
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    if (n.z < 0.0)
+        n.xy = (1.0 - abs(n.yx)) * signNotZero(n.xy);
+    return normalize(n);
+}
 
-// camera position
-uniform vec3 eyePos;
+// world position of the light-map texel at uv with the given depth,
+// lightToWorld is the inverse of the light's lightSpaceMatrix
+vec3 lightMapPosition(mat4 lightToWorld, vec2 uv, float depth)
+{
+    vec4 position = lightToWorld * vec4(uv * 2.0 - 1.0, depth * 2.0 - 1.0, 1.0);
+    return position.xyz / position.w;
+}
+#endif
 
 //PI constant
 const float PI = 3.14159265359;
@@ -34,18 +283,64 @@ uniform float roughness = 0.03;
 
 uniform float thickness_scale = 4.0;
 
-// plane near and far
-uniform float nearPlane;
-uniform float farPlane;
-
-// Screen resolution
-uniform vec2 resolution;
+#if LOD_FADE
+uniform vec2 lodRange;
+#endif
+
+#if TRANSLUCENCY_CACHE
+// subsurface radiance of the lights before the exit Fresnel term, in the atlas TexCoords
+uniform sampler2D translucencyCache;
+#endif
+
+#if TEMPORAL_REUSE
+// the previous frame's targets and camera
+uniform sampler2D historyTranslucency;
+uniform sampler2D historyGeometry;
+uniform mat4 previousView;
+uniform mat4 previousProjection;
+uniform bool historyValid;
+// pixels are gathered again when their slot comes round, one slot of refreshPeriod per frame
+uniform int refreshPeriod;
+uniform int refreshFrame;
+uniform float depthTolerance;
+uniform float normalTolerance;
+#endif
+
+#if SUBSURFACE_UPSAMPLE
+// the SUBSURFACE_LOW_RES pass's targets
+uniform sampler2D lowResSubsurface;
+uniform sampler2D lowResGeometry;
+uniform float upsampleDepthSigma;
+uniform float upsampleNormalPower;
+#endif
+
+#if GATHER_MODE == GATHER_ADAPTIVE
+// relative difference of neighbouring coarse samples above which a cell is refined
+uniform float gatherThreshold = 0.25;
+// most cells a fragment refines, over all its lights
+uniform int gatherBudget = 16;
+#endif
+
+#if POINT_CLOUD
+// two vec4s per node, centre and radius, power and the index after its subtree
+uniform samplerBuffer cloudNodes;
+uniform int cloudNodeCount;
+// largest radius / distance of a node evaluated as one source
+uniform float cloudError;
+#endif
+
+#if ENVIRONMENT_SH
+// irradiance of the environment, evaluate with irradianceAt
+uniform vec3 shIrradiance[9];
+// distance through a grain, in model units, for the environment transmission (its mean chord)
+uniform float grainThickness = 1.0;
+#endif
 
 
 uniform vec3 reflectance = vec3(0.5);
 
 
-int sample_step = 35;
+const int sample_step = SAMPLE_STEP;
 
 // Material properties
 struct MaterialProperties {
@@ -209,6 +504,53 @@ vec3 SingleScattering2(vec3 wi, vec3 wo, vec3 Fnormal, float Fresnel, vec3 sigma
     return scattering;
 }
 
+// Fresnel transmittance out of the grain towards wo at a surface with normal n
+float exitTransmittance(vec3 n, vec3 wo, float eta)
+{
+    float cos_out = dot(n, wo);
+    float sin_out = sqrt(max(1.0 - cos_out * cos_out, 0.0));
+    float sin_inside = sin_out / eta;
+    float cos_inside = sqrt(1.0 - sin_inside * sin_inside);
+    return 1.0 - FresnelReflection(eta, 1.0, max(cos_out, 0.0), max(cos_inside, 0.0));
+}
+
+#if SUBSURFACE_UPSAMPLE
+// subsurface term of the fragment with the given normal and view depth from the four
+// low-resolution texels around it, weighted bilinearly and by how closely their geometry
+// matches; the texel of the nearest depth if none matches
+vec3 upsampleSubsurface(vec3 normal, float depth)
+{
+    ivec2 size = textureSize(lowResSubsurface, 0);
+    vec2 position = gl_FragCoord.xy / resolution * vec2(size) - 0.5;
+    vec2 base = floor(position);
+    vec2 f = position - base;
+    vec3 sum = vec3(0.0);
+    float weights = 0.0;
+    vec3 nearest = vec3(0.0);
+    float nearestDifference = 1e30;
+    for (int y = 0; y < 2; y++) {
+        for (int x = 0; x < 2; x++) {
+            ivec2 texel = clamp(ivec2(base) + ivec2(x, y), ivec2(0), size - 1);
+            vec4 value = texelFetch(lowResSubsurface, texel, 0);
+            if (value.a == 0.0)
+                continue;
+            vec4 geometry = texelFetch(lowResGeometry, texel, 0);
+            float difference = abs(geometry.w - depth) / depth;
+            float bilinear = (x == 0 ? 1.0 - f.x : f.x) * (y == 0 ? 1.0 - f.y : f.y);
+            float similarity = exp(-0.5 * difference * difference / (upsampleDepthSigma * upsampleDepthSigma))
+                             * pow(max(dot(geometry.xyz, normal), 0.0), upsampleNormalPower);
+            sum += value.rgb * bilinear * similarity;
+            weights += bilinear * similarity;
+            if (difference < nearestDifference) {
+                nearestDifference = difference;
+                nearest = value.rgb;
+            }
+        }
+    }
+    return weights > 1e-4 ? sum / weights : nearest;
+}
+#endif
+
 float LinearizeDepth(float depth, float nearPlane, float farPlane) {
     float z = depth * 2.0 - 1.0; // Transform depth to NDC [-1, 1]
     return (2.0 * nearPlane * farPlane) / (farPlane + nearPlane - z * (farPlane - nearPlane));
@@ -247,6 +589,127 @@ vec3 BSSRDF_distance_old(vec3 r, vec3 albedo_prime, vec3 sigma_a, vec3 sigma_t_p
     return albedo_prime / (4.0 * PI) * (real_source + virt_source);
 }
 
+#if ENVIRONMENT_SH
+// irradiance arriving at a surface facing n
+vec3 irradianceAt(vec3 n)
+{
+    float basis[9];
+    shBasis(n, basis);
+    vec3 irradiance = vec3(0.0);
+    for (int k = 0; k < 9; k++)
+        irradiance += shIrradiance[k] * basis[k];
+    return irradiance;
+}
+#endif
+
+#if GATHER_MODE == GATHER_JITTERED
+// per-fragment offset in [0, 1) for the jittered gather
+float gatherHash(vec2 p)
+{
+    return fract(sin(dot(p, vec2(12.9898, 78.233))) * 43758.5453);
+}
+#endif
+
+#if SUBSURFACE_GATHER && !THICKNESS_MAP
+// one sample of the gather: the light entering at point of light's map (layer of the map
+// arrays) and leaving at the fragment; count is 1, 0 for an empty texel or one facing away
+// from the light, and -1 for the fragment's own point, which the average leaves out
+vec3 gatherSample(int light, float layer, mat4 lightToWorld, vec2 point, vec3 wi, vec3 wo, vec3 Fnormal, MaterialProperties material, vec3 sigma_s, out int count)
+{
+    count = 0;
+    // get a normal of the incident point
+#if COMPACT_LIGHT_MAPS
+#if LIGHT_CASCADES > 1 || LIGHT_LIST
+    float lightDepth = texture(lightDepthMaps, vec3(point, layer)).r;
+#else
+    float lightDepth = texture(depthTextures[light], point).r;
+#endif
+    // check if empty (cleared to the far plane)
+    if (lightDepth >= 1.0) {
+        return vec3(0.0);
+    }
+    vec3 frontPos = lightMapPosition(lightToWorld, point, lightDepth);
+#if LIGHT_CASCADES > 1 || LIGHT_LIST
+    vec3 incidentNormal = octahedralDecode(texture(lightNormalMaps, vec3(point, layer)).xy);
+#else
+    vec3 incidentNormal = octahedralDecode(texture(normalTextures[light], point).xy);
+#endif
+#else
+    vec3 frontPos = texture(vertexTextures[light], point).xyz;
+    vec3 incidentNormal = texture(normalTextures[light], point).xyz;
+    // check if empty
+    if (length(incidentNormal) == 0.0) {
+        return vec3(0.0);
+    }
+#endif
+    // float thickness_old = length(FragPos - frontPos);
+    vec3 thickness = (FragPos - frontPos) * thickness_scale;
+    // normalize the normal
+    incidentNormal = normalize(incidentNormal);
+    
+    // find cos_incident
+    float cos_incident = dot(incidentNormal, wi);
+    if (cos_incident <= 0.0) {
+        return vec3(0.0);
+    }
+
+    // the same point as the current point
+    if (dot(Fnormal, incidentNormal) > 0.999) {
+        count = -1;
+        return vec3(0.0);
+    }
+
+    count = 1;
+    vec3 Lo = vec3(0.0);
+
+    // find Fresnel term for in-scattering n1 to n2
+    float sin_incident = sqrt(1.0 - cos_incident * cos_incident);
+    float sin_refracted = sin_incident / material.n;
+    float cos_refracted = sqrt(1.0 - sin_refracted * sin_refracted);
+    float Fr_1 = FresnelReflection(1.0, material.n, max(cos_refracted,0.0), max(cos_incident, 0.0));
+    float Ft_1 = 1.0 - Fr_1;
+
+    // find Fresnel term for out-scattering n2 to n1
+    float cos_refracted_2 = dot(Fnormal, wo);
+    float sin_refracted_2 = sqrt(1.0 - cos_refracted_2 * cos_refracted_2);
+    float sin_incident_2 = sin_refracted_2 / material.n;
+    float cos_incident_2 = sqrt(1.0 - sin_incident_2 * sin_incident_2);
+    float Fr_2 = FresnelReflection(material.n, 1.0, max(cos_refracted_2,0.0), max(cos_incident_2, 0.0));
+    float Ft_2 = 1.0 - Fr_2;
+#if TRANSLUCENCY_CACHE_BAKE
+    // applied when the cache is read
+    Ft_2 = 1.0;
+#endif
+    
+    // full Fresnel term
+    float Fresnel = Ft_1 * Ft_2;
+
+    // ORIGINAL
+#if ENABLE_DIPOLE
+    Lo += 1.0/PI * BSSRDF_distance(thickness, material.albedo_prime, material.sigma_a, material.sigma_t_prime, g, A(material.n)) * Fresnel * dot(incidentNormal, wi);
+#endif
+
+#if ENABLE_SINGLE_SCATTERING
+    vec3 singlescattering_res = vec3(0.0);
+
+            //conditions to address the issue of  single scattering spots
+            singlescattering_res = SingleScattering2(wi, wo, Fnormal, Fresnel, (sigma_a + sigma_s), thickness, material.albedo,material.g)*dot(incidentNormal, wi);
+
+    Lo += singlescattering_res;
+#endif
+    return Lo;
+}
+#endif
+
+#if SUBSURFACE_GATHER && !THICKNESS_MAP && GATHER_MODE == GATHER_ADAPTIVE
+// true if two coarse samples disagree in finding a sample at all, or in value by more than
+// threshold relative to their mean
+bool gatherDiffers(vec3 a, int countA, vec3 b, int countB, float threshold)
+{
+    return (countA > 0) != (countB > 0) || length(a - b) > threshold * 0.5 * (length(a) + length(b));
+}
+#endif
+
 // Pseudo random number generator. 
 // float hash( vec2 a )
 // {
@@ -269,6 +732,18 @@ vec3 BSSRDF_distance_old(vec3 r, vec3 albedo_prime, vec3 sigma_a, vec3 sigma_t_p
 // }
 void main()
 {   
+#if GATHER_MODE == GATHER_ADAPTIVE
+    // refine more readily where the normal turns quickly across the screen (edges, small
+    // grains), taken before any discard so the derivative is defined
+    float refineThreshold = gatherThreshold / (1.0 + 4.0 * length(fwidth(Fnormal)));
+    int refinedCells = 0;
+#endif
+#if LOD_FADE
+    // screen-door fade, the fragments left are shaded in full
+    float lodFade = smoothstep(lodRange.x, lodRange.y, length(FragPos - eyePos));
+    if (fract(sin(dot(gl_FragCoord.xy, vec2(12.9898, 78.233))) * 43758.5453) < lodFade)
+        discard;
+#endif
     vec3 sigma_s = sigma_s_prime / (1.0 - g);
     vec3 Fnormal = normalize(Fnormal);
     // Creating a material instance with the predefined properties
@@ -294,13 +769,76 @@ void main()
     // Vec3 for the final color
     vec3 resultFcolor = vec3(0.0);
 
-    vec2 pixel = vec2 (1.0 / resolution.x, 1.0 / resolution.y);
+#if TEMPORAL_REUSE
+    // subsurface term of the lights, kept apart from the specular for the next frame
+    vec3 subsurface = vec3(0.0);
+    bool reuse = false;
+    {
+        ivec2 pixel = ivec2(gl_FragCoord.xy);
+        bool refresh = (pixel.x + 3 * pixel.y) % refreshPeriod == refreshFrame;
+        vec4 previous = previousProjection * previousView * vec4(FragPos, 1.0);
+        vec2 uv = previous.xy / previous.w * 0.5 + 0.5;
+        if (historyValid && !refresh && previous.w > 0.0 && all(greaterThanEqual(uv, vec2(0.0))) && all(lessThanEqual(uv, vec2(1.0)))) {
+            vec4 history = texture(historyTranslucency, uv);
+            vec4 geometry = texture(historyGeometry, uv);
+            float depth = -(previousView * vec4(FragPos, 1.0)).z;
+            // the same surface if it was drawn there at the same depth facing the same way
+            if (history.a > 0.0 && abs(geometry.w - depth) < depthTolerance * depth && dot(geometry.xyz, Fnormal) > normalTolerance) {
+                subsurface = history.rgb;
+                reuse = true;
+            }
+        }
+    }
+#endif
 
  
-    for (int i = 0; i < (numLights-1); i++) {
+#if LIGHT_CASCADES > 1
+    float viewDistance = -(view * vec4(FragPos, 1.0)).z;
+    int cascade = LIGHT_CASCADES - 1;
+    for (int c = LIGHT_CASCADES - 2; c >= 0; c--) {
+        if (viewDistance < cascadeSplits[c].x)
+            cascade = c;
+    }
+#endif
+
+#if LIGHT_LIST
+    int tileSize = texelFetch(lightTiles, 0).r;
+    ivec2 tile = ivec2(gl_FragCoord.xy) / tileSize;
+    int tileEntry = 2 + 2 * (tile.y * texelFetch(lightTiles, 1).r + tile.x);
+    int tileOffset = texelFetch(lightTiles, tileEntry).r;
+    int tileCount = texelFetch(lightTiles, tileEntry + 1).r;
+    for (int t = 0; t < tileCount; t++) {
+        int i = texelFetch(lightTiles, tileOffset + t).r;
+        int texel = i * LIGHT_TEXELS;
+        mat4 lightSpaceMatrix = mat4(texelFetch(lightList, texel), texelFetch(lightList, texel + 1),
+                                     texelFetch(lightList, texel + 2), texelFetch(lightList, texel + 3));
+        vec4 lightDirectionLayer = texelFetch(lightList, texel + 4);
+        vec3 lightDirection = lightDirectionLayer.xyz;
+        vec3 lightRadiance = texelFetch(lightList, texel + 5).rgb;
+        float layer = lightDirectionLayer.w;
+        ivec2 lightMapSize = textureSize(lightNormalMaps, 0).xy;
+        // outside the light's box, i.e. the region it reaches
+        vec3 lightSpace = (lightSpaceMatrix * vec4(FragPos, 1.0)).xyz;
+        if (any(greaterThan(abs(lightSpace.xy), vec2(1.0))))
+            continue;
+#else
+    for (int i = 0; i < numLights; i++) {
+        vec3 lightDirection = lightDirections[i];
+        vec3 lightRadiance = lightRadiances[i];
+#endif
+
+#if LIGHT_CASCADES > 1
+        int layer = i * LIGHT_CASCADES + cascade;
+        mat4 lightSpaceMatrix = cascadeMatrices[layer];
+        ivec2 lightMapSize = textureSize(lightNormalMaps, 0).xy;
+#elif !LIGHT_LIST
+        mat4 lightSpaceMatrix = lightSpaceMatrices[i];
+        // the light maps are sized independently of the screen, gather over the light's own map
+        ivec2 lightMapSize = textureSize(normalTextures[i], 0);
+#endif
 
         // calculating thickness of the material
-            vec4 fragPosLightSpace = lightSpaceMatrices[i] * vec4(FragPos, 1.0);
+            vec4 fragPosLightSpace = lightSpaceMatrix * vec4(FragPos, 1.0);
             vec3 projCoords = fragPosLightSpace.xyz; /*/ fragPosLightSpace.w; //if perspective division is needed*/
             projCoords = projCoords * 0.5 + 0.5; 
 
@@ -335,12 +873,16 @@ void main()
                 sample_end_y = 0;
             }
 
-        vec3 lightDir = normalize(lightDirections[i]);
-        vec3 lightRadiance = lightRadiances[i];
+        vec3 lightDir = normalize(lightDirection);
 
         // Defining wi and wo
         vec3 wi = normalize(lightDir);
+#if TRANSLUCENCY_CACHE_BAKE
+        // the cache is view independent, the single-scattering lobe is taken along the normal
+        vec3 wo = Fnormal;
+#else
         vec3 wo = normalize( eyePos - FragPos);
+#endif
         // incident angle
         float cos_incident = dot(Fnormal, wi);
 
@@ -349,80 +891,137 @@ void main()
         int numSamples = 0;
         vec3 Lo = vec3(0.0);
 
-        for (int j = 0; j < resolution.x; j+=sample_step) {
-            for (int k = 0; k < resolution.y; k+=sample_step) {
-
-            vec2 point =  vec2(j, k) * pixel;
-
-            //clamp the point
-            point = clamp(point, 0.0, 1.0);
-
-            // get a normal of the incident point
-            vec3 frontPos = texture(vertexTextures[i], point).xyz;
-            // float thickness_old = length(FragPos - frontPos);
-            vec3 thickness = (FragPos - frontPos) * thickness_scale;
-            
-            vec3 incidentNormal = texture(normalTextures[i], point).xyz;
-            // check if empty
-            if (length(incidentNormal) == 0.0) {
-                continue;
-            }
-            // normalize the normal
-            incidentNormal = normalize(incidentNormal);
-            
-            // find cos_incident
-            cos_incident = dot(incidentNormal, wi);
-            if (cos_incident <= 0.0) {
-                continue;
-            }
-
-            // continue if it is the same point as the current point
-            if (dot(Fnormal, incidentNormal) > 0.999) {
-                numSamples -= 1;
-                continue;
-            }
-
-            numSamples += 1;
-
-            // find Fresnel term for in-scattering n1 to n2
-            float sin_incident = sqrt(1.0 - cos_incident * cos_incident);
-            float sin_refracted = sin_incident / material.n;
+#if COMPACT_LIGHT_MAPS
+        mat4 lightToWorld = inverse(lightSpaceMatrix);
+#else
+        mat4 lightToWorld = mat4(1.0);
+#endif
+#if LIGHT_CASCADES > 1 || LIGHT_LIST
+        float gatherLayer = float(layer);
+#else
+        float gatherLayer = 0.0;
+#endif
+
+        vec2 pixel = 1.0 / vec2(lightMapSize);
+#if GATHER_MODE == GATHER_JITTERED
+        vec2 jitter = vec2(gatherHash(gl_FragCoord.xy), gatherHash(gl_FragCoord.yx + 17.0)) * float(sample_step) * pixel;
+#endif
+#if TEMPORAL_REUSE
+        // the reused term already holds this light, the gather below runs no samples
+        if (reuse)
+            lightMapSize = ivec2(0);
+#endif
+
+#if SUBSURFACE_GATHER && THICKNESS_MAP
+        {
+            // the gather's samples lie on a disc of radius r around the entry point, take
+            // their rms distance to the fragment
+            vec2 entry = thicknessTowards(wi);
+            float depth = max(entry.x, 0.0) * thickness_scale;
+            float cos_entry = clamp(entry.y, 0.0, 1.0);
+            float r = 2.4 * thickness_scale;
+            vec3 thickness = wi * sqrt(depth * depth + 0.5 * r * r);
+
+            float sin_entry = sqrt(1.0 - cos_entry * cos_entry);
+            float sin_refracted = sin_entry / material.n;
             float cos_refracted = sqrt(1.0 - sin_refracted * sin_refracted);
-            float Fr_1 = FresnelReflection(1.0, material.n, max(cos_refracted,0.0), max(cos_incident, 0.0));
-            float Ft_1 = 1.0 - Fr_1;
-
-            // find Fresnel term for out-scattering n2 to n1
+            float Ft_1 = 1.0 - FresnelReflection(1.0, material.n, max(cos_refracted, 0.0), cos_entry);
             float cos_refracted_2 = dot(Fnormal, wo);
-            float sin_refracted_2 = sqrt(1.0 - cos_refracted_2 * cos_refracted_2);
+            float sin_refracted_2 = sqrt(max(1.0 - cos_refracted_2 * cos_refracted_2, 0.0));
             float sin_incident_2 = sin_refracted_2 / material.n;
             float cos_incident_2 = sqrt(1.0 - sin_incident_2 * sin_incident_2);
-            float Fr_2 = FresnelReflection(material.n, 1.0, max(cos_refracted_2,0.0), max(cos_incident_2, 0.0));
-            float Ft_2 = 1.0 - Fr_2;
-            
-            // full Fresnel term
+            float Ft_2 = 1.0 - FresnelReflection(material.n, 1.0, max(cos_refracted_2, 0.0), max(cos_incident_2, 0.0));
             float Fresnel = Ft_1 * Ft_2;
+#if ENABLE_DIPOLE
+            Lo += 1.0/PI * BSSRDF_distance(thickness, material.albedo_prime, material.sigma_a, material.sigma_t_prime, g, A(material.n)) * Fresnel * cos_entry;
+#endif
+#if ENABLE_SINGLE_SCATTERING
+            Lo += SingleScattering2(wi, wo, Fnormal, Fresnel, (sigma_a + sigma_s), thickness, material.albedo, material.g) * cos_entry;
+#endif
+            Lo *= PI * (r * r);
+        }
+#elif SUBSURFACE_GATHER && GATHER_MODE == GATHER_ADAPTIVE
+        {
+            // coarse cells of twice the fine step, each standing for the four fine samples in it;
+            // a cell whose sample disagrees with one of its four neighbours' (in value or in
+            // finding a sample at all) takes its three other fine samples instead, while the
+            // fragment's budget lasts, so both cells of a disagreeing pair are refined. Three
+            // columns of coarse samples are kept, each is taken once.
+            int fine = max(sample_step, (lightMapSize.y + 2 * GATHER_MAX_ROWS - 1) / (2 * GATHER_MAX_ROWS));
+            int coarse = 2 * fine;
+            int rows = (lightMapSize.y + coarse - 1) / coarse;
+            int columns = (lightMapSize.x + coarse - 1) / coarse;
+            vec3 coarseValues[3 * GATHER_MAX_ROWS];
+            int coarseCounts[3 * GATHER_MAX_ROWS];
+            for (int c = 0; c <= columns; c++) {
+                if (c < columns) {
+                    for (int r = 0; r < rows; r++) {
+                        int slot = (c % 3) * GATHER_MAX_ROWS + r;
+                        vec2 point = clamp(vec2(c, r) * float(coarse) * pixel, 0.0, 1.0);
+                        coarseValues[slot] = gatherSample(i, gatherLayer, lightToWorld, point, wi, wo, Fnormal, material, sigma_s, coarseCounts[slot]);
+                    }
+                }
+                // the cells of the column before, whose neighbours are all taken now
+                int j = c - 1;
+                for (int r = 0; j >= 0 && r < rows; r++) {
+                    int slot = (j % 3) * GATHER_MAX_ROWS + r;
+                    vec3 value = coarseValues[slot];
+                    int count = coarseCounts[slot];
+                    int left = ((j + 2) % 3) * GATHER_MAX_ROWS + r;
+                    int right = (c % 3) * GATHER_MAX_ROWS + r;
+                    bool differs = (r > 0 && gatherDiffers(value, count, coarseValues[slot - 1], coarseCounts[slot - 1], refineThreshold)) ||
+                                   (r + 1 < rows && gatherDiffers(value, count, coarseValues[slot + 1], coarseCounts[slot + 1], refineThreshold)) ||
+                                   (j > 0 && gatherDiffers(value, count, coarseValues[left], coarseCounts[left], refineThreshold)) ||
+                                   (c < columns && gatherDiffers(value, count, coarseValues[right], coarseCounts[right], refineThreshold));
+                    if (differs && refinedCells < gatherBudget) {
+                        refinedCells++;
+                        Lo += value;
+                        numSamples += count;
+                        for (int f = 1; f < 4; f++) {
+                            vec2 point = clamp((vec2(j, r) * float(coarse) + vec2(f & 1, f >> 1) * float(fine)) * pixel, 0.0, 1.0);
+                            int fineCount;
+                            Lo += gatherSample(i, gatherLayer, lightToWorld, point, wi, wo, Fnormal, material, sigma_s, fineCount);
+                            numSamples += fineCount;
+                        }
+                    }
+                    else {
+                        Lo += 4.0 * value;
+                        numSamples += 4 * count;
+                    }
+                }
+            }
+        }
+#elif SUBSURFACE_GATHER
+        for (int j = 0; j < lightMapSize.x; j+=sample_step) {
+            for (int k = 0; k < lightMapSize.y; k+=sample_step) {
 
-            // ORIGINAL
-            Lo += 1.0/PI * BSSRDF_distance(thickness, material.albedo_prime, material.sigma_a, material.sigma_t_prime, g, A(material.n)) * Fresnel * dot(incidentNormal, wi);
-
-            vec3 singlescattering_res = vec3(0.0);
-
-                    //conditions to address the issue of  single scattering spots
-                    singlescattering_res = SingleScattering2(wi, wo, Fnormal, Fresnel, (sigma_a + sigma_s), thickness, material.albedo,material.g)*dot(incidentNormal, wi);
-
-            Lo += singlescattering_res;
+            vec2 point =  vec2(j, k) * pixel;
+#if GATHER_MODE == GATHER_JITTERED
+            point += jitter;
+#endif
 
+            //clamp the point
+            point = clamp(point, 0.0, 1.0);
 
+            int count;
+            Lo += gatherSample(i, gatherLayer, lightToWorld, point, wi, wo, Fnormal, material, sigma_s, count);
+            numSamples += count;
             }
 
     }
+#endif
+#if SUBSURFACE_GATHER && !THICKNESS_MAP
+            // average of the grid, jittered or adaptive samples over the gathered area
             if (numSamples != 0) {
                 float r = 2.4 * thickness_scale;
                 Lo = Lo / numSamples * PI * (r*r);
                 // Lo = vec3(numSamples);
             }
+#endif
 
          
+            float BRDF = 0.0;
+#if ENABLE_SPECULAR
         // find Fresnel term for in-scattering n1 to n2
             cos_incident = dot(Fnormal, wi);
             float sin_incident = sqrt(1.0 - cos_incident * cos_incident);
@@ -441,11 +1040,11 @@ void main()
 
             float numerator = D * G * Fr_1;
             float denominator = 4.0 * abs(dot(Fnormal, wo))*abs(dot(Fnormal, wi));
-            float BRDF = 0.0;
             // Avoid division by zero
             if(denominator != 0.0) {
                 BRDF = numerator / denominator * max(cos_incident,0.0);
             }
+#endif
         
         // resultFcolor += (Fresnel*DiffuseReflectance/PI) * Li;
         // resultFcolor = vec3(single_scattering);
@@ -461,7 +1060,12 @@ void main()
 
         // resultFcolor += (Lo);
         // resultFcolor += Lo;
+#if TEMPORAL_REUSE
+        subsurface += Lo*lightRadiance;
+        resultFcolor += BRDF*lightRadiance;
+#else
         resultFcolor += (BRDF+Lo)*lightRadiance;
+#endif
         // resultFcolor += vec3(dot(Fnormal, wi));
         // resultFcolor = vec3(rand_num_x,rand_num_y,0.0);
 
@@ -469,5 +1073,74 @@ void main()
 
         // resultFcolor = vec3(thickness);
     }
+
+#if PRT_TRANSFER
+    {
+        // the subsurface part of every light comes from the transfer, only the exit Fresnel
+        // term depends on the view
+        resultFcolor += exitTransmittance(Fnormal, normalize(eyePos - FragPos), material.n) * Transferred;
+    }
+#endif
+
+#if TRANSLUCENCY_CACHE
+    resultFcolor += exitTransmittance(Fnormal, normalize(eyePos - FragPos), material.n) * texture(translucencyCache, TexCoords).rgb;
+#endif
+
+#if POINT_CLOUD && ENABLE_DIPOLE
+    {
+        // radiant exitance from the dipole of every source (Jensen and Buhler 2002), the
+        // single-scattering term has no hierarchical form and is left out
+        vec3 exitance = vec3(0.0);
+        int node = 0;
+        while (node < cloudNodeCount) {
+            vec4 centreRadius = texelFetch(cloudNodes, node * 2);
+            vec4 powerSkip = texelFetch(cloudNodes, node * 2 + 1);
+            int skip = int(powerSkip.w);
+            float separation = length(FragPos - centreRadius.xyz);
+            if (skip == node + 1 || centreRadius.w < cloudError * separation) {
+                exitance += BSSRDF_distance((FragPos - centreRadius.xyz) * thickness_scale, material.albedo_prime, material.sigma_a, material.sigma_t_prime, g, A(material.n)) * powerSkip.rgb * (thickness_scale * thickness_scale);
+                node = skip;
+            }
+            else
+                node++;
+        }
+        resultFcolor += exitTransmittance(Fnormal, normalize(eyePos - FragPos), material.n) / PI * exitance;
+    }
+#endif
+
+#if ENVIRONMENT_SH
+    {
+        // the environment is too wide for the point-light gather: light entering around the
+        // fragment gives the diffuse reflectance, light entering on the far side of the grain
+        // reaches it through the dipole at the grain's thickness, spread over the same
+        // disc as the gather
+        vec3 wo = normalize(eyePos - FragPos);
+        float cos_out = dot(Fnormal, wo);
+        float sin_out = sqrt(max(1.0 - cos_out * cos_out, 0.0));
+        float sin_inside = sin_out / material.n;
+        float cos_inside = sqrt(1.0 - sin_inside * sin_inside);
+        float Ft_out = 1.0 - FresnelReflection(material.n, 1.0, max(cos_out, 0.0), max(cos_inside, 0.0));
+        // diffuse Fresnel transmittance into the grain
+        float Fdr = - 1.440 / (material.n * material.n) + 0.710 / material.n + 0.668 + 0.0636 * material.n;
+        float Ft_in = 1.0 - Fdr;
+
+        vec3 front = max(irradianceAt(Fnormal), vec3(0.0));
+        vec3 back = max(irradianceAt(-Fnormal), vec3(0.0));
+        float r = 2.4 * thickness_scale;
+        vec3 transmission = BSSRDF_distance(vec3(grainThickness * thickness_scale), material.albedo_prime, material.sigma_a, material.sigma_t_prime, g, A(material.n)) * (r * r);
+        resultFcolor += Ft_out * Ft_in * (DiffuseReflectance / PI * front + transmission * back);
+    }
+#endif
+#if SUBSURFACE_UPSAMPLE
+    resultFcolor += upsampleSubsurface(Fnormal, -(view * vec4(FragPos, 1.0)).z);
+#endif
+#if SUBSURFACE_LOW_RES
+    Geometry = vec4(Fnormal, -(view * vec4(FragPos, 1.0)).z);
+#endif
+#if TEMPORAL_REUSE
+    resultFcolor += subsurface;
+    Translucency = vec4(subsurface, 1.0);
+    Geometry = vec4(Fnormal, -(view * vec4(FragPos, 1.0)).z);
+#endif
     FragColor = vec4(resultFcolor, 1.0);
 }
@@ -0,0 +1,15 @@
+// order 2 real spherical harmonics, pulled in with #include "sh_basis.glsl"
+
+// the nine basis functions at the unit direction d, in the order of shBasis in sh_lighting.h
+void shBasis(vec3 d, out float basis[9])
+{
+    basis[0] = 0.282095;
+    basis[1] = 0.488603 * d.y;
+    basis[2] = 0.488603 * d.z;
+    basis[3] = 0.488603 * d.x;
+    basis[4] = 1.092548 * d.x * d.y;
+    basis[5] = 1.092548 * d.y * d.z;
+    basis[6] = 0.315392 * (3.0 * d.z * d.z - 1.0);
+    basis[7] = 1.092548 * d.x * d.z;
+    basis[8] = 0.546274 * (d.x * d.x - d.y * d.y);
+}
@@ -0,0 +1,21 @@
+#version 410 core
+layout (location = 0) in vec3 aPos;
+layout (location = 1) in vec3 aNormal;
+layout (location = 2) in vec2 aTexCoords;
+// per-instance model matrix (grains are rigid and uniformly scaled, so it also transforms normals)
+layout (location = 7) in mat4 aInstanceModel;
+
+out vec2 TexCoords;
+out vec3 Fnormal;
+out vec3 FragPos;
+
+uniform mat4 model;
+uniform mat4 lightSpaceMatrix;
+
+void main()
+{
+    mat4 instanceModel = model * aInstanceModel;
+    Fnormal = normalize(mat3(instanceModel) * aNormal);
+    FragPos = vec3(instanceModel * vec4(aPos, 1.0));
+    gl_Position = lightSpaceMatrix * instanceModel * vec4(aPos, 1.0);
+}
@@ -0,0 +1,99 @@
+#version 410 core
+// PRT_TRANSFER evaluates the precomputed subsurface transfer of the grain per vertex
+#ifndef PRT_TRANSFER
+#define PRT_TRANSFER 0
+#endif
+#if PRT_TRANSFER
+#ifndef MAX_LIGHTS
+#define MAX_LIGHTS 2
+#endif
+// per-vertex SH transfer of the grain shape, nine texels per vertex (see grain_transfer.h)
+uniform samplerBuffer transfer;
+uniform int transferBase;
+
+// per-frame light data, streamed through a uniform buffer (see frame_data.h)
+layout(std140) uniform LightData {
+    mat4 lightSpaceMatrices[MAX_LIGHTS];
+    vec3 lightDirections[MAX_LIGHTS];
+    vec3 lightRadiances[MAX_LIGHTS];
+};
+
+// subsurface radiance of the lights before the exit Fresnel term
+out vec3 Transferred;
+
+#include "sh_basis.glsl"
+
+// transfer of this vertex towards the unit direction w (grain space)
+vec3 transferTowards(vec3 w)
+{
+    int at = (gl_VertexID - transferBase) * 9;
+    float basis[9];
+    shBasis(w, basis);
+    vec3 transferred = vec3(0.0);
+    for (int k = 0; k < 9; k++)
+        transferred += texelFetch(transfer, at + k).rgb * basis[k];
+    return transferred;
+}
+#endif
+// THICKNESS_MAP passes the grain's baked thickness coefficients on to the fragment shader
+#ifndef THICKNESS_MAP
+#define THICKNESS_MAP 0
+#endif
+#if THICKNESS_MAP
+// nine (distance, cosine) SH coefficients per vertex (see grain_thickness.h)
+uniform samplerBuffer thicknessMap;
+uniform int thicknessBase;
+
+out vec2 ThicknessSH[9];
+// world to grain space for directions
+flat out mat3 ToGrain;
+#endif
+// TRANSLUCENCY_CACHE_BAKE places the triangles at their TexCoords in the translucency cache
+// atlas instead of on screen (see translucency_cache.h)
+#ifndef TRANSLUCENCY_CACHE_BAKE
+#define TRANSLUCENCY_CACHE_BAKE 0
+#endif
+layout (location = 0) in vec3 aPos;
+layout (location = 1) in vec3 aNormal;
+layout (location = 2) in vec2 aTexCoords;
+// per-instance model matrix (grains are rigid and uniformly scaled, so it also transforms normals)
+layout (location = 7) in mat4 aInstanceModel;
+
+out vec2 TexCoords;
+out vec3 Fnormal;
+out vec3 FragPos;
+
+uniform mat4 model;
+// per-frame camera data, streamed through a uniform buffer (see frame_data.h)
+layout(std140) uniform CameraData {
+    mat4 projection;
+    mat4 view;
+    vec3 eyePos;
+    float nearPlane;
+    vec2 resolution;
+    float farPlane;
+};
+
+void main()
+{
+    mat4 instanceModel = model * aInstanceModel;
+    TexCoords = aTexCoords;  
+    Fnormal = mat3(instanceModel) * aNormal; 
+    gl_Position = projection * view * instanceModel * vec4(aPos, 1.0);
+    FragPos = vec3(instanceModel * vec4(aPos, 1.0));
+#if PRT_TRANSFER
+    // lights into grain space, the grain is rigid and uniformly scaled
+    mat3 toGrain = transpose(mat3(instanceModel)) / dot(instanceModel[0].xyz, instanceModel[0].xyz);
+    Transferred = vec3(0.0);
+    for (int i = 0; i < MAX_LIGHTS; i++)
+        Transferred += lightRadiances[i] * max(transferTowards(normalize(toGrain * lightDirections[i])), vec3(0.0));
+#endif
+#if THICKNESS_MAP
+    for (int k = 0; k < 9; k++)
+        ThicknessSH[k] = texelFetch(thicknessMap, (gl_VertexID - thicknessBase) * 9 + k).rg;
+    ToGrain = transpose(mat3(instanceModel)) / dot(instanceModel[0].xyz, instanceModel[0].xyz);
+#endif
+#if TRANSLUCENCY_CACHE_BAKE
+    gl_Position = vec4(aTexCoords * 2.0 - 1.0, 0.0, 1.0);
+#endif
+}
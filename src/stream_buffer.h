@@ -0,0 +1,156 @@
+#ifndef STREAM_BUFFER_H
+#define STREAM_BUFFER_H
+
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+
+#include <cstring>
+#include <iostream>
+
+// number of frames the CPU may write ahead of the GPU
+#define STREAM_FRAMES 3
+
+// from ARB_buffer_storage (core in 4.4), not part of the GL 4.1 loader
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#define GL_MAP_COHERENT_BIT 0x0080
+#define GL_DYNAMIC_STORAGE_BIT 0x0100
+typedef void (*PFNGLBUFFERSTORAGEPROC)(GLenum target, GLsizeiptr size, const void *data, GLbitfield flags);
+
+// a piece of the ring written this frame
+struct StreamRange {
+    GLuint buffer;
+    GLintptr offset;
+    GLsizeiptr size;
+};
+
+// Ring buffer for data rewritten every frame (uniform blocks, streamed vertex data). It holds
+// STREAM_FRAMES regions; each frame writes into the next region after waiting on the fence
+// of the frame that last used it, which is normally long signaled. With ARB_buffer_storage
+// the buffer is mapped once, persistent and coherent, and writes go straight to it. Without
+// it every write maps its range with GL_MAP_UNSYNCHRONIZED_BIT, which is safe for the same
+// reason, so the driver never has to copy or wait either way.
+class StreamBuffer
+{
+public:
+    StreamBuffer(GLsizeiptr bytesPerFrame) : bytesPerFrame(bytesPerFrame), buffer(0), mapped(nullptr), frame(0), used(0), overflowReported(false)
+    {
+        GLint alignment = 256;
+        glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+        this->alignment = alignment;
+        for (unsigned int i = 0; i < STREAM_FRAMES; i++)
+            fences[i] = 0;
+
+        glGenBuffers(1, &buffer);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+        PFNGLBUFFERSTORAGEPROC bufferStorage = nullptr;
+        if (glfwExtensionSupported("GL_ARB_buffer_storage"))
+            bufferStorage = (PFNGLBUFFERSTORAGEPROC)glfwGetProcAddress("glBufferStorage");
+        if (bufferStorage)
+        {
+            GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            bufferStorage(GL_COPY_WRITE_BUFFER, bytesPerFrame * STREAM_FRAMES, NULL, flags);
+            mapped = (char *)glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, bytesPerFrame * STREAM_FRAMES, flags);
+        }
+        else
+            glBufferData(GL_COPY_WRITE_BUFFER, bytesPerFrame * STREAM_FRAMES, NULL, GL_STREAM_DRAW);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    }
+
+    ~StreamBuffer()
+    {
+        cleanup();
+    }
+
+    bool persistent() const { return mapped != nullptr; }
+
+    // moves to the next region, call once per frame before the first write
+    void beginFrame()
+    {
+        frame = (frame + 1) % STREAM_FRAMES;
+        used = 0;
+        if (fences[frame])
+        {
+            // only blocks if the GPU is more than STREAM_FRAMES - 1 frames behind
+            glClientWaitSync(fences[frame], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+            glDeleteSync(fences[frame]);
+            fences[frame] = 0;
+        }
+    }
+
+    // fences the region of this frame, call after its last draw
+    void endFrame()
+    {
+        fences[frame] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+
+    // copies size bytes into this frame's region, aligned for glBindBufferRange
+    StreamRange write(const void *data, GLsizeiptr size)
+    {
+        GLintptr start = (used + alignment - 1) / alignment * alignment;
+        if (start + size > bytesPerFrame)
+        {
+            if (!overflowReported)
+                std::cout << "StreamBuffer: more than " << bytesPerFrame << " bytes written in one frame" << std::endl;
+            overflowReported = true;
+            StreamRange empty = {buffer, 0, 0};
+            return empty;
+        }
+        used = start + size;
+        StreamRange range = {buffer, frame * bytesPerFrame + start, size};
+        if (mapped)
+            memcpy(mapped + range.offset, data, size);
+        else
+        {
+            glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+            void *target = glMapBufferRange(GL_COPY_WRITE_BUFFER, range.offset, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+            if (target)
+            {
+                memcpy(target, data, size);
+                glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+            }
+            glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+        }
+        return range;
+    }
+
+    // writes a uniform block and binds it to the binding point
+    void bindUniforms(GLuint binding, const void *data, GLsizeiptr size)
+    {
+        StreamRange range = write(data, size);
+        if (range.size > 0)
+            glBindBufferRange(GL_UNIFORM_BUFFER, binding, range.buffer, range.offset, range.size);
+    }
+
+    // must be called while the context is still alive
+    void cleanup()
+    {
+        for (unsigned int i = 0; i < STREAM_FRAMES; i++)
+            if (fences[i])
+                glDeleteSync(fences[i]);
+        if (buffer != 0)
+        {
+            if (mapped)
+            {
+                glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+                glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+                glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+            }
+            glDeleteBuffers(1, &buffer);
+        }
+        buffer = 0;
+        mapped = nullptr;
+        for (unsigned int i = 0; i < STREAM_FRAMES; i++)
+            fences[i] = 0;
+    }
+
+private:
+    GLsizeiptr bytesPerFrame;
+    GLintptr alignment;
+    GLuint buffer;
+    char *mapped;
+    GLsync fences[STREAM_FRAMES];
+    unsigned int frame;
+    GLintptr used;
+    bool overflowReported;
+};
+#endif
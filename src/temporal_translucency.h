@@ -0,0 +1,173 @@
+#ifndef TEMPORAL_TRANSLUCENCY_H
+#define TEMPORAL_TRANSLUCENCY_H
+
+#include <glad/glad.h>
+
+#include <glm/glm.hpp>
+
+#include "shader.h"
+#include "translucency_cache.h"
+
+#include <iostream>
+
+// texture units of the previous frame's subsurface term and geometry, after the cache's unit
+#define TEMPORAL_TRANSLUCENCY_UNIT (TRANSLUCENCY_CACHE_UNIT + 1)
+#define TEMPORAL_GEOMETRY_UNIT (TRANSLUCENCY_CACHE_UNIT + 2)
+
+// Temporal reuse of the subsurface term between frames. The view pass renders into one of
+// two framebuffers with three targets: the shaded colour, the subsurface term of the lights
+// and the geometry it was gathered for (normal and view depth). The TEMPORAL_REUSE variant of
+// model3 reprojects each fragment into the other framebuffer with last frame's view and
+// projection and reuses the subsurface term found there when the depth and normal agree, so
+// only disoccluded fragments and a rotating 1/refreshPeriod share of the screen run the
+// gather; the share keeps view-dependent terms and light changes from lagging more than
+// refreshPeriod frames. end() copies the colour to the target and swaps the framebuffers.
+class TemporalTranslucency
+{
+public:
+    // every pixel is gathered again at least once per this many frames
+    int refreshPeriod;
+    // largest relative view-depth difference and smallest normal cosine of a reused sample
+    float depthTolerance;
+    float normalTolerance;
+
+    TemporalTranslucency() : refreshPeriod(8), depthTolerance(0.02f), normalTolerance(0.9f),
+                             width(0), height(0), current(0), frameIndex(0), historyValid(false),
+                             previousView(1.0f), previousProjection(1.0f)
+    {
+        for (int i = 0; i < 2; i++)
+        {
+            framebuffers[i] = depthBuffers[i] = 0;
+            for (int k = 0; k < 3; k++)
+                textures[i][k] = 0;
+        }
+    }
+
+    ~TemporalTranslucency()
+    {
+        cleanup();
+    }
+
+    // call when the lights, the geometry or the shading options change, the next frame
+    // gathers every pixel
+    void invalidate() { historyValid = false; }
+
+    // binds this frame's framebuffer (width x height, recreated on resize) and clears it, and
+    // sets the history inputs of shader, the TEMPORAL_REUSE variant of model3
+    void begin(Shader &shader, unsigned int width, unsigned int height)
+    {
+        if (width != this->width || height != this->height)
+            resize(width, height);
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffers[current]);
+        const GLenum all[3] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2};
+        glDrawBuffers(3, all);
+        // alpha 0 marks the subsurface texels no fragment wrote
+        glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+
+        shader.use();
+        glActiveTexture(GL_TEXTURE0 + TEMPORAL_TRANSLUCENCY_UNIT);
+        glBindTexture(GL_TEXTURE_2D, textures[1 - current][1]);
+        glActiveTexture(GL_TEXTURE0 + TEMPORAL_GEOMETRY_UNIT);
+        glBindTexture(GL_TEXTURE_2D, textures[1 - current][2]);
+        glActiveTexture(GL_TEXTURE0);
+        shader.setInt("historyTranslucency", TEMPORAL_TRANSLUCENCY_UNIT);
+        shader.setInt("historyGeometry", TEMPORAL_GEOMETRY_UNIT);
+        shader.setMat4("previousView", previousView);
+        shader.setMat4("previousProjection", previousProjection);
+        shader.setBool("historyValid", historyValid);
+        shader.setInt("refreshPeriod", refreshPeriod);
+        shader.setInt("refreshFrame", frameIndex % refreshPeriod);
+        shader.setFloat("depthTolerance", depthTolerance);
+        shader.setFloat("normalTolerance", normalTolerance);
+    }
+
+    // copies the colour to target (0 for the window) and keeps the frame as the history of
+    // the next one, view and projection are the matrices the frame was drawn with
+    void end(const glm::mat4 &view, const glm::mat4 &projection, GLuint target = 0)
+    {
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffers[current]);
+        glReadBuffer(GL_COLOR_ATTACHMENT0);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, target);
+        glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        previousView = view;
+        previousProjection = projection;
+        historyValid = true;
+        current = 1 - current;
+        frameIndex++;
+    }
+
+    size_t bytes() const
+    {
+        // colour, subsurface and geometry in RGBA16F plus a 32-bit depth buffer, twice
+        return (size_t)width * height * (8 * 3 + 4) * 2;
+    }
+
+    // must be called while the context is still alive
+    void cleanup()
+    {
+        for (int i = 0; i < 2; i++)
+        {
+            if (framebuffers[i] != 0)
+            {
+                glDeleteFramebuffers(1, &framebuffers[i]);
+                glDeleteRenderbuffers(1, &depthBuffers[i]);
+                glDeleteTextures(3, textures[i]);
+            }
+            framebuffers[i] = depthBuffers[i] = 0;
+            for (int k = 0; k < 3; k++)
+                textures[i][k] = 0;
+        }
+        width = height = 0;
+        historyValid = false;
+    }
+
+private:
+    unsigned int width, height;
+    // the framebuffer drawn this frame, the other one holds the history
+    int current;
+    int frameIndex;
+    bool historyValid;
+    glm::mat4 previousView, previousProjection;
+    GLuint framebuffers[2];
+    GLuint depthBuffers[2];
+    // colour, subsurface term, geometry
+    GLuint textures[2][3];
+
+    void resize(unsigned int width, unsigned int height)
+    {
+        cleanup();
+        this->width = width;
+        this->height = height;
+        for (int i = 0; i < 2; i++)
+        {
+            glGenFramebuffers(1, &framebuffers[i]);
+            glBindFramebuffer(GL_FRAMEBUFFER, framebuffers[i]);
+            glGenTextures(3, textures[i]);
+            for (int k = 0; k < 3; k++)
+            {
+                glBindTexture(GL_TEXTURE_2D, textures[i][k]);
+                glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, width, height, 0, GL_RGBA, GL_FLOAT, 0);
+                // nearest so depth and normals are not blended across silhouettes
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+                glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + k, GL_TEXTURE_2D, textures[i][k], 0);
+            }
+            glGenRenderbuffers(1, &depthBuffers[i]);
+            glBindRenderbuffer(GL_RENDERBUFFER, depthBuffers[i]);
+            glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT32F, width, height);
+            glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthBuffers[i]);
+            if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+                std::cout << "Temporal translucency framebuffer not complete!" << std::endl;
+        }
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        current = 0;
+        historyValid = false;
+    }
+};
+#endif
@@ -0,0 +1,146 @@
+#ifndef TEXTURE_CACHE_H
+#define TEXTURE_CACHE_H
+
+#include <glad/glad.h>
+
+#include <climits>
+#include <cstdlib>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// Process-wide registry of textures loaded from files, so a file used by several models is
+// decoded and uploaded once. Entries are keyed by the canonical path plus the load options
+// and reference counted. Unreferenced textures stay resident for reuse until the resident
+// total exceeds the budget, then the least recently released ones are deleted.
+// contains() may be called from any thread, everything else needs the GL thread.
+class TextureCache
+{
+public:
+    static TextureCache &instance()
+    {
+        static TextureCache cache;
+        return cache;
+    }
+
+    // cache key of a file loaded with the given options
+    static std::string key(const std::string &filename, bool gamma)
+    {
+        char resolved[PATH_MAX];
+        std::string path = realpath(filename.c_str(), resolved) ? resolved : filename;
+        return path + (gamma ? "|srgb" : "|linear");
+    }
+
+    bool contains(const std::string &key)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return entries.count(key) != 0;
+    }
+
+    // adds a reference to the cached texture, 0 if there is none
+    unsigned int acquire(const std::string &key)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::unordered_map<std::string, Entry>::iterator it = entries.find(key);
+        if (it == entries.end())
+            return 0;
+        if (it->second.references++ == 0)
+            unused.erase(it->second.unusedPosition);
+        return it->second.texture;
+    }
+
+    // registers a texture made for key, the caller holds the first reference
+    void insert(const std::string &key, unsigned int texture, size_t bytes)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Entry entry;
+        entry.texture = texture;
+        entry.bytes = bytes;
+        entry.references = 1;
+        entries[key] = entry;
+        keys[texture] = key;
+        residentBytes += bytes;
+        evict();
+    }
+
+    // updates the size of a texture inserted before its texels were known
+    void resize(unsigned int texture, size_t bytes)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::unordered_map<unsigned int, std::string>::iterator key = keys.find(texture);
+        if (key == keys.end())
+            return;
+        Entry &entry = entries[key->second];
+        residentBytes += bytes - entry.bytes;
+        entry.bytes = bytes;
+        evict();
+    }
+
+    void release(unsigned int texture)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::unordered_map<unsigned int, std::string>::iterator key = keys.find(texture);
+        if (key == keys.end())
+            return;
+        Entry &entry = entries[key->second];
+        if (entry.references == 0 || --entry.references > 0)
+            return;
+        unused.push_back(key->second);
+        entry.unusedPosition = --unused.end();
+        evict();
+    }
+
+    // GPU memory the cache may keep, textures still referenced are never evicted
+    void setBudget(size_t bytes)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        budget = bytes;
+        evict();
+    }
+
+    size_t bytes()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return residentBytes;
+    }
+
+private:
+    struct Entry {
+        unsigned int texture;
+        size_t bytes;
+        unsigned int references;
+        // position in unused while references is 0
+        std::list<std::string>::iterator unusedPosition;
+    };
+
+    std::mutex mutex;
+    std::unordered_map<std::string, Entry> entries;
+    std::unordered_map<unsigned int, std::string> keys;
+    // unreferenced keys, least recently released first
+    std::list<std::string> unused;
+    size_t residentBytes;
+    size_t budget;
+
+    TextureCache() : residentBytes(0), budget((size_t)512 << 20)
+    {
+        const char *env = getenv("GRANULAR_TEXTURE_BUDGET_MB");
+        if (env != nullptr)
+            budget = (size_t)atol(env) << 20;
+    }
+
+    // called with the lock held
+    void evict()
+    {
+        while (residentBytes > budget && !unused.empty())
+        {
+            Entry &entry = entries[unused.front()];
+            glDeleteTextures(1, &entry.texture);
+            residentBytes -= entry.bytes;
+            keys.erase(entry.texture);
+            entries.erase(unused.front());
+            unused.pop_front();
+        }
+    }
+};
+#endif
@@ -0,0 +1,272 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <glad/glad.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// capacity of every per-thread event ring (power of two), the oldest events are overwritten on wrap
+#define TRACE_RING_CAPACITY (1 << 16)
+// track (Chrome trace "tid") used for GPU timer results, CPU threads are numbered from 1
+#define TRACE_GPU_TRACK 0
+
+// counters accumulated over a frame and emitted by Trace::frameEnd
+enum TraceCounter {
+    TRACE_DRAW_CALLS,
+    TRACE_BYTES_READ_BACK,
+    TRACE_COUNTER_COUNT
+};
+
+struct TraceEvent {
+    // must point to static storage (string literals), it is only dereferenced when dumping
+    const char *name;
+    // nanoseconds since the trace epoch
+    int64_t start;
+    // nanoseconds for zones, the value for counters
+    int64_t duration;
+    uint32_t track;
+    // 'X' complete zone, 'C' counter
+    char phase;
+};
+
+// single producer ring, only the owning thread writes so pushing needs no lock
+class TraceRing
+{
+public:
+    uint32_t track;
+    std::string name;
+
+    TraceRing(uint32_t track, const std::string &name) : track(track), name(name), head(0), events(TRACE_RING_CAPACITY) {}
+
+    void push(const TraceEvent &event)
+    {
+        uint64_t h = head.load(std::memory_order_relaxed);
+        events[h & (TRACE_RING_CAPACITY - 1)] = event;
+        head.store(h + 1, std::memory_order_release);
+    }
+
+    // copies the events currently held in the ring, oldest first
+    void snapshot(std::vector<TraceEvent> &out) const
+    {
+        uint64_t h = head.load(std::memory_order_acquire);
+        uint64_t count = h < TRACE_RING_CAPACITY ? h : TRACE_RING_CAPACITY;
+        for (uint64_t i = h - count; i < h; i++)
+            out.push_back(events[i & (TRACE_RING_CAPACITY - 1)]);
+    }
+
+private:
+    std::atomic<uint64_t> head;
+    std::vector<TraceEvent> events;
+};
+
+// Lightweight CPU/GPU timeline recorder that dumps Chrome trace JSON (loadable in Perfetto
+// or chrome://tracing). While disabled every entry point is a single relaxed atomic load,
+// so the instrumentation can stay in release builds.
+class Trace
+{
+public:
+    static bool enabled()
+    {
+        return flag().load(std::memory_order_relaxed);
+    }
+
+    // starts recording, the trace is written to path by dump()
+    static void start(const std::string &path)
+    {
+        outputPath() = path;
+        epoch();
+        calibrateGpu();
+        flag().store(true, std::memory_order_relaxed);
+    }
+
+    static void stop()
+    {
+        flag().store(false, std::memory_order_relaxed);
+    }
+
+    // nanoseconds since the trace epoch
+    static int64_t now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch()).count();
+    }
+
+    static void setThreadName(const char *name)
+    {
+        ring()->name = name;
+    }
+
+    static void complete(const char *name, int64_t start, int64_t end)
+    {
+        if (!enabled())
+            return;
+        TraceRing *r = ring();
+        TraceEvent event = {name, start, end - start, r->track, 'X'};
+        r->push(event);
+    }
+
+    // records a zone measured with GL_TIMESTAMP queries on the GPU track
+    static void gpuComplete(const char *name, GLuint64 gpuStart, GLuint64 gpuEnd)
+    {
+        if (!enabled())
+            return;
+        int64_t offset = gpuOffset().load(std::memory_order_relaxed);
+        TraceEvent event = {name, (int64_t)gpuStart - offset, (int64_t)(gpuEnd - gpuStart), TRACE_GPU_TRACK, 'X'};
+        ring()->push(event);
+    }
+
+    static void counter(const char *name, int64_t value)
+    {
+        if (!enabled())
+            return;
+        TraceEvent event = {name, now(), value, 0, 'C'};
+        ring()->push(event);
+    }
+
+    static void add(TraceCounter counter, int64_t value)
+    {
+        if (!enabled())
+            return;
+        counters()[counter].fetch_add(value, std::memory_order_relaxed);
+    }
+
+    // emits and resets the per-frame counters and re-syncs the GPU clock, call once per frame
+    static void frameEnd()
+    {
+        if (!enabled())
+            return;
+        static const char *names[TRACE_COUNTER_COUNT] = {"draw calls", "bytes read back"};
+        for (int i = 0; i < TRACE_COUNTER_COUNT; i++)
+            counter(names[i], counters()[i].exchange(0, std::memory_order_relaxed));
+        calibrateGpu();
+    }
+
+    // writes everything recorded so far as Chrome trace JSON
+    static bool dump()
+    {
+        if (outputPath().empty())
+            return false;
+        FILE *file = fopen(outputPath().c_str(), "w");
+        if (!file)
+        {
+            fprintf(stderr, "Trace: could not open %s\n", outputPath().c_str());
+            return false;
+        }
+        fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+        fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"GPU\"}}", TRACE_GPU_TRACK);
+
+        std::lock_guard<std::mutex> lock(registryMutex());
+        std::vector<TraceEvent> events;
+        for (unsigned int i = 0; i < registry().size(); i++)
+        {
+            TraceRing *r = registry()[i];
+            fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}", r->track, r->name.c_str());
+            events.clear();
+            r->snapshot(events);
+            for (unsigned int j = 0; j < events.size(); j++)
+            {
+                const TraceEvent &e = events[j];
+                if (e.phase == 'X')
+                    fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+                            e.name, e.track == TRACE_GPU_TRACK ? "gpu" : "cpu", e.track, e.start / 1000.0, e.duration / 1000.0);
+                else
+                    fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"C\",\"pid\":1,\"ts\":%.3f,\"args\":{\"value\":%lld}}",
+                            e.name, e.start / 1000.0, (long long)e.duration);
+            }
+        }
+        fprintf(file, "\n]}\n");
+        fclose(file);
+        printf("Saved trace file. [ %s ] \n", outputPath().c_str());
+        return true;
+    }
+
+private:
+    static std::atomic<bool> &flag()
+    {
+        static std::atomic<bool> value(false);
+        return value;
+    }
+
+    static std::string &outputPath()
+    {
+        static std::string path;
+        return path;
+    }
+
+    static std::chrono::steady_clock::time_point epoch()
+    {
+        static std::chrono::steady_clock::time_point value = std::chrono::steady_clock::now();
+        return value;
+    }
+
+    // GPU timestamp minus trace time, in nanoseconds
+    static std::atomic<int64_t> &gpuOffset()
+    {
+        static std::atomic<int64_t> value(0);
+        return value;
+    }
+
+    // must be called from a thread with a current GL context
+    static void calibrateGpu()
+    {
+        GLint64 gpuNow = 0;
+        glGetInteger64v(GL_TIMESTAMP, &gpuNow);
+        gpuOffset().store(gpuNow - now(), std::memory_order_relaxed);
+    }
+
+    static std::atomic<int64_t> *counters()
+    {
+        static std::atomic<int64_t> values[TRACE_COUNTER_COUNT];
+        return values;
+    }
+
+    static std::mutex &registryMutex()
+    {
+        static std::mutex value;
+        return value;
+    }
+
+    // rings are never freed so that events of finished threads survive until the dump
+    static std::vector<TraceRing *> &registry()
+    {
+        static std::vector<TraceRing *> value;
+        return value;
+    }
+
+    // the calling thread's ring, registered on first use (the only time a lock is taken)
+    static TraceRing *ring()
+    {
+        static thread_local TraceRing *local = nullptr;
+        if (!local)
+        {
+            std::lock_guard<std::mutex> lock(registryMutex());
+            uint32_t track = (uint32_t)registry().size() + 1;
+            local = new TraceRing(track, track == 1 ? "main" : "worker " + std::to_string(track - 1));
+            registry().push_back(local);
+        }
+        return local;
+    }
+};
+
+// records the enclosing scope as a CPU zone
+class TraceScope
+{
+public:
+    TraceScope(const char *name) : name(name), active(Trace::enabled()), start(active ? Trace::now() : 0) {}
+    ~TraceScope()
+    {
+        if (active)
+            Trace::complete(name, start, Trace::now());
+    }
+
+private:
+    const char *name;
+    bool active;
+    int64_t start;
+};
+#endif
@@ -0,0 +1,234 @@
+#ifndef TRANSLUCENCY_CACHE_H
+#define TRANSLUCENCY_CACHE_H
+
+#include <glad/glad.h>
+
+#include <glm/glm.hpp>
+
+#include "shader.h"
+#include "model.h"
+#include "mesh.h"
+#include "grain_transfer.h"
+#include "profiler.h"
+#include "trace.h"
+
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+// texture unit of the cache, after the transfer, thickness map and point cloud units
+#define TRANSLUCENCY_CACHE_UNIT (PRT_TRANSFER_UNIT + 3)
+// gap in texels between a triangle and the edges of its half of an atlas cell
+#define CACHE_TRIANGLE_MARGIN 1.5f
+
+// Texture-space cache of the subsurface term of the lights for one object. The grain meshes'
+// own texture coordinates overlap, so build() lays the triangles out in an atlas of their own,
+// two per square cell, and keeps them as an unindexed copy of the model whose TexCoords are
+// the atlas. render() redraws the atlas with the TRANSLUCENCY_CACHE_BAKE variant of model3
+// only after invalidate() (lights or geometry changed) and grows it past the triangle edges
+// (cacheDilate.fs); the view pass then draws the atlas mesh with TRANSLUCENCY_CACHE, which
+// reads the cache instead of gathering and adds only the exit Fresnel term and specular.
+class TranslucencyCache
+{
+public:
+    TranslucencyCache() : size(0), vertexCount(0), vao(0), vbo(0), emptyVAO(0), dirty(true)
+    {
+        framebuffers[0] = framebuffers[1] = 0;
+        textures[0] = textures[1] = 0;
+    }
+
+    ~TranslucencyCache()
+    {
+        cleanup();
+    }
+
+    bool built() const { return vao != 0; }
+
+    // built and drawn since the last invalidate()
+    bool current() const { return built() && !dirty; }
+
+    // call after changing the lights or the geometry, the next render() redraws the cache
+    void invalidate() { dirty = true; }
+
+    // lays out the triangles of model in a size x size atlas and creates the cache
+    void build(const Model &model, unsigned int size = 2048)
+    {
+        TraceScope trace("build translucency cache");
+        cleanup();
+        this->size = size;
+        std::vector<Vertex> vertices;
+        for (unsigned int m = 0; m < model.meshes.size(); m++)
+        {
+            const Mesh &mesh = model.meshes[m];
+            for (unsigned int j = 0; j + 2 < mesh.indices.size(); j += 3)
+                for (int k = 0; k < 3; k++)
+                    vertices.push_back(mesh.vertices[mesh.indices[j + k]]);
+        }
+        unsigned int triangles = vertices.size() / 3;
+        if (triangles == 0)
+            return;
+
+        unsigned int cells = (triangles + 1) / 2;
+        unsigned int perRow = (unsigned int)std::ceil(std::sqrt((float)cells));
+        float cell = (float)size / perRow;
+        float m = CACHE_TRIANGLE_MARGIN;
+        if (cell < 6.0f * m)
+            std::cout << "Translucency cache of " << size << " texels is too small for " << triangles << " triangles" << std::endl;
+        // the lower left and upper right half of a cell, in texels from its corner
+        const glm::vec2 halves[2][3] = {
+            {glm::vec2(m, m), glm::vec2(cell - 2.0f * m, m), glm::vec2(m, cell - 2.0f * m)},
+            {glm::vec2(cell - m, cell - m), glm::vec2(2.0f * m, cell - m), glm::vec2(cell - m, 2.0f * m)}};
+        for (unsigned int t = 0; t < triangles; t++)
+        {
+            unsigned int c = t / 2;
+            glm::vec2 corner = glm::vec2(c % perRow, c / perRow) * cell;
+            for (int k = 0; k < 3; k++)
+                vertices[t * 3 + k].TexCoords = (corner + halves[t % 2][k]) / (float)size;
+        }
+        vertexCount = vertices.size();
+
+        glGenVertexArrays(1, &vao);
+        glGenBuffers(1, &vbo);
+        glBindVertexArray(vao);
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), &vertices[0], GL_STATIC_DRAW);
+        Mesh::setupVertexAttributes();
+        glBindVertexArray(0);
+
+        // baked into 0, dilated into 1 and back into 0
+        glGenTextures(2, textures);
+        glGenFramebuffers(2, framebuffers);
+        for (int i = 0; i < 2; i++)
+        {
+            glBindTexture(GL_TEXTURE_2D, textures[i]);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, size, size, 0, GL_RGBA, GL_FLOAT, 0);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glBindFramebuffer(GL_FRAMEBUFFER, framebuffers[i]);
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, textures[i], 0);
+            if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+                std::cout << "Translucency cache framebuffer not complete!" << std::endl;
+        }
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        glGenVertexArrays(1, &emptyVAO);
+        dirty = true;
+    }
+
+    // attach a buffer of per-instance glm::mat4 model matrices at attribute locations 7-10,
+    // like Mesh::setInstanceBuffer; the cache holds a single object, so only instance 0 is used
+    void setInstanceBuffer(unsigned int buffer)
+    {
+        glBindVertexArray(vao);
+        glBindBuffer(GL_ARRAY_BUFFER, buffer);
+        for (unsigned int i = 0; i < 4; i++)
+        {
+            glEnableVertexAttribArray(7 + i);
+            glVertexAttribPointer(7 + i, 4, GL_FLOAT, GL_FALSE, sizeof(glm::mat4), (void*)(i * sizeof(glm::vec4)));
+            glVertexAttribDivisor(7 + i, 1);
+        }
+        glBindVertexArray(0);
+    }
+
+    // redraws the cache if it was invalidated; shader is the TRANSLUCENCY_CACHE_BAKE variant
+    // with its light inputs and model matrix set, dilateShader fullscreen.vs with cacheDilate.fs
+    void render(Shader &shader, Shader &dilateShader, PassProfiler &profiler)
+    {
+        if (!dirty || !built())
+            return;
+        ProfileScope scope(profiler, "translucency cache");
+        GLint viewport[4];
+        glGetIntegerv(GL_VIEWPORT, viewport);
+        glViewport(0, 0, size, size);
+        glDisable(GL_DEPTH_TEST);
+        glDisable(GL_CULL_FACE);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffers[0]);
+        glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+        glClear(GL_COLOR_BUFFER_BIT);
+        glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+        Draw(shader);
+
+        dilateShader.use();
+        dilateShader.setInt("cache", 0);
+        glBindVertexArray(emptyVAO);
+        for (int pass = 0; pass < 2; pass++)
+        {
+            glBindFramebuffer(GL_FRAMEBUFFER, framebuffers[1 - pass]);
+            glActiveTexture(GL_TEXTURE0);
+            glBindTexture(GL_TEXTURE_2D, textures[pass]);
+            glDrawArrays(GL_TRIANGLES, 0, 3);
+        }
+        glBindVertexArray(0);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glEnable(GL_DEPTH_TEST);
+        glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+        dirty = false;
+    }
+
+    // draws the atlas mesh, the view pass must use it instead of the model
+    void Draw(Shader &shader)
+    {
+        shader.use();
+        glBindVertexArray(vao);
+        glDrawArrays(GL_TRIANGLES, 0, vertexCount);
+        Trace::add(TRACE_DRAW_CALLS, 1);
+        glBindVertexArray(0);
+    }
+
+    // as Draw, for the instanced shaders once setInstanceBuffer was called
+    void DrawInstanced(Shader &shader)
+    {
+        shader.use();
+        glBindVertexArray(vao);
+        glDrawArraysInstanced(GL_TRIANGLES, 0, vertexCount, 1);
+        Trace::add(TRACE_DRAW_CALLS, 1);
+        glBindVertexArray(0);
+    }
+
+    // binds the cache to TRANSLUCENCY_CACHE_UNIT and sets the shader's sampler
+    void bind(Shader &shader) const
+    {
+        glActiveTexture(GL_TEXTURE0 + TRANSLUCENCY_CACHE_UNIT);
+        glBindTexture(GL_TEXTURE_2D, textures[0]);
+        glActiveTexture(GL_TEXTURE0);
+        shader.setInt("translucencyCache", TRANSLUCENCY_CACHE_UNIT);
+    }
+
+    size_t bytes() const
+    {
+        return built() ? (size_t)size * size * 8 * 2 + (size_t)vertexCount * sizeof(Vertex) : 0;
+    }
+
+    // must be called while the context is still alive
+    void cleanup()
+    {
+        if (vao != 0)
+        {
+            glDeleteVertexArrays(1, &vao);
+            glDeleteBuffers(1, &vbo);
+            glDeleteVertexArrays(1, &emptyVAO);
+            glDeleteTextures(2, textures);
+            glDeleteFramebuffers(2, framebuffers);
+        }
+        vao = vbo = emptyVAO = 0;
+        framebuffers[0] = framebuffers[1] = 0;
+        textures[0] = textures[1] = 0;
+        vertexCount = 0;
+        dirty = true;
+    }
+
+private:
+    unsigned int size;
+    unsigned int vertexCount;
+    GLuint vao, vbo;
+    // the dilate pass is made from gl_VertexID, core profiles still need a VAO
+    GLuint emptyVAO;
+    GLuint framebuffers[2];
+    GLuint textures[2];
+    bool dirty;
+};
+#endif